@@ -16,6 +16,12 @@ lm:lua_dll "math3d"{
         "GLM_FORCE_QUAT_DATA_XYZW",
         "GLM_FORCE_INTRINSICS",
     },
+    gcc = {
+        flags = { "-ffp-contract=off" },
+    },
+    clang = {
+        flags = { "-ffp-contract=off" },
+    },
     visibility = "default",
     cxx = "c++20",
 }
\ No newline at end of file
@@ -16,19 +16,28 @@
 #include "mathid.h"	
 #include "math3d.h"
 #include "math3dfunc.h"
+#include "math3dexpr.h"
+#include "math3dcmd.h"
 
 #define MAT_PERSPECTIVE 0
 #define MAT_ORTHO 1
 
 struct refobject {
 	math_t id;
+	uint32_t version;	// increased when the value changes
+	uint32_t computed;	// the uservalue 1 is a struct computed_ref
+};
+
+#define COMPUTED_MAXINPUT MATH3D_EXPR_MAXINPUT
+
+struct computed_ref {
+	struct math3d_expr e;
+	uint32_t version[COMPUTED_MAXINPUT];	// the versions of the input refs at the last update
 };
 
 #define FLAG_HOMOGENEOUS_DEPTH 0
 #define FLAG_ORIGIN_BOTTOM_LEFT 1
 
-#ifdef MATHIDSOURCE
-
 typedef math_t (*mark_func)(struct math_context *, math_t id, const char *filename, int line);
 
 static math_t
@@ -60,11 +69,14 @@ lua_math_mark_(lua_State *L, mark_func mark, struct math_context *M, math_t id,
 	}
 	return mark(M, id, filename, line);
 }
+
+#ifdef MATHIDSOURCE
 #define lua_math_mark(L, M, id) lua_math_mark_(L, math_mark_, M, id, __FILE__, __LINE__)
 #define lua_math_clone(L, M, id) lua_math_mark_(L, math_clone_, M, id, __FILE__, __LINE__)
 #else
-#define lua_math_mark(L, M, id) math_mark_(M, id, __FILE__, __LINE__)
-#define lua_math_clone(L, M, id) math_clone_(M, id, __FILE__, __LINE__)
+// look up the lua source only when the profiler samples the next mark
+#define lua_math_mark(L, M, id) (math_profile_pending(M) ? lua_math_mark_(L, math_mark_, M, id, __FILE__, __LINE__) : math_mark_(M, id, __FILE__, __LINE__))
+#define lua_math_clone(L, M, id) (math_profile_pending(M) ? lua_math_mark_(L, math_clone_, M, id, __FILE__, __LINE__) : math_clone_(M, id, __FILE__, __LINE__))
 #endif
 
 static size_t
@@ -125,6 +137,73 @@ refobj_meta(lua_State *L) {
 	return M->refmeta;
 }
 
+static const void *
+cmdbuf_meta(lua_State *L) {
+	struct math3d_api *M = lua_touserdata(L, lua_upvalueindex(1));
+	return M->cmdbufmeta;
+}
+
+// The uservalues of struct computed_ref are the inputs : ref objects, marked ids (marked again by the computed ref) or numbers.
+// Computed refs in the inputs are updated first, then the expression is evaluated again if any version changed.
+static void
+update_computed(lua_State *L, struct math_context *M, struct refobject *R, int index) {
+	luaL_checkstack(L, 4, NULL);
+	lua_getiuservalue(L, index, 1);
+	int cindex = lua_gettop(L);
+	struct computed_ref *c = (struct computed_ref *)lua_touserdata(L, cindex);
+	struct math3d_expr_arg input[COMPUTED_MAXINPUT];
+	// committed only after a successful evaluation, so a failed one is retried on the next read
+	uint32_t version[COMPUTED_MAXINPUT];
+	int dirty = math_isnull(R->id);
+	int i;
+	for (i=0;i<c->e.ninput;i++) {
+		int t = lua_getiuservalue(L, cindex, i+1);
+		version[i] = c->version[i];
+		if (t == LUA_TUSERDATA) {
+			struct refobject *in = (struct refobject *)lua_touserdata(L, -1);
+			if (in->computed)
+				update_computed(L, M, in, lua_gettop(L));
+			if (in->version != c->version[i]) {
+				version[i] = in->version;
+				dirty = 1;
+			}
+			input[i].id = in->id;
+			input[i].n = 0;
+		} else if (t == LUA_TLIGHTUSERDATA) {
+			input[i].id = HANDLE_TO_MATH(lua_touserdata(L, -1));
+			input[i].n = 0;
+		} else {
+			input[i].id = MATH_NULL;
+			input[i].n = lua_tonumber(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	if (dirty) {
+		math_t result;
+		double n;
+		const char *err = math3d_expr_eval(M, &c->e, input, &result, &n);
+		if (err)
+			luaL_error(L, "Computed ref : %s", err);
+		if (math_isnull(result))
+			luaL_error(L, "Computed ref : the result is a number");
+		math_t oid = R->id;
+		R->id = lua_math_mark(L, M, result);
+		if (!math_isnull(oid))
+			math_unmark(M, oid);
+		memcpy(c->version, version, c->e.ninput * sizeof(uint32_t));
+		++R->version;
+	}
+	lua_settop(L, cindex - 1);
+}
+
+static inline math_t
+refobject_id(lua_State *L, struct math_context *M, int index) {
+	struct refobject *R = (struct refobject *)lua_touserdata(L, index);
+	if (R->computed)
+		update_computed(L, M, R, index);
+	return R->id;
+}
+
 static math_t
 get_id_withtype(lua_State *L, struct math_context *M, int index, int ltype) {
 	if (ltype == LUA_TLIGHTUSERDATA) {
@@ -135,8 +214,7 @@ get_id_withtype(lua_State *L, struct math_context *M, int index, int ltype) {
 		return id;
 	} else if (lua_getmetatable(L, index) && lua_topointer(L, -1) == refobj_meta(L)) {
 		lua_pop(L, 1);	// pop metatable
-		struct refobject * ref = lua_touserdata(L, index);
-		return ref->id;
+		return refobject_id(L, M, index);
 	}
 	luaL_argerror(L, index, "Need ref userdata");
 	return MATH_NULL;
@@ -160,8 +238,7 @@ get_id_api(lua_State *L, struct math_context *M, int index) {
 		if (lua_rawlen(L, index) != sizeof(struct refobject)) {
 			luaL_argerror(L, index, "Invalid ref userdata");
 		}
-		struct refobject * ref = lua_touserdata(L, index);
-		return ref->id;
+		return refobject_id(L, M, index);
 	}
 	luaL_argerror(L, index, "Need ref userdata");
 	return MATH_NULL;
@@ -173,6 +250,8 @@ lref(lua_State *L) {
 	math_refcount(M, 1);
 	lua_settop(L, 1);
 	struct refobject * R = (struct refobject *)lua_newuserdatauv(L, sizeof(struct refobject), 0);
+	R->version = 0;
+	R->computed = 0;
 	if (lua_isnil(L, 1)) {
 		R->id = MATH_NULL;
 	} else {
@@ -427,6 +506,8 @@ ref_set_key(lua_State *L){
 	const char *key = luaL_checkstring(L, 2);
 	struct math_context *M = GETMC(L);
 	math_t oid = R->id;
+	if (R->computed)
+		return luaL_error(L, "Computed ref is read only");
 	switch(key[0]) {
 	case 'v':	// should be vector
 		R->id = assign_vector(L, M, 3);
@@ -441,6 +522,7 @@ ref_set_key(lua_State *L){
 		return luaL_error(L, "Invalid set key %s with ref object", key); 
 	}
 	unmark_check(M, oid);
+	++R->version;
 	return 0;
 }
 
@@ -451,9 +533,12 @@ ref_set_number(lua_State *L){
 	struct refobject *R = lua_touserdata(L, 1);
 	struct math_context *M = GETMC(L);
 	math_t oid = R->id;
+	if (R->computed)
+		return luaL_error(L, "Computed ref is read only");
 
 	R->id = lua_math_mark(L, M, set_index_object(L, M, oid));
 	unmark_check(M, oid);
+	++R->version;
 
 	return 0;
 }
@@ -516,11 +601,16 @@ ref_get_key(lua_State *L) {
 	struct refobject *R = lua_touserdata(L, 1);
 	struct math_context * M = GETMC(L);
 	const char *key = lua_tostring(L, 2);
+	refobject_id(L, M, 1);
 	switch(key[0]) {
 	case 'i':
 		lua_pushmath(L, R->id);
 		break;
 	case 'p':
+		if (R->computed)
+			return luaL_error(L, "Computed ref is read only");
+		// the value may be written through the pointer
+		++R->version;
 		lua_pushlightuserdata(L, math_init(M, R->id));
 		break;
 	case 'v':
@@ -567,10 +657,9 @@ index_object(lua_State *L, struct math_context *M, math_t id, int idx) {
 
 static int
 ref_get_number(lua_State *L) {
-	struct refobject *R = lua_touserdata(L, 1);
 	struct math_context *M = GETMC(L);
 	int idx = (int)lua_tointeger(L, 2);
-	return index_object(L, M, R->id, idx);
+	return index_object(L, M, refobject_id(L, M, 1), idx);
 }
 
 static int
@@ -664,8 +753,7 @@ id_tostring(lua_State *L, math_t id) {
 
 static int
 lref_tostring(lua_State *L) {
-	struct refobject *R = lua_touserdata(L, 1);
-	return id_tostring(L, R->id);
+	return id_tostring(L, refobject_id(L, GETMC(L), 1));
 }
 
 static int
@@ -701,10 +789,28 @@ lserialize(lua_State *L) {
 	return serialize_id(L, M, id);
 }
 
+static void
+computed_gc(lua_State *L, struct math_context *M) {
+	lua_getiuservalue(L, 1, 1);
+	struct computed_ref *c = (struct computed_ref *)lua_touserdata(L, -1);
+	int i;
+	for (i=0;i<c->e.ninput;i++) {
+		if (lua_getiuservalue(L, -1, i+1) == LUA_TLIGHTUSERDATA) {
+			unmark_check(M, HANDLE_TO_MATH(lua_touserdata(L, -1)));
+			lua_pushnil(L);
+			lua_setiuservalue(L, -3, i+1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
 static int
 lref_gc(lua_State *L) {
 	struct refobject *R = lua_touserdata(L, 1);
 	struct math_context *M = GETMC(L);
+	if (R->computed)
+		computed_gc(L, M);
 	unmark_check(M, R->id);
 	math_refcount(M, -1);
 	R->id = MATH_NULL;
@@ -1017,18 +1123,43 @@ lmarked_quat(lua_State *L) {
 	return marked_ctor(L, lquaternion_);
 }
 
-static int
-larray_matrix_ref(lua_State *L) {
-	struct math_context *M = GETMC(L);
-	float *ptr = (float *)lua_touserdata(L, 1);
+// [stride] at arg, [offset] at arg+1, both in bytes, stride 0 : packed.
+// index is the first element, counted in stride
+static math_t
+array_ref(lua_State *L, struct math_context *M, int type, int flags, int arg, lua_Integer index) {
+	const char *ptr = (const char *)lua_touserdata(L, 1);
 	if (ptr == NULL) {
-		return luaL_error(L, "Invalid pointer (type = %s)", lua_typename(L, lua_type(L, 1)));
+		luaL_error(L, "Invalid pointer (type = %s)", lua_typename(L, lua_type(L, 1)));
 	}
 	int sz = (int)luaL_checkinteger(L, 2);
-	int off = (int)luaL_optinteger(L, 3, 0);
-	ptr += off * 16;
-	math_t id = math_ref(M, ptr, MATH_TYPE_MAT, sz);
-	lua_pushmath(L, id);
+	lua_Integer stride = luaL_optinteger(L, arg, 0);
+	lua_Integer off = luaL_optinteger(L, arg + 1, 0);
+	int elem = (type == MATH_TYPE_MAT ? 16 : (flags & MATH_REF_VEC3) ? 3 : 4) * (int)sizeof(float);
+	if (sz <= 0)
+		luaL_error(L, "Invalid size %d", sz);
+	if (stride != 0 && (stride < elem || stride >= (1 << 24)))
+		luaL_error(L, "Invalid stride %d", (int)stride);
+	if (off < 0 || index < 0)
+		luaL_error(L, "Invalid offset %d", (int)(index < 0 ? index : off));
+	return math_ref_stride(M, ptr + off + index * (stride ? stride : elem), type, sz, (int)stride, flags);
+}
+
+// ptr, size, [offset], [stride], [byte offset]
+// offset counts matrices, stride and byte offset are in bytes
+static int
+larray_matrix_ref(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	lua_Integer index = luaL_optinteger(L, 3, 0);
+	lua_pushmath(L, array_ref(L, M, MATH_TYPE_MAT, 0, 4, index));
+	return 1;
+}
+
+// ptr, size, [stride], [offset], [vec3]
+// stride and offset are in bytes
+static int
+larray_vector_ref(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	lua_pushmath(L, array_ref(L, M, MATH_TYPE_VEC4, lua_toboolean(L, 5) ? MATH_REF_VEC3 : 0, 3, 0));
 	return 1;
 }
 
@@ -1184,6 +1315,56 @@ lsrt(lua_State *L) {
 	return 3;	
 }
 
+// s, r, t arrays (size n or 1, nil : identity), [output ref], returns matrix array
+static int
+lmake_srt_array(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	static const int types[3] = { MATH_TYPE_VEC4, MATH_TYPE_QUAT, MATH_TYPE_VEC4 };
+	math_t srt[3];
+	int n = 1;
+	int i;
+	for (i=0;i<3;i++) {
+		if (lua_isnoneornil(L, i+1)) {
+			srt[i] = MATH_NULL;
+		} else {
+			srt[i] = array_from_index(L, M, i+1, types[i]);
+			int sz = math_size(M, srt[i]);
+			if (sz > 1) {
+				if (n > 1 && sz != n)
+					return luaL_error(L, "Array size mismatch %d != %d", sz, n);
+				n = sz;
+			}
+		}
+	}
+	math_t output = MATH_NULL;
+	if (!lua_isnoneornil(L, 4)) {
+		output = get_id(L, M, 4);
+		if (!math_isref(M, output))
+			return luaL_error(L, "Output is not ref");
+		int t = math_type(M, output);
+		if (t != MATH_TYPE_MAT)
+			return luaL_error(L, "Output is not matrix, it's %s", math_typename(t));
+		if (math_size(M, output) < n)
+			return luaL_error(L, "Output is too short (%d < %d)", math_size(M, output), n);
+	}
+	lua_pushmath(L, math3d_make_srt_array(M, srt[0], srt[1], srt[2], output));
+	return 1;
+}
+
+// matrix array -> s, r, t arrays
+static int
+ldecompose_array(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	math_t mat = array_from_index(L, M, 1, MATH_TYPE_MAT);
+	math_t r[3];
+	math3d_decompose_matrix_array(M, mat, r);
+	int i;
+	for (i=0;i<3;i++) {
+		lua_pushmath(L, r[i]);
+	}
+	return 3;
+}
+
 static int
 llength(lua_State *L) {
 	struct math_context *M = GETMC(L);
@@ -1697,6 +1878,139 @@ lslerp(lua_State *L) {
 	return 1;
 }
 
+// a, b (vec4 or quat arrays, size n or 1), weight (number, table or string of floats), [output ref], ["lerp" | "slerp" | "add"]
+// lerp is nlerp for quat, add : a + b * w for vec4, a * nlerp(identity, b, w) for quat.
+static int
+lblend_array(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	math_t a = get_id(L, M, 1);
+	int type = math_type(M, a);
+	if (type != MATH_TYPE_VEC4 && type != MATH_TYPE_QUAT)
+		return luaL_error(L, "%s type can not for blend", math_typename(type));
+	math_t b = array_from_index(L, M, 2, type);
+	int n = math_size(M, a);
+	int sz = math_size(M, b);
+	if (n != sz && n != 1 && sz != 1)
+		return luaL_error(L, "Array size mismatch %d != %d", n, sz);
+	if (sz > n)
+		n = sz;
+	const float *weight;
+	int nweight;
+	float w;
+	switch (lua_type(L, 3)) {
+	case LUA_TNUMBER:
+		w = (float)lua_tonumber(L, 3);
+		weight = &w;
+		nweight = 1;
+		break;
+	case LUA_TSTRING: {
+		size_t len;
+		weight = (const float *)lua_tolstring(L, 3, &len);
+		nweight = (int)(len / sizeof(float));
+		break;
+	}
+	case LUA_TTABLE: {
+		int i;
+		nweight = (int)lua_rawlen(L, 3);
+		float *tmp = (float *)lua_newuserdatauv(L, (nweight > 0 ? nweight : 1) * sizeof(float), 0);
+		for (i=0;i<nweight;i++) {
+			lua_geti(L, 3, i+1);
+			tmp[i] = (float)luaL_checknumber(L, -1);
+			lua_pop(L, 1);
+		}
+		weight = tmp;
+		break;
+	}
+	default:
+		return luaL_error(L, "Invalid weight (type = %s)", lua_typename(L, lua_type(L, 3)));
+	}
+	if (nweight != 1 && nweight < n)
+		return luaL_error(L, "Need %d weights (%d)", n, nweight);
+	math_t output = MATH_NULL;
+	if (!lua_isnoneornil(L, 4)) {
+		output = get_id(L, M, 4);
+		if (!math_isref(M, output))
+			return luaL_error(L, "Output is not ref");
+		if (math_type(M, output) != type)
+			return luaL_error(L, "Output is not %s, it's %s", math_typename(type), math_typename(math_type(M, output)));
+		struct math_view view;
+		math_view(M, output, &view);
+		if (view.vec3)
+			return luaL_error(L, "Output can't be vec3");
+		if (view.size < n)
+			return luaL_error(L, "Output is too short (%d < %d)", view.size, n);
+	}
+	const char *mode = luaL_optstring(L, 5, "lerp");
+	int blend;
+	if (strcmp(mode, "lerp") == 0) {
+		blend = MATH3D_BLEND_LERP;
+	} else if (strcmp(mode, "slerp") == 0) {
+		blend = MATH3D_BLEND_SLERP;
+	} else if (strcmp(mode, "add") == 0) {
+		blend = MATH3D_BLEND_ADDITIVE;
+	} else {
+		return luaL_error(L, "Invalid mode %s", mode);
+	}
+	lua_pushmath(L, math3d_blend_array(M, blend, a, b, weight, nweight, output));
+	return 1;
+}
+
+static int
+lexpr_call(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	const struct math3d_expr *e = (const struct math3d_expr *)lua_touserdata(L, lua_upvalueindex(2));
+	struct math3d_expr_arg input[MATH3D_EXPR_MAXINPUT];
+	int i;
+	if (lua_gettop(L) != e->ninput)
+		return luaL_error(L, "Need %d inputs (%d)", e->ninput, lua_gettop(L));
+	for (i=0;i<e->ninput;i++) {
+		if (lua_type(L, i+1) == LUA_TNUMBER) {
+			input[i].id = MATH_NULL;
+			input[i].n = lua_tonumber(L, i+1);
+		} else {
+			input[i].id = get_id(L, M, i+1);
+			input[i].n = 0;
+		}
+	}
+	math_t result;
+	double n;
+	const char *err = math3d_expr_eval(M, e, input, &result, &n);
+	if (err)
+		return luaL_error(L, "%s", err);
+	if (math_isnull(result)) {
+		lua_pushnumber(L, n);
+	} else {
+		lua_pushmath(L, result);
+	}
+	return 1;
+}
+
+// expr, [input names ...] : returns the compiled function, and the names of inputs in order
+static int
+lcompile(lua_State *L) {
+	const char *source = luaL_checkstring(L, 1);
+	int nname = lua_gettop(L) - 1;
+	const char *names[MATH3D_EXPR_MAXINPUT];
+	int i;
+	if (nname > MATH3D_EXPR_MAXINPUT)
+		return luaL_error(L, "Too many inputs (%d)", nname);
+	for (i=0;i<nname;i++) {
+		names[i] = luaL_checkstring(L, i+2);
+	}
+	struct math3d_expr *e = (struct math3d_expr *)lua_newuserdatauv(L, sizeof(*e), 0);
+	char err[128];
+	if (math3d_expr_compile(e, source, nname, names, err))
+		return luaL_error(L, "%s", err);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, -2);
+	lua_pushcclosure(L, lexpr_call, 2);
+	luaL_checkstack(L, e->ninput, NULL);
+	for (i=0;i<e->ninput;i++) {
+		lua_pushstring(L, e->input[i]);
+	}
+	return e->ninput + 1;
+}
+
 static int
 lmemsize(lua_State *L) {
 	struct math_context *M = GETMC(L);
@@ -1711,6 +2025,46 @@ lset_homogeneous_depth(lua_State *L) {
 	return 0;
 }
 
+static int
+lset_transient_retention(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	int frames = (int)luaL_checkinteger(L, 1);
+	if (frames < 0)
+		return luaL_error(L, "Invalid retention frames %d", frames);
+	math_set_transient_retention(M, frames);
+	return 0;
+}
+
+static int
+lset_compaction(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	int budget = (int)luaL_checkinteger(L, 1);
+	if (budget < 0)
+		return luaL_error(L, "Invalid compaction budget %d", budget);
+	math_set_compaction(M, budget);
+	return 0;
+}
+
+// [level name] : limit the simd level of the kernels, returns the current one and the best supported.
+// The level is shared by all the lua states (and threads) in the process.
+static int
+lsimd(lua_State *L) {
+	if (!lua_isnoneornil(L, 1)) {
+		const char *name = luaL_checkstring(L, 1);
+		int level;
+		for (level = MATH3D_SIMD_NONE; level <= MATH3D_SIMD_AVX512; level++) {
+			if (strcmp(name, math3d_simd_name(level)) == 0)
+				break;
+		}
+		if (level > MATH3D_SIMD_AVX512)
+			return luaL_error(L, "Invalid simd level %s", name);
+		math3d_simd(level);
+	}
+	lua_pushstring(L, math3d_simd_name(math3d_simd(-1)));
+	lua_pushstring(L, math3d_simd_name(math3d_simd_support()));
+	return 2;
+}
+
 static int
 lset_origin_bottom_left(lua_State *L){
 	struct math_context *M = GETMC(L);
@@ -2108,6 +2462,67 @@ lfrustum_intersect_aabb_list(lua_State *L) {
 	return 1;
 }
 
+// planes, aabbs (vec4 array / ref / string of min,max pairs), [output pointer], ["mask" or "index"]
+// Write the visibility bitmask (uint32_t[(n+31)/32]) or the 0-based index list (uint32_t[n]) into output,
+// returns the number of visible aabbs, and the output as a string if the output pointer is absent.
+static int
+lfrustum_cull(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	math_t planes = box_planes_from_index(L, M, 1);
+	const float *aabb;
+	int stride;
+	int n;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		size_t sz;
+		aabb = (const float *)lua_tolstring(L, 2, &sz);
+		stride = 8 * sizeof(float);
+		if (sz % stride != 0)
+			return luaL_error(L, "Invalid aabbs size %d", (int)sz);
+		n = (int)(sz / stride);
+	} else {
+		math_t id = get_id(L, M, 2);
+		if (math_type(M, id) != MATH_TYPE_VEC4)
+			return luaL_error(L, "Need vec4 array for aabbs");
+		struct math_view view;
+		math_view(M, id, &view);
+		// the kernels read max right after min
+		if (view.vec3 || view.stride != 4 * sizeof(float))
+			return luaL_error(L, "Need packed vec4 array for aabbs");
+		if (view.size % 2 != 0)
+			return luaL_error(L, "Need (min, max) pairs for aabbs, size = %d", view.size);
+		aabb = view.ptr;
+		stride = view.stride * 2;
+		n = view.size / 2;
+	}
+	void *output = lua_touserdata(L, 3);
+	if (output == NULL && !lua_isnoneornil(L, 3))
+		return luaL_error(L, "Invalid output buffer (type = %s)", lua_typename(L, lua_type(L, 3)));
+	const char *mode = luaL_optstring(L, 4, "mask");
+	int index_mode;
+	if (strcmp(mode, "mask") == 0) {
+		index_mode = 0;
+	} else if (strcmp(mode, "index") == 0) {
+		index_mode = 1;
+	} else {
+		return luaL_error(L, "Invalid mode %s", mode);
+	}
+	size_t output_sz = index_mode ? n * sizeof(uint32_t) : (n + 31) / 32 * sizeof(uint32_t);
+	if (output == NULL) {
+		output = lua_newuserdatauv(L, output_sz > 0 ? output_sz : 1, 0);
+	} else if (lua_type(L, 3) == LUA_TUSERDATA && lua_rawlen(L, 3) < output_sz) {
+		return luaL_error(L, "Output buffer is too small (%d < %d)", (int)lua_rawlen(L, 3), (int)output_sz);
+	}
+	uint32_t *buffer = (uint32_t *)output;
+	int count = math3d_frustum_cull_aabb(math_value(M, planes), aabb, stride, n,
+		index_mode ? NULL : buffer, index_mode ? buffer : NULL);
+	lua_pushinteger(L, count);
+	if (lua_isnoneornil(L, 3)) {
+		lua_pushlstring(L, (const char *)buffer, index_mode ? count * sizeof(uint32_t) : output_sz);
+		return 2;
+	}
+	return 1;
+}
+
 static int
 lfrustum_test_point(lua_State *L){
 	struct math_context *M = GETMC(L);
@@ -2189,18 +2604,18 @@ ltriangle_ray(lua_State *L){
 
 static inline const struct triangle*
 to_triangles(lua_State *L, int idx){
-	const int ltype = lua_type(L, 3);
+	const int ltype = lua_type(L, idx);
 	switch(ltype){
 		case LUA_TSTRING:{
 			size_t len = 0;
-			const struct triangle* triangles = (const struct triangle*)lua_tolstring(L, 3, &len);
+			const struct triangle* triangles = (const struct triangle*)lua_tolstring(L, idx, &len);
 			if (len == 0){
 				luaL_error(L, "Invalid triangles buffer");
 			}
 			return triangles;
 		}
 		case LUA_TLIGHTUSERDATA:{
-			return (const struct triangle*)lua_touserdata(L, 3);
+			return (const struct triangle*)lua_touserdata(L, idx);
 		}
 		default:
 			luaL_error(L, "Invalid argument type");
@@ -2233,6 +2648,245 @@ ltriangles_ray(lua_State *L){
 	return 0;
 }
 
+// triangles (string or lightuserdata), numtri : returns the bvh as a string
+static int
+ltriangles_bvh(lua_State *L) {
+	const struct triangle* triangles = to_triangles(L, 1);
+	const uint32_t numtri = (uint32_t)luaL_checkinteger(L, 2);
+	if (numtri == 0){
+		luaL_error(L, "At least one triangle");
+	}
+	if (lua_type(L, 1) == LUA_TSTRING && lua_rawlen(L, 1) < numtri * sizeof(struct triangle)) {
+		return luaL_error(L, "Invalid triangles buffer size %d < %d", (int)lua_rawlen(L, 1), (int)(numtri * sizeof(struct triangle)));
+	}
+	void *buffer = lua_newuserdatauv(L, math3d_bvh_size(numtri), 0);
+	size_t sz = math3d_bvh_build(triangles, numtri, buffer);
+	lua_pushlstring(L, (const char *)buffer, sz);
+	return 1;
+}
+
+// bvh : returns "triangles" or "mesh", or nil if the bvh (loaded from somewhere) is broken
+static int
+lbvh_check(lua_State *L) {
+	size_t sz;
+	const char *bvh = luaL_checklstring(L, 1, &sz);
+	switch (math3d_bvh_check(bvh, sz)) {
+	case MATH3D_BVH_TRIANGLES:
+		lua_pushliteral(L, "triangles");
+		return 1;
+	case MATH3D_BVH_MESH:
+		lua_pushliteral(L, "mesh");
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// o, d, bvh, [withpt], [anyhit] : returns t, [point], triangle index
+static int
+lbvh_ray(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	const math_t o = vector_from_index(L, M, 1);
+	const math_t d = vector_from_index(L, M, 2);
+	size_t sz;
+	const char *bvh = luaL_checklstring(L, 3, &sz);
+	if (math3d_bvh_type(bvh, sz) != MATH3D_BVH_TRIANGLES) {
+		return luaL_error(L, "Invalid bvh");
+	}
+	const int withpt = lua_toboolean(L, 4);
+	const int anyhit = lua_toboolean(L, 5);
+	struct ray_triangle_interset_result r;
+	uint32_t index;
+	if (math3d_bvh_ray(M, o, d, bvh, anyhit, &r, &index)) {
+		lua_pushnumber(L, r.t);
+		if (withpt){
+			lua_pushmath(L, math3d_ray_point(M, o, d, r.t));
+		}
+		lua_pushinteger(L, index + 1);
+		return withpt ? 3 : 2;
+	}
+	return 0;
+}
+
+static const void *
+mesh_buffer(lua_State *L, int idx, const char *name, size_t *sz) {
+	switch (lua_getfield(L, idx, name)) {
+	case LUA_TSTRING: {
+		const void *ptr = lua_tolstring(L, -1, sz);
+		lua_pop(L, 1);	// the string is still referenced by the table
+		return ptr;
+	}
+	case LUA_TUSERDATA: {
+		const void *ptr = lua_touserdata(L, -1);
+		*sz = lua_rawlen(L, -1);
+		lua_pop(L, 1);
+		return ptr;
+	}
+	case LUA_TLIGHTUSERDATA: {
+		const void *ptr = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		*sz = SIZE_MAX;	// unknown
+		return ptr;
+	}
+	case LUA_TNIL:
+		lua_pop(L, 1);
+		return NULL;
+	default:
+		luaL_error(L, "Invalid mesh.%s (type = %s)", name, lua_typename(L, lua_type(L, -1)));
+		return NULL;
+	}
+}
+
+static int
+mesh_integer(lua_State *L, int idx, const char *name, int def) {
+	lua_getfield(L, idx, name);
+	int r = (int)luaL_optinteger(L, -1, def);
+	lua_pop(L, 1);
+	return r;
+}
+
+// { vb = vertex buffer, stride = 12, ib = index buffer (optional), index_size = 2 or 4, n = number of triangles, nv = number of vertices }
+// the buffers are strings, userdata or lightuserdata. n and nv can be omitted unless the size of buffer is unknown (lightuserdata).
+static void
+mesh_from_index(lua_State *L, int idx, struct math3d_mesh *mesh) {
+	luaL_checktype(L, idx, LUA_TTABLE);
+	size_t vsz, isz = SIZE_MAX;
+	mesh->vertex = mesh_buffer(L, idx, "vb", &vsz);
+	if (mesh->vertex == NULL)
+		luaL_error(L, "Need mesh.vb");
+	mesh->stride = mesh_integer(L, idx, "stride", 3 * sizeof(float));
+	if (mesh->stride < 3 * sizeof(float))
+		luaL_error(L, "Invalid mesh.stride %d", (int)mesh->stride);
+	mesh->index = mesh_buffer(L, idx, "ib", &isz);
+	mesh->index_size = mesh_integer(L, idx, "index_size", 2);
+	if (mesh->index_size != 2 && mesh->index_size != 4)
+		luaL_error(L, "Invalid mesh.index_size %d", mesh->index_size);
+	// the last vertex needs the position only
+	size_t nv = SIZE_MAX;
+	if (vsz != SIZE_MAX)
+		nv = vsz < 3 * sizeof(float) ? 0 : (vsz - 3 * sizeof(float)) / mesh->stride + 1;
+	int n = mesh_integer(L, idx, "n", -1);
+	if (n < 0) {
+		if (mesh->index ? isz == SIZE_MAX : nv == SIZE_MAX)
+			luaL_error(L, "Need mesh.n");
+		n = (int)((mesh->index ? isz / mesh->index_size : nv) / 3);
+	}
+	if (n <= 0)
+		luaL_error(L, "Need mesh.n");
+	if (mesh->index) {
+		if (isz != SIZE_MAX && (size_t)n * 3 * mesh->index_size > isz)
+			luaL_error(L, "Invalid mesh.n %d (index buffer size = %d)", n, (int)isz);
+	} else {
+		if (nv != SIZE_MAX && (size_t)n * 3 > nv)
+			luaL_error(L, "Invalid mesh.n %d (vertex buffer size = %d)", n, (int)vsz);
+	}
+	int nvi = mesh_integer(L, idx, "nv", -1);
+	if (nvi >= 0) {
+		if ((size_t)nvi > nv)
+			luaL_error(L, "Invalid mesh.nv %d (vertex buffer size = %d)", nvi, (int)vsz);
+		nv = nvi;
+	} else if (nv == SIZE_MAX) {
+		if (mesh->index)
+			luaL_error(L, "Need mesh.nv");
+		nv = (size_t)n * 3;
+	}
+	mesh->numtriangles = n;
+	mesh->numvertices = nv > UINT32_MAX ? UINT32_MAX : (uint32_t)nv;
+}
+
+// mesh : returns the bvh as a string, the bvh reads the mesh buffers in place when querying
+static int
+lmesh_bvh(lua_State *L) {
+	struct math3d_mesh mesh;
+	mesh_from_index(L, 1, &mesh);
+	if (!math3d_mesh_check(&mesh))
+		return luaL_error(L, "Invalid mesh index (vertex out of range)");
+	void *buffer = lua_newuserdatauv(L, math3d_bvh_mesh_size(mesh.numtriangles), 0);
+	size_t sz = math3d_bvh_build_mesh(&mesh, buffer);
+	lua_pushlstring(L, (const char *)buffer, sz);
+	return 1;
+}
+
+// o, d, mesh, [bvh], [withpt], [anyhit] : returns t, [point], triangle index
+static int
+lmesh_ray(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	const math_t o = vector_from_index(L, M, 1);
+	const math_t d = vector_from_index(L, M, 2);
+	struct math3d_mesh mesh;
+	mesh_from_index(L, 3, &mesh);
+	const int withpt = lua_toboolean(L, 5);
+	struct ray_triangle_interset_result r;
+	uint32_t index;
+	int hit;
+	const int anyhit = lua_toboolean(L, 6);
+	if (lua_isnoneornil(L, 4)) {
+		if (!math3d_mesh_check(&mesh))
+			return luaL_error(L, "Invalid mesh index (vertex out of range)");
+		hit = math3d_ray_mesh(M, o, d, &mesh, anyhit, &r, &index);
+	} else {
+		size_t sz;
+		const char *bvh = luaL_checklstring(L, 4, &sz);
+		if (math3d_bvh_type(bvh, sz) != MATH3D_BVH_MESH)
+			return luaL_error(L, "Invalid mesh bvh");
+		if (math3d_bvh_numtriangles(bvh) != mesh.numtriangles)
+			return luaL_error(L, "The bvh is built from %d triangles, mesh.n = %d", (int)math3d_bvh_numtriangles(bvh), (int)mesh.numtriangles);
+		hit = math3d_bvh_ray_mesh(M, o, d, bvh, &mesh, anyhit, &r, &index);
+	}
+	if (!hit)
+		return 0;
+	lua_pushnumber(L, r.t);
+	if (withpt){
+		lua_pushmath(L, math3d_ray_point(M, o, d, r.t));
+	}
+	lua_pushinteger(L, index + 1);
+	return withpt ? 3 : 2;
+}
+
+// origins, dirs (vec4 arrays, size 1 : shared), output at index oidx
+// returns the number of hits, and t,u,v (float[3] per ray, t < 0 : no hit) as a string if the output pointer is absent
+static int
+rays_triangles(lua_State *L, const struct triangle *triangles, uint32_t numtri, const char *bvh, int oidx) {
+	struct math_context *M = GETMC(L);
+	const math_t origins = array_from_index(L, M, 1, MATH_TYPE_VEC4);
+	const math_t dirs = array_from_index(L, M, 2, MATH_TYPE_VEC4);
+	const int no = math_size(M, origins);
+	const int nd = math_size(M, dirs);
+	const int n = no > nd ? no : nd;
+	if ((no != n && no != 1) || (nd != n && nd != 1))
+		return luaL_error(L, "Size mismatch (origins = %d, dirs = %d)", no, nd);
+	struct ray_triangle_interset_result *r = (struct ray_triangle_interset_result *)lua_touserdata(L, oidx);
+	if (r == NULL) {
+		if (!lua_isnoneornil(L, oidx))
+			return luaL_error(L, "Invalid output buffer (type = %s)", lua_typename(L, lua_type(L, oidx)));
+		r = (struct ray_triangle_interset_result *)lua_newuserdatauv(L, n * sizeof(*r), 0);
+	}
+	lua_pushinteger(L, math3d_rays_triangles(M, origins, dirs, triangles, numtri, bvh, r, NULL));
+	if (lua_isnoneornil(L, oidx)) {
+		lua_pushlstring(L, (const char *)r, n * sizeof(*r));
+		return 2;
+	}
+	return 1;
+}
+
+// origins, dirs, triangles, numtri, [output]
+static int
+lrays_triangles(lua_State *L) {
+	const struct triangle* triangles = to_triangles(L, 3);
+	const uint32_t numtri = (uint32_t)luaL_checkinteger(L, 4);
+	return rays_triangles(L, triangles, numtri, NULL, 5);
+}
+
+// origins, dirs, bvh, [output]
+static int
+lrays_bvh(lua_State *L) {
+	size_t sz;
+	const char *bvh = luaL_checklstring(L, 3, &sz);
+	if (math3d_bvh_type(bvh, sz) != MATH3D_BVH_TRIANGLES)
+		return luaL_error(L, "Invalid bvh");
+	return rays_triangles(L, NULL, 0, bvh, 4);
+}
+
 static int
 lbox_ray(lua_State *L){
 	struct math_context *M = GETMC(L);
@@ -2372,6 +3026,435 @@ lmul_array(lua_State *L) {
 	return 1;
 }
 
+// world (matrix array ref), parent (string of int32 : 0-based, -1 root ; or table : 1-based, 0 root),
+// local matrix array or { s = , r = , t = } arrays (size n or 1), [dirty bitmask string/userdata]
+// Updates world in place, parent must be before its children. returns the number of nodes recomputed.
+static int
+ltransform_hierarchy(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	math_t world = get_id(L, M, 1);
+	if (!math_isref(M, world))
+		return luaL_error(L, "World is not ref");
+	if (math_type(M, world) != MATH_TYPE_MAT)
+		return luaL_error(L, "World is not matrix, it's %s", math_typename(math_type(M, world)));
+	int n = math_size(M, world);
+	const int *parent;
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		size_t sz;
+		parent = (const int *)lua_tolstring(L, 2, &sz);
+		if (sz < n * sizeof(int))
+			return luaL_error(L, "Need %d parents", n);
+	} else {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		int *p = (int *)lua_newuserdatauv(L, (n > 0 ? n : 1) * sizeof(int), 0);
+		lua_replace(L, 2);
+		int i;
+		for (i=0;i<n;i++) {
+			lua_geti(L, -1, i+1);
+			p[i] = (int)luaL_optinteger(L, -1, 0) - 1;
+			lua_pop(L, 1);
+		}
+		parent = p;
+	}
+	int i;
+	for (i=0;i<n;i++) {
+		if (parent[i] >= i || parent[i] < -1)
+			return luaL_error(L, "Invalid parent %d of node %d", parent[i], i);
+	}
+	math_t local = MATH_NULL, s = MATH_NULL, r = MATH_NULL, t = MATH_NULL;
+	if (lua_type(L, 3) == LUA_TTABLE && lua_rawlen(L, 3) == 0) {
+		if (lua_getfield(L, 3, "s") != LUA_TNIL)
+			s = array_from_index(L, M, lua_gettop(L), MATH_TYPE_VEC4);
+		if (lua_getfield(L, 3, "r") != LUA_TNIL)
+			r = array_from_index(L, M, lua_gettop(L), MATH_TYPE_QUAT);
+		if (lua_getfield(L, 3, "t") != LUA_TNIL)
+			t = array_from_index(L, M, lua_gettop(L), MATH_TYPE_VEC4);
+		lua_pop(L, 3);
+		math_t v[3] = { s, r, t };
+		for (i=0;i<3;i++) {
+			if (!math_isnull(v[i])) {
+				int sz = math_size(M, v[i]);
+				if (sz != 1 && sz < n)
+					return luaL_error(L, "Need %d elements of %c", n, "srt"[i]);
+			}
+		}
+	} else {
+		local = array_from_index(L, M, 3, MATH_TYPE_MAT);
+		if (math_size(M, local) < n)
+			return luaL_error(L, "Need %d local matrices", n);
+	}
+	const uint32_t *dirty = NULL;
+	switch (lua_type(L, 4)) {
+	case LUA_TNONE:
+	case LUA_TNIL:
+		break;
+	case LUA_TSTRING: {
+		size_t sz;
+		dirty = (const uint32_t *)lua_tolstring(L, 4, &sz);
+		if (sz < (n + 31) / 32 * sizeof(uint32_t))
+			return luaL_error(L, "Dirty mask is too short");
+		break;
+	}
+	case LUA_TUSERDATA:
+		dirty = (const uint32_t *)lua_touserdata(L, 4);
+		if (lua_rawlen(L, 4) < (n + 31) / 32 * sizeof(uint32_t))
+			return luaL_error(L, "Dirty mask is too short");
+		break;
+	default:
+		return luaL_error(L, "Invalid dirty mask (type = %s)", lua_typename(L, lua_type(L, 4)));
+	}
+	lua_pushinteger(L, math3d_transform_hierarchy(M, world, parent, n, local, s, r, t, dirty));
+	return 1;
+}
+
+static int
+is_refobject(lua_State *L, int index) {
+	if (lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index))
+		return 0;
+	int r = lua_topointer(L, -1) == refobj_meta(L);
+	lua_pop(L, 1);
+	return r;
+}
+
+// world, invbind (matrix arrays), [root matrix], [output], ["mat4" | "3x4"]
+// output : a matrix ref (mat4), a vec4 ref (3x4, 3 vec4 per joint), or a userdata buffer, returns the output.
+// Without output, returns a matrix array (mat4) or a string (3x4)
+static int
+lskin_palette(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	math_t world = array_from_index(L, M, 1, MATH_TYPE_MAT);
+	math_t invbind = array_from_index(L, M, 2, MATH_TYPE_MAT);
+	math_t root = lua_isnoneornil(L, 3) ? MATH_NULL : matrix_from_index(L, M, 3);
+	int n = math_size(M, world);
+	if (math_size(M, invbind) < n)
+		return luaL_error(L, "Need %d inverse bind matrices", n);
+	int format = MATH3D_PALETTE_MAT4;
+	if (!lua_isnoneornil(L, 5)) {
+		const char *f = luaL_checkstring(L, 5);
+		if (strcmp(f, "3x4") == 0) {
+			format = MATH3D_PALETTE_3X4;
+		} else if (strcmp(f, "mat4") != 0) {
+			return luaL_error(L, "Invalid format %s", f);
+		}
+	}
+	size_t esize = (format == MATH3D_PALETTE_3X4 ? 12 : 16) * sizeof(float);
+	if (lua_isnoneornil(L, 4)) {
+		if (format == MATH3D_PALETTE_MAT4) {
+			math_t output = math_import(M, NULL, MATH_TYPE_MAT, n);
+			math3d_skin_palette(M, root, world, invbind, math_init(M, output), 0, format);
+			lua_pushmath(L, output);
+		} else {
+			void *buffer = lua_newuserdatauv(L, n > 0 ? n * esize : 1, 0);
+			math3d_skin_palette(M, root, world, invbind, buffer, 0, format);
+			lua_pushlstring(L, (const char *)buffer, n * esize);
+		}
+		return 1;
+	}
+	if (lua_type(L, 4) == LUA_TUSERDATA && !is_refobject(L, 4)) {
+		if (lua_rawlen(L, 4) < n * esize)
+			return luaL_error(L, "Output buffer is too small");
+		math3d_skin_palette(M, root, world, invbind, lua_touserdata(L, 4), 0, format);
+		lua_pushvalue(L, 4);
+		return 1;
+	}
+	math_t output = get_id(L, M, 4);
+	if (!math_isref(M, output))
+		return luaL_error(L, "Output is not ref");
+	struct math_view view;
+	math_view(M, output, &view);
+	switch (math_type(M, output)) {
+	case MATH_TYPE_MAT:
+		if (format != MATH3D_PALETTE_MAT4)
+			return luaL_error(L, "Need vec4 ref for 3x4 palette");
+		if (view.size < n)
+			return luaL_error(L, "Need %d matrices in output", n);
+		math3d_skin_palette(M, root, world, invbind, (void *)view.ptr, view.stride, format);
+		break;
+	case MATH_TYPE_VEC4:
+		if (lua_isnoneornil(L, 5))
+			format = MATH3D_PALETTE_3X4;
+		if (format != MATH3D_PALETTE_3X4)
+			return luaL_error(L, "Need matrix ref for mat4 palette");
+		if (view.vec3 || view.stride != 4 * sizeof(float))
+			return luaL_error(L, "Need packed vec4 ref for 3x4 palette");
+		if (view.size < n * 3)
+			return luaL_error(L, "Need %d vectors in output", n * 3);
+		math3d_skin_palette(M, root, world, invbind, (void *)view.ptr, 0, format);
+		break;
+	default:
+		return luaL_error(L, "Invalid output type %s", math_typename(math_type(M, output)));
+	}
+	lua_pushvalue(L, 4);
+	return 1;
+}
+
+#define EXPORT_BATCH 64
+
+// ids (a math id or a table of math ids, arrays are flattened), layout, [output], [offset]
+// layout : "mat4", "3x4" (the first 3 rows), "vec4" (a matrix is 4 vec4), with "_half" suffix for half floats
+// output : a light userdata (the caller makes sure of the size) or a userdata buffer, offset in bytes.
+// Without output, returns a string; or returns the bytes written
+static int
+lexport(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	const char *layout = luaL_checkstring(L, 2);
+	static const char * names[] = { "mat4", "3x4", "vec4", NULL };
+	int format;
+	for (format=0;names[format];format++) {
+		size_t sz = strlen(names[format]);
+		if (strncmp(layout, names[format], sz) == 0) {
+			if (layout[sz] == 0)
+				break;
+			if (strcmp(layout + sz, "_half") == 0) {
+				format |= MATH3D_EXPORT_HALF;
+				break;
+			}
+		}
+	}
+	if (names[format & ~MATH3D_EXPORT_HALF] == NULL)
+		return luaL_error(L, "Invalid layout %s", layout);
+	math_t tmp[EXPORT_BATCH];
+	math_t *id = tmp;
+	int n = 1;
+	if (lua_type(L, 1) == LUA_TTABLE) {
+		n = (int)lua_rawlen(L, 1);
+		if (n > EXPORT_BATCH)
+			id = (math_t *)lua_newuserdatauv(L, n * sizeof(math_t), 0);
+		int i;
+		for (i=0;i<n;i++) {
+			lua_geti(L, 1, i+1);
+			id[i] = get_id(L, M, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+	} else {
+		id[0] = get_id(L, M, 1);
+	}
+	int sz = math3d_export(M, id, n, format, NULL);
+	if (sz < 0)
+		return luaL_error(L, "Need matrices for %s layout", layout);
+	int ltype = lua_type(L, 3);
+	if (ltype == LUA_TNONE || ltype == LUA_TNIL) {
+		void *buffer = lua_newuserdatauv(L, sz > 0 ? sz : 1, 0);
+		math3d_export(M, id, n, format, buffer);
+		lua_pushlstring(L, (const char *)buffer, sz);
+		return 1;
+	}
+	size_t offset = (size_t)luaL_optinteger(L, 4, 0);
+	char *output;
+	if (ltype == LUA_TLIGHTUSERDATA) {
+		output = (char *)lua_touserdata(L, 3);
+	} else if (ltype == LUA_TUSERDATA && !is_refobject(L, 3)) {
+		if (lua_rawlen(L, 3) < offset + sz)
+			return luaL_error(L, "Output buffer is too small");
+		output = (char *)lua_touserdata(L, 3);
+	} else {
+		return luaL_error(L, "Need userdata for output");
+	}
+	math3d_export(M, id, n, format, output + offset);
+	lua_pushinteger(L, sz);
+	return 1;
+}
+
+static int
+lcmdbuf_gc(lua_State *L) {
+	struct math3d_cmdbuf *cb = (struct math3d_cmdbuf *)lua_touserdata(L, 1);
+	math3d_cmdbuf_deinit(cb);
+	return 0;
+}
+
+static struct math3d_cmdbuf *
+check_cmdbuf(lua_State *L, int index) {
+	if (lua_type(L, index) == LUA_TUSERDATA && lua_getmetatable(L, index)) {
+		int r = lua_topointer(L, -1) == cmdbuf_meta(L);
+		lua_pop(L, 1);
+		if (r)
+			return (struct math3d_cmdbuf *)lua_touserdata(L, index);
+	}
+	luaL_argerror(L, index, "Need command buffer");
+	return NULL;
+}
+
+// The uservalue of the command buffer is a table of the ref objects bound to the input registers,
+// their ids are read at execute time. The metatable is upvalue 2.
+static int
+lcommand_buffer(lua_State *L) {
+	struct math3d_cmdbuf *cb = (struct math3d_cmdbuf *)lua_newuserdatauv(L, sizeof(*cb), 1);
+	math3d_cmdbuf_init(cb);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+	return 1;
+}
+
+static void
+bind_input(lua_State *L, struct math_context *M, struct math3d_cmdbuf *cb, int reg, int index) {
+	lua_getiuservalue(L, 1, 1);
+	if (is_refobject(L, index)) {
+		cb->reg[reg] = refobject_id(L, M, index);
+		lua_pushvalue(L, index);
+	} else {
+		cb->reg[reg] = lua_isnoneornil(L, index) ? MATH_NULL : get_id(L, M, index);
+		lua_pushnil(L);
+	}
+	lua_rawseti(L, -2, reg + 1);
+	lua_pop(L, 1);
+}
+
+// cb, op, args... : returns the register of the result (integer).
+// The value args are registers or math ids (refs), and the number args are numbers.
+// op "input" with an optional id creates an input register.
+static int
+lcommand(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct math3d_cmdbuf *cb = check_cmdbuf(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	if (strcmp(name, "input") == 0) {
+		int reg = math3d_cmdbuf_input(cb, MATH_NULL);
+		if (reg < 0)
+			return luaL_error(L, "Out of memory");
+		bind_input(L, M, cb, reg, 3);
+		lua_pushinteger(L, reg + 1);
+		return 1;
+	}
+	const char *spec;
+	int op = math3d_cmdbuf_op(name, &spec);
+	if (op < 0)
+		return luaL_error(L, "Invalid command %s", name);
+	int arg[3];
+	int i, n = 0;
+	float f = 0;
+	for (i=0;spec[i];i++) {
+		int index = i + 3;
+		if (spec[i] == 'f') {
+			f = (float)luaL_checknumber(L, index);
+		} else if (lua_isinteger(L, index)) {
+			int reg = (int)lua_tointeger(L, index);
+			if (reg <= 0 || reg > cb->nreg)
+				return luaL_error(L, "Invalid register %d", reg);
+			arg[n++] = reg - 1;
+		} else {
+			luaL_checkany(L, index);
+			int reg = math3d_cmdbuf_input(cb, MATH_NULL);
+			if (reg < 0)
+				return luaL_error(L, "Out of memory");
+			bind_input(L, M, cb, reg, index);
+			arg[n++] = reg;
+		}
+	}
+	int dst = math3d_cmdbuf_push(cb, op, arg, f);
+	if (dst < 0)
+		return luaL_error(L, "Out of memory");
+	lua_pushinteger(L, dst + 1);
+	return 1;
+}
+
+// cb, input register, id (or ref)
+static int
+lcommand_bind(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct math3d_cmdbuf *cb = check_cmdbuf(L, 1);
+	int reg = (int)luaL_checkinteger(L, 2);
+	if (reg <= 0 || reg > cb->nreg)
+		return luaL_error(L, "Invalid register %d", reg);
+	if (!math3d_cmdbuf_isinput(cb, reg - 1))
+		return luaL_error(L, "Register %d is not an input", reg);
+	luaL_checkany(L, 3);
+	bind_input(L, M, cb, reg - 1, 3);
+	return 0;
+}
+
+// cb, [registers...] : executes all the commands, returns the ids of the registers (the last one by default)
+static int
+lcommand_execute(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	struct math3d_cmdbuf *cb = check_cmdbuf(L, 1);
+	lua_getiuservalue(L, 1, 1);
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		cb->reg[lua_tointeger(L, -2) - 1] = refobject_id(L, M, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	const char *err = math3d_cmdbuf_execute(M, cb);
+	if (err)
+		return luaL_error(L, "%s", err);
+	int top = lua_gettop(L);
+	if (top == 1) {
+		if (cb->nreg == 0)
+			return 0;
+		lua_pushmath(L, cb->reg[cb->nreg - 1]);
+		return 1;
+	}
+	int i;
+	for (i=2;i<=top;i++) {
+		int reg = (int)luaL_checkinteger(L, i);
+		if (reg <= 0 || reg > cb->nreg)
+			return luaL_error(L, "Invalid register %d", reg);
+		lua_pushmath(L, cb->reg[reg - 1]);
+	}
+	return top - 1;
+}
+
+static int
+lcommand_reset(lua_State *L) {
+	struct math3d_cmdbuf *cb = check_cmdbuf(L, 1);
+	math3d_cmdbuf_reset(cb);
+	lua_newtable(L);
+	lua_setiuservalue(L, 1, 1);
+	return 0;
+}
+
+// expr, { name = ref | marked id | number ... } : returns a read only ref object.
+// It's evaluated lazily on read, only when the version of any input ref changed.
+static int
+lcomputed(lua_State *L) {
+	struct math_context *M = GETMC(L);
+	const char *source = luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	struct refobject *R = (struct refobject *)lua_newuserdatauv(L, sizeof(struct refobject), 1);
+	R->id = MATH_NULL;
+	R->version = 0;
+	R->computed = 1;
+	struct computed_ref *c = (struct computed_ref *)lua_newuserdatauv(L, sizeof(struct computed_ref), COMPUTED_MAXINPUT);
+	char err[128];
+	if (math3d_expr_compile(&c->e, source, 0, NULL, err))
+		return luaL_error(L, "%s", err);
+	int i;
+	for (i=0;i<c->e.ninput;i++) {
+		const char *name = c->e.input[i];
+		switch (lua_getfield(L, 2, name)) {
+		case LUA_TUSERDATA:
+			if (!is_refobject(L, -1))
+				return luaL_error(L, "Input %s is not a ref object", name);
+			break;
+		case LUA_TLIGHTUSERDATA: {
+			math_t id = HANDLE_TO_MATH(lua_touserdata(L, -1));
+			if (!math_valid(M, id) || !(math_marked(M, id) || math_isconstant(id)))
+				return luaL_error(L, "Input %s should be a marked id", name);
+			break; }
+		case LUA_TNUMBER:
+			break;
+		default:
+			return luaL_error(L, "Missing input %s", name);
+		}
+		c->version[i] = 0;
+		lua_setiuservalue(L, 4, i+1);
+	}
+	// all the inputs are valid, the marked ids are released by the gc of the computed ref
+	for (i=0;i<c->e.ninput;i++) {
+		if (lua_getiuservalue(L, 4, i+1) == LUA_TLIGHTUSERDATA)
+			lua_math_mark(L, M, HANDLE_TO_MATH(lua_touserdata(L, -1)));
+		lua_pop(L, 1);
+	}
+	lua_setiuservalue(L, 3, 1);
+	math_refcount(M, 1);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_setmetatable(L, 3);
+	return 1;
+}
+
 static int
 lpoints_center(lua_State *L) {
 	struct math_context *M = GETMC(L);
@@ -2514,6 +3597,8 @@ lconstant(lua_State *L) {
 		break;
 	}
 	id = math_constant(M, id);
+	if (math_isnull(id))
+		return luaL_error(L, "Can't add constant to the read only pool");
 	lua_pushmath(L, id);
 	return 1;
 }
@@ -2533,8 +3618,10 @@ lconstant_array(lua_State *L) {
 	}
 
 	struct math_context * M = GETMC(L);
-	math_t id = array_from_index(L, M, 2, type);
-	lua_pushmath(L, math_constant(M, id));
+	math_t id = math_constant(M, array_from_index(L, M, 2, type));
+	if (math_isnull(id))
+		return luaL_error(L, "Can't add constant to the read only pool");
+	lua_pushmath(L, id);
 	return 1;
 }
 
@@ -2559,6 +3646,22 @@ linfo(lua_State *L) {
 		w = MATH_INFO_REF;
 	} else if (strcmp(what, "slot") == 0) {
 		w = MATH_INFO_SLOT;
+	} else if (strcmp(what, "constant_hit") == 0) {
+		w = MATH_INFO_CONSTANT_HIT;
+	} else if (strcmp(what, "constant_miss") == 0) {
+		w = MATH_INFO_CONSTANT_MISS;
+	} else if (strcmp(what, "large") == 0) {
+		w = MATH_INFO_LARGE;
+	} else if (strcmp(what, "transient_alloc") == 0) {
+		w = MATH_INFO_TRANSIENT_ALLOC;
+	} else if (strcmp(what, "transient_free") == 0) {
+		w = MATH_INFO_TRANSIENT_FREE;
+	} else if (strcmp(what, "transient_retain") == 0) {
+		w = MATH_INFO_TRANSIENT_RETAIN;
+	} else if (strcmp(what, "marked_page") == 0) {
+		w = MATH_INFO_MARKED_PAGE;
+	} else if (strcmp(what, "compact_moved") == 0) {
+		w = MATH_INFO_COMPACT_MOVED;
 	} else if (strcmp(what, "maxpage") == 0) {
 		w = MATH_INFO_MAXPAGE;
 	} else if (strcmp(what, "frame") == 0) {
@@ -2622,6 +3725,119 @@ lmarked_list(lua_State *L) {
 	return 1;
 }
 
+// enable : turn on (or off) the modification stamps of marked values
+static int
+ltrack(lua_State *L) {
+	struct math_context * M = GETMC(L);
+	math_track(M, lua_toboolean(L, 1));
+	return 0;
+}
+
+static int
+lstamp(lua_State *L) {
+	struct math_context * M = GETMC(L);
+	lua_pushinteger(L, math_stamp(M));
+	return 1;
+}
+
+// id (or ref) : returns the stamp of the last write, 0 for constant or not tracked
+static int
+lmodified(lua_State *L) {
+	struct math_context * M = GETMC(L);
+	math_t id = get_id(L, M, 1);
+	lua_pushinteger(L, math_modified(M, id));
+	return 1;
+}
+
+// since (stamp), [result table] : returns an array of the marked ids created or written at or after the stamp, and the number
+static int
+lchanged(lua_State *L) {
+	struct math_context * M = GETMC(L);
+	uint32_t since = (uint32_t)luaL_checkinteger(L, 1);
+	if (lua_isnoneornil(L, 2)) {
+		lua_settop(L, 1);
+		lua_newtable(L);
+	} else {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_settop(L, 2);
+	}
+	int iter = 0;
+	int n = 0;
+	math_t id;
+	while (math_changed_next(M, since, &iter, &id)) {
+		lua_pushmath(L, id);
+		lua_rawseti(L, 2, ++n);
+	}
+	// clear the rest of the result table
+	int i = n + 1;
+	while (lua_rawgeti(L, 2, i) != LUA_TNIL) {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_rawseti(L, 2, i++);
+	}
+	lua_pop(L, 1);
+	lua_pushinteger(L, n);
+	return 2;
+}
+
+static int
+lprofile(lua_State *L) {
+	struct math_context * M = GETMC(L);
+	int sample = (int)luaL_optinteger(L, 1, 0);
+	if (sample < 0)
+		return luaL_error(L, "Invalid profile sample %d", sample);
+	math_profile(M, sample);
+	return 0;
+}
+
+// returns { ["filename:line"] = live }, or the difference from the last report if it is given.
+static int
+lprofile_report(lua_State *L) {
+	struct math_context * M = GETMC(L);
+	int diff = !lua_isnoneornil(L, 1);
+	if (diff)
+		luaL_checktype(L, 1, LUA_TTABLE);
+	int n = math_profile_report(M, NULL, 0);
+	struct math_profile_site *site = (struct math_profile_site *)lua_newuserdatauv(L, n * sizeof(*site), 0);
+	math_profile_report(M, site, n);
+	lua_newtable(L);
+	int i;
+	for (i=0;i<n;i++) {
+		int live = site[i].live;
+		lua_pushfstring(L, "%s:%d", site[i].filename, site[i].line);
+		if (diff) {
+			lua_pushvalue(L, -1);
+			if (lua_rawget(L, 1) == LUA_TNUMBER) {
+				live -= (int)lua_tointeger(L, -1);
+			}
+			lua_pop(L, 1);
+			if (live == 0) {
+				lua_pop(L, 1);
+				continue;
+			}
+		}
+		lua_pushinteger(L, live);
+		lua_rawset(L, -3);
+	}
+	if (diff) {
+		// the sites only in the last report
+		lua_pushnil(L);
+		while (lua_next(L, 1)) {
+			lua_pushvalue(L, -2);
+			if (lua_rawget(L, -4) == LUA_TNIL && lua_tointeger(L, -2) != 0) {
+				lua_pop(L, 1);
+				lua_pushvalue(L, -2);
+				lua_pushinteger(L, -lua_tointeger(L, -2));
+				lua_rawset(L, -5);
+			} else {
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+	}
+	return 1;
+}
+
 static void
 init_math3d_api(lua_State *L, struct math3d_api *M) {
 	luaL_Reg l[] = {
@@ -2638,6 +3854,7 @@ init_math3d_api(lua_State *L, struct math3d_api *M) {
 		{ "vector", lvector },
 		{ "quaternion", lquaternion },
 		{ "array_matrix_ref", larray_matrix_ref },
+		{ "array_vector_ref", larray_vector_ref },
 		{ "array_vector", larray_vector },
 		{ "array_matrix", larray_matrix },
 		{ "array_quat", larray_quat },
@@ -2649,10 +3866,15 @@ init_math3d_api(lua_State *L, struct math3d_api *M) {
 		{ "reset", lreset },
 		{ "mul", lmul },
 		{ "mul_array", lmul_array },
+		{ "skin_palette", lskin_palette },
+		{ "export", lexport },
+		{ "transform_hierarchy", ltransform_hierarchy },
 		{ "add", ladd },
 		{ "sub", lsub },
 		{ "muladd", lmuladd},
 		{ "srt", lsrt },
+		{ "make_srt_array", lmake_srt_array },
+		{ "decompose_array", ldecompose_array },
 		{ "length", llength },
 		{ "floor", lfloor },
 		{ "ceil", lceil },
@@ -2684,11 +3906,21 @@ init_math3d_api(lua_State *L, struct math3d_api *M) {
 		{ "log", llog},
 		{ "lerp", llerp},
 		{ "slerp", lslerp},
+		{ "blend_array", lblend_array},
+		{ "compile", lcompile},
+		{ "command_buffer", NULL},
+		{ "command", lcommand},
+		{ "command_bind", lcommand_bind},
+		{ "command_execute", lcommand_execute},
+		{ "command_reset", lcommand_reset},
 		{ "quat2euler", lquat2euler},
 		{ "dir2radian", ldir2radian},
 		{ "forward_dir",lforward_dir},
 		{ "stacksize", lmemsize},	// todo : change name
 		{ "set_homogeneous_depth", lset_homogeneous_depth},
+		{ "set_transient_retention", lset_transient_retention},
+		{ "set_compaction", lset_compaction},
+		{ "simd", lsimd},
 		{ "set_origin_bottom_left", lset_origin_bottom_left},
 		{ "get_homogeneous_depth", lget_homogeneous_depth},
 		{ "get_origin_bottom_left", lget_origin_bottom_left},
@@ -2720,6 +3952,7 @@ init_math3d_api(lua_State *L, struct math3d_api *M) {
 		{ "frustum_points", 		lfrustum_points},
 		{ "frustum_intersect_aabb", lfrustum_intersect_aabb},
 		{ "frustum_intersect_aabb_list", lfrustum_intersect_aabb_list},
+		{ "frustum_cull", lfrustum_cull},
 		{ "frustum_test_point",		lfrustum_test_point},
 		{ "frustum_aabb_intersect_points",lfrustum_aabb_intersect_points},
 
@@ -2732,6 +3965,13 @@ init_math3d_api(lua_State *L, struct math3d_api *M) {
 		{ "plane_ray",			lplane_ray},
 		{ "triangle_ray",		ltriangle_ray},
 		{ "triangles_ray",		ltriangles_ray},
+		{ "triangles_bvh",		ltriangles_bvh},
+		{ "bvh_ray",			lbvh_ray},
+		{ "bvh_check",			lbvh_check},
+		{ "rays_triangles",		lrays_triangles},
+		{ "rays_bvh",			lrays_bvh},
+		{ "mesh_bvh",			lmesh_bvh},
+		{ "mesh_ray",			lmesh_ray},
 		{ "box_ray", 			lbox_ray},
 
 		{ "marked_vector", lmarked_vector },
@@ -2743,6 +3983,12 @@ init_math3d_api(lua_State *L, struct math3d_api *M) {
 		{ "recover", lrecover },
 		{ "live", llive },
 		{ "marked_list", lmarked_list },
+		{ "track", ltrack },
+		{ "stamp", lstamp },
+		{ "modified", lmodified },
+		{ "changed", lchanged },
+		{ "profile", lprofile },
+		{ "profile_report", lprofile_report },
 
 		{ "CINTERFACE", NULL },
 		{ "_COBJECT", NULL },
@@ -2823,6 +4069,20 @@ math3d_object(lua_State *L, int maxpage) {
 	lua_pushcclosure(L, lref, 2);
 	lua_setfield(L, -2, "ref");
 
+	lua_pushlightuserdata(L, M);
+	lua_pushvalue(L, refmeta);
+	lua_pushcclosure(L, lcomputed, 2);
+	lua_setfield(L, -2, "computed");
+
+	// the metatable of command buffers, upvalue 2 of .command_buffer
+	lua_pushlightuserdata(L, M);
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, lcmdbuf_gc);
+	lua_setfield(L, -2, "__gc");
+	M->cmdbufmeta = lua_topointer(L, -1);
+	lua_pushcclosure(L, lcommand_buffer, 2);
+	lua_setfield(L, -2, "command_buffer");
+
 	lua_pushcfunction(L, lnew_math3d);
 	lua_setfield(L, -2, "new");
 }
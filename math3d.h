@@ -9,6 +9,7 @@ struct math3d_api {
 	const void * refmeta;
 	math_t (*from_lua)(lua_State *L, struct math_context *MC, int index, int type);
 	math_t (*from_lua_id)(lua_State *L, struct math_context *MC, int index);
+	const void * cmdbufmeta;
 };
 
 // binding functions
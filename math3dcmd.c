@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "math3dcmd.h"
+#include "math3dfunc.h"
+
+static const struct {
+	const char *name;
+	const char *spec;
+} ops[MATH3D_CMD_COUNT] = {
+	{ "add", "vv" },
+	{ "sub", "vv" },
+	{ "mul", "**" },
+	{ "muladd", "vvv" },
+	{ "cross", "vv" },
+	{ "normalize", "*" },
+	{ "inverse", "*" },
+	{ "transpose", "m" },
+	{ "transform", "*v" },
+	{ "transformH", "mv" },
+	{ "lerp", "**f" },
+	{ "slerp", "qqf" },
+	{ "srt", "vqv" },
+	{ "tomat", "q" },
+	{ "toquat", "m" },
+	{ "reciprocal", "v" },
+};
+
+void
+math3d_cmdbuf_init(struct math3d_cmdbuf *cb) {
+	memset(cb, 0, sizeof(*cb));
+}
+
+void
+math3d_cmdbuf_deinit(struct math3d_cmdbuf *cb) {
+	free(cb->cmd);
+	free(cb->reg);
+	free(cb->input);
+	memset(cb, 0, sizeof(*cb));
+}
+
+void
+math3d_cmdbuf_reset(struct math3d_cmdbuf *cb) {
+	cb->n = 0;
+	cb->nreg = 0;
+	cb->ninput = 0;
+}
+
+int
+math3d_cmdbuf_op(const char *name, const char **spec) {
+	int i;
+	for (i=0;i<MATH3D_CMD_COUNT;i++) {
+		if (strcmp(ops[i].name, name) == 0) {
+			*spec = ops[i].spec;
+			return i;
+		}
+	}
+	return -1;
+}
+
+// returns 0 if out of memory
+static int
+reserve_register(struct math3d_cmdbuf *cb) {
+	if (cb->nreg >= cb->regcap) {
+		int cap = cb->regcap ? cb->regcap * 2 : 64;
+		math_t *reg = (math_t *)realloc(cb->reg, cap * sizeof(math_t));
+		if (reg == NULL)
+			return 0;
+		cb->reg = reg;
+		cb->regcap = cap;
+	}
+	return 1;
+}
+
+static int
+new_register(struct math3d_cmdbuf *cb, math_t id) {
+	assert(cb->nreg < cb->regcap);
+	cb->reg[cb->nreg] = id;
+	return cb->nreg++;
+}
+
+int
+math3d_cmdbuf_input(struct math3d_cmdbuf *cb, math_t id) {
+	if (cb->ninput >= cb->inputcap) {
+		int cap = cb->inputcap ? cb->inputcap * 2 : 64;
+		int *input = (int *)realloc(cb->input, cap * sizeof(int));
+		if (input == NULL)
+			return -1;
+		cb->input = input;
+		cb->inputcap = cap;
+	}
+	if (!reserve_register(cb))
+		return -1;
+	int reg = new_register(cb, id);
+	cb->input[cb->ninput++] = reg;
+	return reg;
+}
+
+int
+math3d_cmdbuf_isinput(const struct math3d_cmdbuf *cb, int reg) {
+	int i;
+	for (i=0;i<cb->ninput;i++) {
+		if (cb->input[i] == reg)
+			return 1;
+	}
+	return 0;
+}
+
+int
+math3d_cmdbuf_push(struct math3d_cmdbuf *cb, int op, const int *arg, float f) {
+	assert(op >= 0 && op < MATH3D_CMD_COUNT);
+	if (cb->n >= cb->cap) {
+		int cap = cb->cap ? cb->cap * 2 : 64;
+		struct math3d_cmd *cmd = (struct math3d_cmd *)realloc(cb->cmd, cap * sizeof(struct math3d_cmd));
+		if (cmd == NULL)
+			return -1;
+		cb->cmd = cmd;
+		cb->cap = cap;
+	}
+	if (!reserve_register(cb))
+		return -1;
+	struct math3d_cmd *c = &cb->cmd[cb->n++];
+	const char *spec = ops[op].spec;
+	int i, n = 0;
+	c->op = op;
+	for (i=0;spec[i];i++) {
+		if (spec[i] != 'f') {
+			assert(arg[n] >= 0 && arg[n] < cb->nreg);
+			c->arg[n] = arg[n];
+			++n;
+		}
+	}
+	for (;n<3;n++)
+		c->arg[n] = -1;
+	c->f = f;
+	c->dst = new_register(cb, MATH_NULL);
+	return c->dst;
+}
+
+static const char *
+check_args(struct math_context *M, const struct math3d_cmdbuf *cb, const struct math3d_cmd *c, int type[3]) {
+	const char *spec = ops[c->op].spec;
+	int i, n = 0;
+	for (i=0;spec[i];i++) {
+		int t;
+		switch (spec[i]) {
+		case 'f':
+			continue;
+		case 'v':
+			t = MATH_TYPE_VEC4;
+			break;
+		case 'q':
+			t = MATH_TYPE_QUAT;
+			break;
+		case 'm':
+			t = MATH_TYPE_MAT;
+			break;
+		default:
+			t = MATH_TYPE_NULL;
+			break;
+		}
+		type[n] = math_type(M, cb->reg[c->arg[n]]);
+		if (t != MATH_TYPE_NULL && type[n] != t)
+			return "Invalid type";
+		++n;
+	}
+	return NULL;
+}
+
+const char *
+math3d_cmdbuf_execute(struct math_context *M, struct math3d_cmdbuf *cb) {
+	int i;
+	for (i=0;i<cb->ninput;i++) {
+		math_t id = cb->reg[cb->input[i]];
+		if (math_isnull(id))
+			return "Unbound input";
+		if (!math_valid(M, id))
+			return "Invalid math id";
+	}
+	for (i=0;i<cb->n;i++) {
+		const struct math3d_cmd *c = &cb->cmd[i];
+		int type[3];
+		const char *err = check_args(M, cb, c, type);
+		if (err)
+			return err;
+		math_t a = cb->reg[c->arg[0]];
+		math_t b = c->arg[1] >= 0 ? cb->reg[c->arg[1]] : MATH_NULL;
+		math_t r;
+		switch (c->op) {
+		case MATH3D_CMD_ADD:
+			r = math3d_add_vec(M, a, b);
+			break;
+		case MATH3D_CMD_SUB:
+			r = math3d_sub_vec(M, a, b);
+			break;
+		case MATH3D_CMD_MUL:
+			if (type[0] != type[1])
+				return "Need the same type for mul";
+			switch (type[0]) {
+			case MATH_TYPE_MAT:
+				r = math3d_mul_matrix(M, a, b);
+				break;
+			case MATH_TYPE_QUAT:
+				r = math3d_mul_quat(M, a, b);
+				break;
+			default:
+				r = math3d_mul_vec(M, a, b);
+				break;
+			}
+			break;
+		case MATH3D_CMD_MULADD:
+			r = math3d_add_vec(M, math3d_mul_vec(M, a, b), cb->reg[c->arg[2]]);
+			break;
+		case MATH3D_CMD_CROSS:
+			r = math3d_cross(M, a, b);
+			break;
+		case MATH3D_CMD_NORMALIZE:
+			if (type[0] == MATH_TYPE_VEC4)
+				r = math3d_normalize_vector(M, a);
+			else if (type[0] == MATH_TYPE_QUAT)
+				r = math3d_normalize_quat(M, a);
+			else
+				return "Need vector or quat for normalize";
+			break;
+		case MATH3D_CMD_INVERSE:
+			if (type[0] == MATH_TYPE_MAT)
+				r = math3d_inverse_matrix(M, a);
+			else if (type[0] == MATH_TYPE_QUAT)
+				r = math3d_inverse_quat(M, a);
+			else
+				return "Need matrix or quat for inverse";
+			break;
+		case MATH3D_CMD_TRANSPOSE:
+			r = math3d_transpose_matrix(M, a);
+			break;
+		case MATH3D_CMD_TRANSFORM:
+			if (type[0] == MATH_TYPE_QUAT)
+				r = math3d_quat_transform(M, a, b);
+			else if (type[0] == MATH_TYPE_MAT)
+				r = math3d_rotmat_transform(M, a, b);
+			else
+				return "Need matrix or quat for transform";
+			break;
+		case MATH3D_CMD_TRANSFORMH:
+			r = math3d_mulH(M, a, b);
+			break;
+		case MATH3D_CMD_LERP:
+			if (type[0] != type[1])
+				return "Need the same type for lerp";
+			if (type[0] == MATH_TYPE_VEC4)
+				r = math3d_lerp(M, a, b, c->f);
+			else if (type[0] == MATH_TYPE_QUAT)
+				r = math3d_quat_lerp(M, a, b, c->f);
+			else
+				return "Need vector or quat for lerp";
+			break;
+		case MATH3D_CMD_SLERP:
+			r = math3d_quat_slerp(M, a, b, c->f);
+			break;
+		case MATH3D_CMD_SRT:
+			r = math3d_make_srt(M, a, b, cb->reg[c->arg[2]]);
+			break;
+		case MATH3D_CMD_TOMAT:
+			r = math3d_quat_to_matrix(M, a);
+			break;
+		case MATH3D_CMD_TOQUAT:
+			r = math3d_matrix_to_quat(M, a);
+			break;
+		case MATH3D_CMD_RECIPROCAL:
+			r = math3d_reciprocal(M, a);
+			break;
+		default:
+			return "Invalid op";
+		}
+		cb->reg[c->dst] = r;
+	}
+	return NULL;
+}
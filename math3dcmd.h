@@ -0,0 +1,63 @@
+#ifndef math3d_cmd_h
+#define math3d_cmd_h
+
+#include "mathid.h"
+
+// Deferred command buffer : record math ops over registers once, and execute them in one pass.
+// Each command maps to a math3d_* function of math3dfunc.h, the registers are math ids.
+// Registers are inputs (bound to an id before executing) or the results of commands.
+
+enum math3d_cmd_op {
+	MATH3D_CMD_ADD,
+	MATH3D_CMD_SUB,
+	MATH3D_CMD_MUL,
+	MATH3D_CMD_MULADD,
+	MATH3D_CMD_CROSS,
+	MATH3D_CMD_NORMALIZE,
+	MATH3D_CMD_INVERSE,
+	MATH3D_CMD_TRANSPOSE,
+	MATH3D_CMD_TRANSFORM,
+	MATH3D_CMD_TRANSFORMH,
+	MATH3D_CMD_LERP,
+	MATH3D_CMD_SLERP,
+	MATH3D_CMD_SRT,
+	MATH3D_CMD_TOMAT,
+	MATH3D_CMD_TOQUAT,
+	MATH3D_CMD_RECIPROCAL,
+	MATH3D_CMD_COUNT,
+};
+
+struct math3d_cmd {
+	int op;
+	int dst;
+	int arg[3];
+	float f;	// the number argument
+};
+
+struct math3d_cmdbuf {
+	int n;
+	int cap;
+	int nreg;
+	int regcap;
+	int ninput;
+	int inputcap;
+	struct math3d_cmd *cmd;
+	math_t *reg;
+	int *input;	// the input registers, checked once per execute
+};
+
+void math3d_cmdbuf_init(struct math3d_cmdbuf *);
+void math3d_cmdbuf_deinit(struct math3d_cmdbuf *);
+void math3d_cmdbuf_reset(struct math3d_cmdbuf *);
+// returns op or -1; *spec is the arguments : 'v' vec4, 'q' quat, 'm' mat, '*' any of them, 'f' number
+int  math3d_cmdbuf_op(const char *name, const char **spec);
+// returns the register of the input, -1 : out of memory
+int  math3d_cmdbuf_input(struct math3d_cmdbuf *, math_t id);
+// returns 1 if the register is an input
+int  math3d_cmdbuf_isinput(const struct math3d_cmdbuf *, int reg);
+// arg[] are the registers of the value arguments in order, f is the number argument. returns the register of the result, -1 : out of memory
+int  math3d_cmdbuf_push(struct math3d_cmdbuf *, int op, const int *arg, float f);
+// returns NULL if succ, or the error message. The results are transient ids in the registers.
+const char * math3d_cmdbuf_execute(struct math_context *M, struct math3d_cmdbuf *);
+
+#endif
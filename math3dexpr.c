@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "math3dexpr.h"
+
+#define NODE_INPUT 0
+#define NODE_CONST 1
+#define NODE_OP 2
+
+struct node {
+	int kind;
+	int value;	// input or constant index
+	struct math3d_expr_inst inst;	// args are node index before emitting
+};
+
+struct parser {
+	const char *p;
+	struct math3d_expr *e;
+	int fixed;	// input names are given
+	int nnode;
+	int nop;
+	int depth;
+	char *err;
+	struct node node[MATH3D_EXPR_MAXREG];
+};
+
+static const struct {
+	const char *name;
+	int op;
+	int minarg;
+	int maxarg;
+} funcs[] = {
+	{ "add", MATH3D_EXPR_ADD, 2, 2 },
+	{ "sub", MATH3D_EXPR_SUB, 2, 2 },
+	{ "mul", MATH3D_EXPR_MUL, 2, 2 },
+	{ "muladd", MATH3D_EXPR_MULADD, 3, 3 },
+	{ "dot", MATH3D_EXPR_DOT, 2, 2 },
+	{ "cross", MATH3D_EXPR_CROSS, 2, 2 },
+	{ "length", MATH3D_EXPR_LENGTH, 1, 2 },
+	{ "normalize", MATH3D_EXPR_NORMALIZE, 1, 1 },
+	{ "inverse", MATH3D_EXPR_INVERSE, 1, 1 },
+	{ "transpose", MATH3D_EXPR_TRANSPOSE, 1, 1 },
+	{ "transform", MATH3D_EXPR_TRANSFORM, 2, 3 },
+	{ "transformH", MATH3D_EXPR_TRANSFORMH, 2, 2 },
+	{ "lerp", MATH3D_EXPR_LERP, 3, 3 },
+	{ "slerp", MATH3D_EXPR_SLERP, 3, 3 },
+	{ "srt", MATH3D_EXPR_SRT, 3, 3 },
+	{ NULL, 0, 0, 0 },
+};
+
+static int
+error(struct parser *P, const char *msg) {
+	snprintf(P->err, 128, "%s near '%.16s'", msg, P->p);
+	return -1;
+}
+
+static void
+skip_space(struct parser *P) {
+	while (isspace((unsigned char)*P->p))
+		++P->p;
+}
+
+static int
+new_node(struct parser *P, int kind) {
+	if (P->nnode >= MATH3D_EXPR_MAXREG)
+		return error(P, "Too complex");
+	int id = P->nnode++;
+	struct node *n = &P->node[id];
+	memset(n, 0, sizeof(*n));
+	n->kind = kind;
+	return id;
+}
+
+static int
+new_const(struct parser *P, double v) {
+	int id = new_node(P, NODE_CONST);
+	if (id < 0)
+		return -1;
+	P->node[id].value = P->e->nconst;
+	P->e->constant[P->e->nconst++] = v;
+	return id;
+}
+
+static int
+new_op(struct parser *P, int op, int n, const int *arg) {
+	int id = new_node(P, NODE_OP);
+	if (id < 0)
+		return -1;
+	struct node *node = &P->node[id];
+	int i;
+	node->inst.op = op;
+	node->inst.n = n;
+	for (i=0;i<n;i++)
+		node->inst.arg[i] = arg[i];
+	++P->nop;
+	return id;
+}
+
+static int
+input_node(struct parser *P, const char *name, int sz) {
+	struct math3d_expr *e = P->e;
+	int i;
+	for (i=0;i<e->ninput;i++) {
+		if (strncmp(e->input[i], name, sz) == 0 && e->input[i][sz] == 0)
+			break;
+	}
+	if (i == e->ninput) {
+		if (P->fixed)
+			return error(P, "Unknown input");
+		if (e->ninput >= MATH3D_EXPR_MAXINPUT)
+			return error(P, "Too many inputs");
+		if (sz >= MATH3D_EXPR_MAXNAME)
+			return error(P, "Name is too long");
+		memcpy(e->input[i], name, sz);
+		e->input[i][sz] = 0;
+		++e->ninput;
+	}
+	int id = new_node(P, NODE_INPUT);
+	if (id < 0)
+		return -1;
+	P->node[id].value = i;
+	e->used |= 1u << i;
+	return id;
+}
+
+static int parse_expr(struct parser *P);
+
+static int
+parse_call(struct parser *P, const char *name, int sz) {
+	int i;
+	for (i=0;funcs[i].name;i++) {
+		if (strncmp(funcs[i].name, name, sz) == 0 && funcs[i].name[sz] == 0)
+			break;
+	}
+	if (funcs[i].name == NULL)
+		return error(P, "Unknown function");
+	int arg[3];
+	int n = 0;
+	++P->p;	// skip (
+	skip_space(P);
+	if (*P->p != ')') {
+		for (;;) {
+			if (n >= funcs[i].maxarg)
+				return error(P, "Too many arguments");
+			arg[n] = parse_expr(P);
+			if (arg[n] < 0)
+				return -1;
+			++n;
+			skip_space(P);
+			if (*P->p != ',')
+				break;
+			++P->p;
+		}
+	}
+	if (*P->p != ')')
+		return error(P, "Need )");
+	++P->p;
+	if (n < funcs[i].minarg)
+		return error(P, "Need more arguments");
+	return new_op(P, funcs[i].op, n, arg);
+}
+
+static int
+parse_primary(struct parser *P) {
+	skip_space(P);
+	const char *s = P->p;
+	if (*s == '(') {
+		++P->p;
+		int id = parse_expr(P);
+		if (id < 0)
+			return -1;
+		skip_space(P);
+		if (*P->p != ')')
+			return error(P, "Need )");
+		++P->p;
+		return id;
+	}
+	if (isdigit((unsigned char)*s) || (*s == '.' && isdigit((unsigned char)s[1]))) {
+		char *end;
+		double v = strtod(s, &end);
+		P->p = end;
+		return new_const(P, v);
+	}
+	if (isalpha((unsigned char)*s) || *s == '_') {
+		while (isalnum((unsigned char)*P->p) || *P->p == '_')
+			++P->p;
+		int sz = (int)(P->p - s);
+		skip_space(P);
+		if (*P->p == '(')
+			return parse_call(P, s, sz);
+		return input_node(P, s, sz);
+	}
+	return error(P, "Unexpected symbol");
+}
+
+static int
+parse_unary(struct parser *P);
+
+static int
+parse_neg(struct parser *P) {
+	skip_space(P);
+	if (*P->p == '-') {
+		++P->p;
+		int id = parse_unary(P);
+		if (id < 0)
+			return -1;
+		struct node *n = &P->node[id];
+		if (n->kind == NODE_CONST) {
+			P->e->constant[n->value] = -P->e->constant[n->value];
+			return id;
+		}
+		return new_op(P, MATH3D_EXPR_NEG, 1, &id);
+	}
+	return parse_primary(P);
+}
+
+// every recursion (parentheses, calls and unary minus) passes here
+static int
+parse_unary(struct parser *P) {
+	if (P->depth >= MATH3D_EXPR_MAXDEPTH)
+		return error(P, "Too deep");
+	++P->depth;
+	int id = parse_neg(P);
+	--P->depth;
+	return id;
+}
+
+static int
+parse_term(struct parser *P) {
+	int arg[3];
+	arg[0] = parse_unary(P);
+	if (arg[0] < 0)
+		return -1;
+	for (;;) {
+		skip_space(P);
+		if (*P->p != '*')
+			return arg[0];
+		++P->p;
+		arg[1] = parse_unary(P);
+		if (arg[1] < 0)
+			return -1;
+		arg[0] = new_op(P, MATH3D_EXPR_MUL, 2, arg);
+		if (arg[0] < 0)
+			return -1;
+	}
+}
+
+static int
+parse_expr(struct parser *P) {
+	int arg[3];
+	arg[0] = parse_term(P);
+	if (arg[0] < 0)
+		return -1;
+	for (;;) {
+		skip_space(P);
+		int op;
+		if (*P->p == '+') {
+			op = MATH3D_EXPR_ADD;
+		} else if (*P->p == '-') {
+			op = MATH3D_EXPR_SUB;
+		} else {
+			return arg[0];
+		}
+		++P->p;
+		arg[1] = parse_term(P);
+		if (arg[1] < 0)
+			return -1;
+		arg[0] = new_op(P, op, 2, arg);
+		if (arg[0] < 0)
+			return -1;
+	}
+}
+
+static int
+node_register(const struct parser *P, const int opreg[], int id) {
+	const struct node *n = &P->node[id];
+	switch (n->kind) {
+	case NODE_INPUT:
+		return n->value;
+	case NODE_CONST:
+		return P->e->ninput + n->value;
+	default:
+		return opreg[id];
+	}
+}
+
+const char *
+math3d_expr_compile(struct math3d_expr *e, const char *source, int nname, const char *names[], char err[128]) {
+	struct parser P;
+	int i, j;
+	memset(e, 0, sizeof(*e));
+	P.p = source;
+	P.e = e;
+	P.fixed = nname > 0;
+	P.nnode = 0;
+	P.nop = 0;
+	P.depth = 0;
+	P.err = err;
+	if (nname > MATH3D_EXPR_MAXINPUT) {
+		snprintf(err, 128, "Too many inputs (%d)", nname);
+		return err;
+	}
+	for (i=0;i<nname;i++) {
+		if (strlen(names[i]) >= MATH3D_EXPR_MAXNAME) {
+			snprintf(err, 128, "Name %s is too long", names[i]);
+			return err;
+		}
+		strcpy(e->input[i], names[i]);
+	}
+	e->ninput = nname;
+	int root = parse_expr(&P);
+	if (root < 0)
+		return err;
+	skip_space(&P);
+	if (*P.p != 0) {
+		error(&P, "Unexpected symbol");
+		return err;
+	}
+	if (e->ninput + e->nconst + P.nop > MATH3D_EXPR_MAXREG) {
+		snprintf(err, 128, "Too complex");
+		return err;
+	}
+	// nodes are created after their args, so the instructions are in order
+	int opreg[MATH3D_EXPR_MAXREG];
+	int reg = e->ninput + e->nconst;
+	for (i=0;i<P.nnode;i++) {
+		struct node *n = &P.node[i];
+		if (n->kind == NODE_OP) {
+			struct math3d_expr_inst *inst = &e->inst[e->ninst++];
+			*inst = n->inst;
+			for (j=0;j<inst->n;j++)
+				inst->arg[j] = node_register(&P, opreg, inst->arg[j]);
+			opreg[i] = reg;
+			inst->dst = reg++;
+		}
+	}
+	e->result = node_register(&P, opreg, root);
+	return NULL;
+}
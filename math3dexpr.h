@@ -0,0 +1,67 @@
+#ifndef math3d_expr_h
+#define math3d_expr_h
+
+#include <stdint.h>
+#include "mathid.h"
+
+// Compiled math expressions : infix + - * , unary -, numbers, named inputs and function calls
+// (add, sub, mul, muladd, dot, cross, length, normalize, inverse, transpose, transform, transformH, lerp, slerp, srt).
+// The expression is compiled once into the instructions over registers, and evaluated without transient intermediates.
+// The results are the same as the chain of the math3d functions with the same names.
+
+#define MATH3D_EXPR_MAXREG 64
+#define MATH3D_EXPR_MAXINPUT 16
+#define MATH3D_EXPR_MAXNAME 32
+#define MATH3D_EXPR_MAXDEPTH 64	// nested parentheses, calls and unary minus
+
+enum math3d_expr_op {
+	MATH3D_EXPR_ADD,
+	MATH3D_EXPR_SUB,
+	MATH3D_EXPR_MUL,
+	MATH3D_EXPR_NEG,
+	MATH3D_EXPR_MULADD,
+	MATH3D_EXPR_DOT,
+	MATH3D_EXPR_CROSS,
+	MATH3D_EXPR_LENGTH,
+	MATH3D_EXPR_NORMALIZE,
+	MATH3D_EXPR_INVERSE,
+	MATH3D_EXPR_TRANSPOSE,
+	MATH3D_EXPR_TRANSFORM,
+	MATH3D_EXPR_TRANSFORMH,
+	MATH3D_EXPR_LERP,
+	MATH3D_EXPR_SLERP,
+	MATH3D_EXPR_SRT,
+};
+
+struct math3d_expr_inst {
+	uint8_t op;
+	uint8_t n;	// number of args
+	uint8_t dst;
+	uint8_t arg[3];
+};
+
+// registers : [0, ninput) inputs, [ninput, ninput + nconst) constants, the others are the results of instructions
+struct math3d_expr {
+	int ninput;
+	int nconst;
+	int ninst;
+	int result;	// register of the result
+	uint32_t used;	// bitset of the inputs referenced by the expression
+	double constant[MATH3D_EXPR_MAXREG];
+	struct math3d_expr_inst inst[MATH3D_EXPR_MAXREG];
+	char input[MATH3D_EXPR_MAXINPUT][MATH3D_EXPR_MAXNAME];
+};
+
+// an input, a math id or a number (id is MATH_NULL)
+struct math3d_expr_arg {
+	math_t id;
+	double n;
+};
+
+// names (can be NULL) is the order of inputs, or the order of the first appearance if nname == 0.
+// returns NULL if succ, or the error message in err
+const char * math3d_expr_compile(struct math3d_expr *e, const char *source, int nname, const char *names[], char err[128]);
+// *result is MATH_NULL if the result is a number (in *number). returns NULL if succ, or the error message
+const char * math3d_expr_eval(struct math_context *M, const struct math3d_expr *e, const struct math3d_expr_arg *input, math_t *result, double *number);
+
+#endif
@@ -8,6 +8,7 @@
 extern "C" {
 	#include "mathid.h"
 	#include "math3dfunc.h"
+	#include "math3dexpr.h"
 }
 
 #ifndef M_PI
@@ -123,6 +124,19 @@ VEC3(struct math_context *M, math_t v3) {
 	return *(const glm::vec3 *)(v);
 }
 
+static inline const float *
+VIEWPTR(const struct math_view &v, int i) {
+	return (const float *)((const char *)v.ptr + (size_t)v.stride * i);
+}
+
+static inline glm::vec4
+VIEWVEC(const struct math_view &v, int i) {
+	const float *p = VIEWPTR(v, i);
+	if (v.vec3)
+		return glm::vec4(p[0], p[1], p[2], 1.0f);
+	return VECPTR(p);
+}
+
 static inline const glm::vec3* V3P(const glm::vec4 &v4) { return (const glm::vec3*)(&v4.x);}
 static inline const glm::vec3& V3R(const glm::vec4 &v4) { return *V3P(v4);}
 
@@ -210,38 +224,34 @@ math3d_make_quat_from_euler(struct math_context *M, math_t euler) {
 }
 
 static int
-scale1(struct math_context *M, math_t s) {
-	const float * v = math_value(M, s);
+scale1(const float *v) {
 	return v[0] == 1 && v[1] == 1 && v[2] == 1;
 }
 
 static int
-rot0(struct math_context *M, math_t r) {
-	const float * v = math_value(M, r);
+rot0(const float *v) {
 	return v[0] == 0 && v[1] == 0 && v[2] == 0 && v[3] == 1;
 }
 
 static int
-trans0(struct math_context *M, math_t t) {
-	const float * v = math_value(M, t);
+trans0(const float *v) {
 	return v[0] == 0 && v[1] == 0 && v[2] == 0;
 }
 
-math_t
-math3d_make_srt(struct math_context *M, math_t s, math_t r, math_t t) {
-	math_t id;
-	glm::mat4x4 &srt = allocmat(M, &id);
+// s/r/t can be NULL, returns 1 if srt is identity
+static int
+make_srt(glm::mat4x4 &srt, const float *s, const float *r, const float *t) {
 	int ident = 1;
-	if (!math_isnull(s) && !scale1(M, s)) {
+	if (s && !scale1(s)) {
 		srt = glm::mat4x4(1);
-		const glm::vec3 &scale = VEC3(M, s);
+		const glm::vec3 &scale = *(const glm::vec3 *)s;
 		srt[0][0] = scale[0];
 		srt[1][1] = scale[1];
 		srt[2][2] = scale[2];
 		ident = 0;
 	}
-	if (!math_isnull(r) && !rot0(M, r)) {
-		const glm::quat &q = QUAT(M, r);
+	if (r && !rot0(r)) {
+		const glm::quat &q = *(const glm::quat *)r;
 		if (!ident) {
 			srt = glm::mat4x4(q) * srt;
 		} else {
@@ -251,15 +261,35 @@ math3d_make_srt(struct math_context *M, math_t s, math_t r, math_t t) {
 	} else if (ident) {
 		srt = glm::mat4x4(1);
 	}
-	if (!math_isnull(t) && !trans0(M, t)) {
-		const glm::vec3 &translate = VEC3(M, t);
+	if (t && !trans0(t)) {
+		const glm::vec3 &translate = *(const glm::vec3 *)t;
 		srt[3][0] = translate[0];
 		srt[3][1] = translate[1];
 		srt[3][2] = translate[2];
 		srt[3][3] = 1;
 		ident = 0;
 	}
-	if (ident) {
+	return ident;
+}
+
+math_t
+math3d_make_srt(struct math_context *M, math_t s, math_t r, math_t t) {
+	math_t id;
+	glm::mat4x4 &srt = allocmat(M, &id);
+	const float *sv = NULL, *rv = NULL, *tv = NULL;
+	if (!math_isnull(s)) {
+		check_type(M, s, MATH_TYPE_VEC4);
+		sv = math_value(M, s);
+	}
+	if (!math_isnull(r)) {
+		check_type(M, r, MATH_TYPE_QUAT);
+		rv = math_value(M, r);
+	}
+	if (!math_isnull(t)) {
+		check_type(M, t, MATH_TYPE_VEC4);
+		tv = math_value(M, t);
+	}
+	if (make_srt(srt, sv, rv, tv)) {
 		return math_identity(MATH_TYPE_MAT);
 	}
 
@@ -422,11 +452,14 @@ math3d_mul_matrix_array(struct math_context *M, math_t mat, math_t array_mat, ma
 					sz = output_sz;
 			}
 			int i;
-			const float * lm = math_value(M, mat);
-			const float * rm = math_value(M, array_mat);
-			float * out_buf = math_init(M, output_ref);
-			for (i=0;i<sz;i++) {
-				matrix_mul(out_buf + i * 16, lm + i * 16, rm + i * 16);
+			struct math_view lm, rm, out;
+			math_view(M, mat, &lm);
+			math_view(M, array_mat, &rm);
+			math_view(M, output_ref, &out);
+			if (!math3d_mul_matrix_batch((float *)out.ptr, out.stride, lm.ptr, lm.stride, rm.ptr, rm.stride, sz)) {
+				for (i=0;i<sz;i++) {
+					matrix_mul((float *)VIEWPTR(out, i), VIEWPTR(lm, i), VIEWPTR(rm, i));
+				}
 			}
 			return output_ref;
 		}
@@ -434,17 +467,21 @@ math3d_mul_matrix_array(struct math_context *M, math_t mat, math_t array_mat, ma
 
 	// matrix * array
 
+	int i;
+	struct math_view in, out;
 	if (math_isidentity(mat)) {
 		// mul identity, copy array
 		if (math_isnull(output_ref)) {
 			return array_mat;
 		} else {
-			float * result = math_init(M, output_ref);
-			const float * source = math_value(M, array_mat);
+			math_view(M, array_mat, &in);
+			math_view(M, output_ref, &out);
 			int sz_output = math_size(M, output_ref);
 			if (sz_output < sz)
 				sz = sz_output;
-			memcpy(result, source, sz * 16 * sizeof(float));
+			for (i=0;i<sz;i++) {
+				memcpy((float *)VIEWPTR(out, i), VIEWPTR(in, i), 16 * sizeof(float));
+			}
 			return output_ref;
 		}
 	}
@@ -456,22 +493,257 @@ math3d_mul_matrix_array(struct math_context *M, math_t mat, math_t array_mat, ma
 		if (output_sz < sz)
 			sz = output_sz;
 	}
-	int i;
 	const float * m = math_value(M, mat);
-	float * out_buf = math_init(M, output_ref);
-	const float * in_buf = math_value(M, array_mat);
+	math_view(M, array_mat, &in);
+	math_view(M, output_ref, &out);
 	if (reverse) {
+		if (math3d_mul_matrix_batch((float *)out.ptr, out.stride, in.ptr, in.stride, m, 0, sz))
+			return output_ref;
 		for (i=0;i<sz;i++) {
-			matrix_mul(out_buf + i * 16, in_buf + i * 16, m);
+			matrix_mul((float *)VIEWPTR(out, i), VIEWPTR(in, i), m);
 		}
 	} else {
+		if (math3d_mul_matrix_batch((float *)out.ptr, out.stride, m, 0, in.ptr, in.stride, sz))
+			return output_ref;
 		for (i=0;i<sz;i++) {
-			matrix_mul(out_buf + i * 16, m, in_buf + i * 16);
+			matrix_mul((float *)VIEWPTR(out, i), m, VIEWPTR(in, i));
+		}
+	}
+	return output_ref;
+}
+
+static inline const float *
+view_element(const struct math_view &v, int i) {
+	if (v.ptr == NULL)
+		return NULL;
+	return VIEWPTR(v, v.size == 1 ? 0 : i);
+}
+
+static inline void
+view_optional(struct math_context *M, math_t id, int type, int n, struct math_view *v) {
+	if (math_isnull(id)) {
+		v->ptr = NULL;
+		return;
+	}
+	check_type(M, id, type);
+	math_view(M, id, v);
+	assert(v->size == 1 || v->size >= n);
+	if (v->vec3) {
+		// gather float[3] into vec4
+		v->ptr = math_value(M, id);
+		v->stride = 4 * sizeof(float);
+		v->vec3 = 0;
+	}
+}
+
+int
+math3d_transform_hierarchy(struct math_context *M, math_t world, const int *parent, int n, math_t local, math_t s, math_t r, math_t t, const uint32_t *dirty) {
+	struct math_view wv, lv, sv, rv, tv;
+	check_type(M, world, MATH_TYPE_MAT);
+	math_view(M, world, &wv);
+	assert(wv.size >= n);
+	view_optional(M, local, MATH_TYPE_MAT, n, &lv);
+	if (lv.ptr == NULL) {
+		view_optional(M, s, MATH_TYPE_VEC4, n, &sv);
+		view_optional(M, r, MATH_TYPE_QUAT, n, &rv);
+		view_optional(M, t, MATH_TYPE_VEC4, n, &tv);
+	}
+	uint32_t *updated = NULL;
+	if (dirty) {
+		// the nodes recomputed in this call, for propagating to the children
+		math_t tmp = math_import(M, NULL, MATH_TYPE_VEC4, (n + 127) / 128);
+		updated = (uint32_t *)math_init(M, tmp);
+		memset(updated, 0, (n + 31) / 32 * sizeof(uint32_t));
+	}
+	int count = 0;
+	int i;
+	for (i=0;i<n;i++) {
+		const int p = parent[i];
+		assert(p < i);
+		if (dirty) {
+			const int d = (dirty[i / 32] >> (i % 32)) & 1;
+			if (!d && (p < 0 || !((updated[p / 32] >> (p % 32)) & 1)))
+				continue;
+			updated[i / 32] |= 1u << (i % 32);
+		}
+		glm::mat4x4 m;
+		if (lv.ptr) {
+			m = *(const glm::mat4x4 *)VIEWPTR(lv, i);
+		} else {
+			make_srt(m, view_element(sv, i), view_element(rv, i), view_element(tv, i));
 		}
+		glm::mat4x4 &w = *(glm::mat4x4 *)VIEWPTR(wv, i);
+		if (p >= 0) {
+			w = *(const glm::mat4x4 *)VIEWPTR(wv, p) * m;
+		} else {
+			w = m;
+		}
+		++count;
 	}
+	return count;
+}
+
+static int
+array_equal(const struct math_view &v, const float *e, int c, int n) {
+	int i, j;
+	for (i=0;i<n;i++) {
+		const float *p = VIEWPTR(v, i);
+		for (j=0;j<c;j++) {
+			if (p[j] != e[j])
+				return 0;
+		}
+	}
+	return 1;
+}
+
+math_t
+math3d_make_srt_array(struct math_context *M, math_t s, math_t r, math_t t, math_t output_ref) {
+	static const float ident[3][4] = {
+		{ 1, 1, 1, 0 },
+		{ 0, 0, 0, 1 },
+		{ 0, 0, 0, 0 },
+	};
+	math_t srt[3] = { s, r, t };
+	int i;
+	int n = 1;
+	for (i=0;i<3;i++) {
+		if (!math_isnull(srt[i])) {
+			int sz = math_size(M, srt[i]);
+			if (sz > n)
+				n = sz;
+		}
+	}
+	if (!math_isnull(output_ref)) {
+		check_type(M, output_ref, MATH_TYPE_MAT);
+		assert(math_size(M, output_ref) >= n);
+	} else {
+		output_ref = math_import(M, NULL, MATH_TYPE_MAT, n);
+	}
+	struct math_view v[3], out;
+	view_optional(M, s, MATH_TYPE_VEC4, n, &v[0]);
+	view_optional(M, r, MATH_TYPE_QUAT, n, &v[1]);
+	view_optional(M, t, MATH_TYPE_VEC4, n, &v[2]);
+	const float *ptr[3];
+	int stride[3];
+	for (i=0;i<3;i++) {
+		if (v[i].ptr == NULL) {
+			ptr[i] = NULL;
+			stride[i] = 0;
+		} else {
+			int sz = v[i].size == 1 ? 1 : n;
+			// the same shortcuts of math3d_make_srt, if the whole array is identity
+			ptr[i] = array_equal(v[i], ident[i], i == 1 ? 4 : 3, sz) ? NULL : v[i].ptr;
+			stride[i] = v[i].size == 1 ? 0 : v[i].stride;
+		}
+	}
+	math_view(M, output_ref, &out);
+	math3d_srt_batch((float *)out.ptr, out.stride, ptr[0], stride[0], ptr[1], stride[1], ptr[2], stride[2], n);
+	return output_ref;
+}
+
+void
+math3d_decompose_matrix_array(struct math_context *M, math_t mat, math_t v[3]) {
+	check_type(M, mat, MATH_TYPE_MAT);
+	int n = math_size(M, mat);
+	struct math_view m;
+	math_view(M, mat, &m);
+	v[0] = math_import(M, NULL, MATH_TYPE_VEC4, n);
+	v[1] = math_import(M, NULL, MATH_TYPE_QUAT, n);
+	v[2] = math_import(M, NULL, MATH_TYPE_VEC4, n);
+	float *scale = math_init(M, v[0]);
+	float *quat = math_init(M, v[1]);
+	float *trans = math_init(M, v[2]);
+	math3d_decompose_batch(m.ptr, m.stride, n, scale, quat, trans);
+}
+
+math_t
+math3d_blend_array(struct math_context *M, int mode, math_t a, math_t b, const float *weight, int nweight, math_t output_ref) {
+	int type = math_type(M, a);
+	assert(type == MATH_TYPE_VEC4 || type == MATH_TYPE_QUAT);
+	int n = math_size(M, a);
+	if (math_size(M, b) > n)
+		n = math_size(M, b);
+	if (!math_isnull(output_ref)) {
+		check_type(M, output_ref, type);
+		assert(math_size(M, output_ref) >= n);
+	} else {
+		output_ref = math_import(M, NULL, type, n);
+	}
+	assert(nweight == 1 || nweight >= n);
+	struct math_view av, bv, out;
+	view_optional(M, a, type, n, &av);
+	view_optional(M, b, type, n, &bv);
+	math_view(M, output_ref, &out);
+	assert(!out.vec3);
+	math3d_blend_batch(mode, type == MATH_TYPE_QUAT, (float *)out.ptr, out.stride,
+		av.ptr, av.size == 1 ? 0 : av.stride,
+		bv.ptr, bv.size == 1 ? 0 : bv.stride,
+		weight, nweight == 1 ? 0 : (int)sizeof(float), n);
 	return output_ref;
 }
 
+int
+math3d_skin_palette(struct math_context *M, math_t root, math_t world, math_t invbind, void *output, int ostride, int format) {
+	check_type(M, world, MATH_TYPE_MAT);
+	check_type(M, invbind, MATH_TYPE_MAT);
+	int n = math_size(M, world);
+	struct math_view wv, bv;
+	math_view(M, world, &wv);
+	math_view(M, invbind, &bv);
+	assert(bv.size >= n);
+	const float *r = NULL;
+	if (!math_isnull(root) && !math_isidentity(root)) {
+		check_type(M, root, MATH_TYPE_MAT);
+		r = math_value(M, root);
+	}
+	if (ostride == 0)
+		ostride = (format == MATH3D_PALETTE_3X4 ? 12 : 16) * sizeof(float);
+	math3d_skin_palette_batch((float *)output, ostride, format, r, wv.ptr, wv.stride, bv.ptr, bv.stride, n);
+	return n;
+}
+
+int
+math3d_export(struct math_context *M, const math_t *id, int n, int format, void *output) {
+	int layout = format & ~MATH3D_EXPORT_HALF;
+	int esize = (layout == MATH3D_EXPORT_MAT4 ? 16 : layout == MATH3D_EXPORT_3X4 ? 12 : 4)
+		* (int)((format & MATH3D_EXPORT_HALF) ? sizeof(uint16_t) : sizeof(float));
+	int i, j;
+	int count = 0;
+	for (i=0;i<n;i++) {
+		int type = math_type(M, id[i]);
+		int size = math_size(M, id[i]);
+		if (type == MATH_TYPE_MAT) {
+			if (layout == MATH3D_EXPORT_VEC4)
+				size *= 4;
+		} else if (type == MATH_TYPE_NULL || layout != MATH3D_EXPORT_VEC4) {
+			return -1;
+		}
+		count += size;
+	}
+	if (output == NULL)
+		return count * esize;
+	char *o = (char *)output;
+	for (i=0;i<n;i++) {
+		struct math_view v;
+		math_view(M, id[i], &v);
+		if (v.vec3) {
+			// gather float[3] into vec4
+			v.ptr = math_value(M, id[i]);
+			v.stride = 4 * sizeof(float);
+		}
+		if (layout == MATH3D_EXPORT_VEC4 && math_type(M, id[i]) == MATH_TYPE_MAT) {
+			for (j=0;j<v.size;j++) {
+				math3d_export_batch(o, format, (const float *)((const char *)v.ptr + (size_t)v.stride * j), 4 * sizeof(float), 4);
+				o += 4 * esize;
+			}
+		} else {
+			math3d_export_batch(o, format, v.ptr, v.stride, v.size);
+			o += v.size * esize;
+		}
+	}
+	return count * esize;
+}
+
 float
 math3d_length(struct math_context *M, math_t v) {
 	return glm::length(VEC3(M, v));
@@ -918,8 +1190,7 @@ maxv(struct math_context *M, math_t v0, math_t v1) {
 }
 
 static inline glm::vec4
-transform_pt(struct math_context *M, const glm::mat4& m, math_t p){
-	glm::vec4 v = VEC(M, p);
+transform_pt(const glm::mat4& m, glm::vec4 v){
 	v.w = 1.f;//we assue p must be a point
 	v = m * v;
 	return v / v.w;
@@ -927,25 +1198,27 @@ transform_pt(struct math_context *M, const glm::mat4& m, math_t p){
 
 math_t
 math3d_minmax(struct math_context *M, math_t transform, math_t points) {
-	const size_t numpoints	= math_size(M, points);
+	check_type(M, points, MATH_TYPE_VEC4);
+	struct math_view pv;
+	math_view(M, points, &pv);
+	const int numpoints = pv.size;
 	if (numpoints == 0)
 		return MATH_NULL;
 
-	const math_t p = math_index(M, points, 0);
 	glm::vec4 minmax[2];
 
 	if (math_isnull(transform)){
-		minmax[0] = minmax[1] = VEC(M, p);
-		for (int ii=1; ii<(int)numpoints; ++ii){
-			const auto& pp = VEC(M, math_index(M, points, ii));
+		minmax[0] = minmax[1] = VIEWVEC(pv, 0);
+		for (int ii=1; ii<numpoints; ++ii){
+			const glm::vec4 pp = VIEWVEC(pv, ii);
 			minmax[0] = glm::min(minmax[0], pp);
 			minmax[1] = glm::max(minmax[1], pp);
 		}
 	} else {
 		const glm::mat4& m = MAT(M, transform);
-		minmax[0] = minmax[1] = transform_pt(M, m, p);
-		for (int ii=1; ii<(int)numpoints; ++ii){
-			const glm::vec4 tpp = transform_pt(M, m, math_index(M, points, ii));
+		minmax[0] = minmax[1] = transform_pt(m, VIEWVEC(pv, 0));
+		for (int ii=1; ii<numpoints; ++ii){
+			const glm::vec4 tpp = transform_pt(m, VIEWVEC(pv, ii));
 			minmax[0] = glm::min(minmax[0], tpp);
 			minmax[1] = glm::max(minmax[1], tpp);
 		}
@@ -1081,9 +1354,12 @@ math3d_box_center(struct math_context *M, math_t points) {
 	math_t id;
 	glm::vec4 &c = allocvec4(M, &id);
 	c = glm::vec4(0, 0, 0, 1);
+	struct math_view pv;
+	math_view(M, points, &pv);
+	assert(pv.size >= 8);
 	int ii;
 	for (ii = 0; ii < 8; ++ii) {
-		c += VEC(M, math_index(M, points, ii));
+		c += VIEWVEC(pv, ii);
 	}
 
 	c /= 8.f;
@@ -1101,10 +1377,12 @@ math3d_frusutm_aabb(struct math_context *M, math_t points) {
 	t.minv = glm::vec4(std::numeric_limits<float>::max()),
 	t.maxv = glm::vec4(std::numeric_limits<float>::lowest());
 
-	const float * points_v = math_value(M, points);
+	struct math_view pv;
+	math_view(M, points, &pv);
+	assert(pv.size >= 8);
 
 	for (int ii = 0; ii < 8; ++ii){
-		const auto &p = VECPTR(points_v + ii * 4);
+		const glm::vec4 p = VIEWVEC(pv, ii);
 		t.minv = glm::min(t.minv, p);
 		t.maxv = glm::max(t.maxv, p);
 	}
@@ -1639,6 +1917,779 @@ math3d_ray_triangles(struct math_context *M, math_t o, math_t d, const struct tr
 	return 0;
 }
 
+// BVH of triangles, a flat binary blob : header, nodes, [reordered triangles], original indices of triangles
+// The bvh of an indexed mesh keeps no triangles, it reads the vertices from the mesh in place.
+
+#define BVH_MAGIC 0x48564233	// "3BVH"
+#define BVH_LEAF_SIZE 4
+#define BVH_BINS 12
+#define BVH_STACK 64
+
+struct bvh_header {
+	uint32_t magic;
+	uint32_t numnodes;
+	uint32_t numtriangles;
+	uint32_t type;	// MATH3D_BVH_TRIANGLES or MATH3D_BVH_MESH
+};
+
+struct bvh_node {
+	float minv[3];
+	uint32_t first;	// leaf : first triangle, node : left child (right child is first + 1)
+	float maxv[3];
+	uint32_t count;	// 0 : node
+};
+
+static_assert(sizeof(struct bvh_node) == 32, "Invalid bvh node size");
+
+struct bvh_bounds {
+	glm::vec3 minv;
+	glm::vec3 maxv;
+	void init() {
+		minv = glm::vec3(std::numeric_limits<float>::max());
+		maxv = glm::vec3(std::numeric_limits<float>::lowest());
+	}
+	void merge(const glm::vec3 &p) {
+		minv = glm::min(minv, p);
+		maxv = glm::max(maxv, p);
+	}
+	void merge(const bvh_bounds &b) {
+		minv = glm::min(minv, b.minv);
+		maxv = glm::max(maxv, b.maxv);
+	}
+	float area() const {
+		const glm::vec3 e = maxv - minv;
+		if (e.x < 0)
+			return 0;
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+};
+
+static inline const glm::vec3 &
+tri_vertex(const struct triangle &tri, int i) {
+	return *(const glm::vec3 *)tri.p[i].v;
+}
+
+// The sources of triangles : get(i, v) fetch the vertices of triangle i
+
+struct triangle_source {
+	const struct triangle *triangles;
+	void get(uint32_t i, glm::vec3 v[3]) const {
+		const struct triangle &tri = triangles[i];
+		v[0] = tri_vertex(tri, 0);
+		v[1] = tri_vertex(tri, 1);
+		v[2] = tri_vertex(tri, 2);
+	}
+};
+
+struct mesh_source {
+	const struct math3d_mesh *mesh;
+	uint32_t vertex_index(uint32_t i) const {
+		if (mesh->index == NULL)
+			return i;
+		if (mesh->index_size == 2)
+			return ((const uint16_t *)mesh->index)[i];
+		return ((const uint32_t *)mesh->index)[i];
+	}
+	void get(uint32_t i, glm::vec3 v[3]) const {
+		const char *vb = (const char *)mesh->vertex;
+		for (int k=0;k<3;k++) {
+			const uint32_t vi = vertex_index(i * 3 + k);
+			if (vi >= mesh->numvertices) {
+				v[0] = v[1] = v[2] = glm::vec3(0);	// degenerated, never hit
+				return;
+			}
+			memcpy(&v[k], vb + (size_t)mesh->stride * vi, sizeof(glm::vec3));
+		}
+	}
+};
+
+int
+math3d_mesh_check(const struct math3d_mesh *mesh) {
+	const mesh_source src = { mesh };
+	const uint32_t n = mesh->numtriangles * 3;
+	uint32_t i;
+	for (i=0;i<n;i++) {
+		if (src.vertex_index(i) >= mesh->numvertices)
+			return 0;
+	}
+	return 1;
+}
+
+template <typename Source>
+static inline glm::vec3
+source_centroid(const Source &src, uint32_t i) {
+	glm::vec3 v[3];
+	src.get(i, v);
+	return (v[0] + v[1] + v[2]) * (1.0f / 3.0f);
+}
+
+template <typename Source>
+static inline void
+source_bounds(const Source &src, uint32_t i, bvh_bounds &b) {
+	glm::vec3 v[3];
+	src.get(i, v);
+	b.merge(v[0]);
+	b.merge(v[1]);
+	b.merge(v[2]);
+}
+
+size_t
+math3d_bvh_size(uint32_t numtriangles) {
+	// enough for building : at most 2n-1 nodes
+	size_t n = numtriangles;
+	return sizeof(struct bvh_header) + (2 * n) * sizeof(struct bvh_node) + n * (sizeof(struct triangle) + sizeof(uint32_t));
+}
+
+size_t
+math3d_bvh_mesh_size(uint32_t numtriangles) {
+	size_t n = numtriangles;
+	return sizeof(struct bvh_header) + (2 * n) * sizeof(struct bvh_node) + n * sizeof(uint32_t);
+}
+
+// returns the number of triangles after partition in [first, first + count), 0 : no good split
+template <typename Source>
+static uint32_t
+bvh_split(const Source &src, uint32_t *index, uint32_t first, uint32_t count, const bvh_bounds &nb) {
+	bvh_bounds cb;
+	cb.init();
+	uint32_t i;
+	for (i=0;i<count;i++) {
+		cb.merge(source_centroid(src, index[first + i]));
+	}
+	const glm::vec3 extent = cb.maxv - cb.minv;
+	int axis = 0;
+	if (extent.y > extent[axis])
+		axis = 1;
+	if (extent.z > extent[axis])
+		axis = 2;
+	if (extent[axis] <= 0)
+		return 0;
+
+	struct {
+		bvh_bounds b;
+		uint32_t n;
+	} bins[BVH_BINS];
+	for (i=0;i<BVH_BINS;i++) {
+		bins[i].b.init();
+		bins[i].n = 0;
+	}
+	const float scale = BVH_BINS / extent[axis];
+	auto bin_of = [&](uint32_t tri) {
+		int b = (int)((source_centroid(src, tri)[axis] - cb.minv[axis]) * scale);
+		return b < BVH_BINS ? b : BVH_BINS - 1;
+	};
+	for (i=0;i<count;i++) {
+		const uint32_t tri = index[first + i];
+		int b = bin_of(tri);
+		bins[b].n++;
+		source_bounds(src, tri, bins[b].b);
+	}
+	// surface area heuristic, sweep from the right then from the left
+	float right_cost[BVH_BINS];
+	bvh_bounds acc;
+	acc.init();
+	uint32_t n = 0;
+	for (i=BVH_BINS-1;i>0;i--) {
+		acc.merge(bins[i].b);
+		n += bins[i].n;
+		right_cost[i] = acc.area() * n;
+	}
+	acc.init();
+	n = 0;
+	int best = -1;
+	float best_cost = nb.area() * count;	// the cost of a leaf
+	for (i=0;i<BVH_BINS-1;i++) {
+		acc.merge(bins[i].b);
+		n += bins[i].n;
+		const float cost = acc.area() * n + right_cost[i+1];
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = i;
+		}
+	}
+	if (best < 0) {
+		if (count > BVH_LEAF_SIZE * 4)
+			best = BVH_BINS / 2 - 1;	// too large for a leaf, split at middle anyway
+		else
+			return 0;
+	}
+	uint32_t lo = first, hi = first + count;
+	while (lo < hi) {
+		if (bin_of(index[lo]) <= best) {
+			++lo;
+		} else {
+			std::swap(index[lo], index[--hi]);
+		}
+	}
+	const uint32_t left = lo - first;
+	if (left == 0 || left == count)
+		return 0;
+	return left;
+}
+
+// build the nodes after header, index (numtriangles) is the order of triangles in leaves. returns the number of nodes
+template <typename Source>
+static uint32_t
+bvh_build_nodes(const Source &src, uint32_t numtriangles, struct bvh_node *nodes, uint32_t *index) {
+	uint32_t i;
+	for (i=0;i<numtriangles;i++) {
+		index[i] = i;
+	}
+	uint32_t numnodes = 1;
+	struct { uint32_t node, first, count, depth; } stack[BVH_STACK];
+	int top = 0;
+	stack[top++] = { 0, 0, numtriangles, 0 };
+	while (top > 0) {
+		--top;
+		const uint32_t ni = stack[top].node;
+		const uint32_t first = stack[top].first;
+		const uint32_t count = stack[top].count;
+		const uint32_t depth = stack[top].depth;
+		bvh_bounds nb;
+		nb.init();
+		for (i=0;i<count;i++) {
+			source_bounds(src, index[first + i], nb);
+		}
+		struct bvh_node &node = nodes[ni];
+		memcpy(node.minv, &nb.minv.x, sizeof(node.minv));
+		memcpy(node.maxv, &nb.maxv.x, sizeof(node.maxv));
+		uint32_t left = 0;
+		// the traversal keeps at most one pending sibling per level, see bvh_internal_valid()
+		if (count > BVH_LEAF_SIZE && depth + 2 <= BVH_STACK) {
+			left = bvh_split(src, index, first, count, nb);
+		}
+		if (left == 0) {
+			node.first = first;
+			node.count = count;
+		} else {
+			node.first = numnodes;
+			node.count = 0;
+			stack[top++] = { numnodes, first, left, depth + 1 };
+			stack[top++] = { numnodes + 1, first + left, count - left, depth + 1 };
+			numnodes += 2;
+		}
+	}
+	return numnodes;
+}
+
+static inline size_t
+bvh_maxnodes(uint32_t numtriangles) {
+	return numtriangles > 0 ? 2 * (size_t)numtriangles - 1 : 1;
+}
+
+size_t
+math3d_bvh_build(const struct triangle *triangles, uint32_t numtriangles, void *buffer) {
+	struct bvh_header *h = (struct bvh_header *)buffer;
+	struct bvh_node *nodes = (struct bvh_node *)(h + 1);
+	uint32_t *index = (uint32_t *)(nodes + bvh_maxnodes(numtriangles));
+	const triangle_source src = { triangles };
+	const uint32_t numnodes = bvh_build_nodes(src, numtriangles, nodes, index);
+	struct triangle *tris = (struct triangle *)(nodes + numnodes);
+	uint32_t *final_index = (uint32_t *)(tris + numtriangles);
+	memmove(final_index, index, numtriangles * sizeof(uint32_t));
+	uint32_t i;
+	for (i=0;i<numtriangles;i++) {
+		tris[i] = triangles[final_index[i]];
+	}
+	h->magic = BVH_MAGIC;
+	h->numnodes = numnodes;
+	h->numtriangles = numtriangles;
+	h->type = MATH3D_BVH_TRIANGLES;
+	return (const char *)(final_index + numtriangles) - (const char *)buffer;
+}
+
+size_t
+math3d_bvh_build_mesh(const struct math3d_mesh *mesh, void *buffer) {
+	struct bvh_header *h = (struct bvh_header *)buffer;
+	struct bvh_node *nodes = (struct bvh_node *)(h + 1);
+	const uint32_t numtriangles = mesh->numtriangles;
+	uint32_t *index = (uint32_t *)(nodes + bvh_maxnodes(numtriangles));
+	const mesh_source src = { mesh };
+	const uint32_t numnodes = bvh_build_nodes(src, numtriangles, nodes, index);
+	uint32_t *final_index = (uint32_t *)(nodes + numnodes);
+	memmove(final_index, index, numtriangles * sizeof(uint32_t));
+	h->magic = BVH_MAGIC;
+	h->numnodes = numnodes;
+	h->numtriangles = numtriangles;
+	h->type = MATH3D_BVH_MESH;
+	return (const char *)(final_index + numtriangles) - (const char *)buffer;
+}
+
+int
+math3d_bvh_type(const void *bvh, size_t sz) {
+	const struct bvh_header *h = (const struct bvh_header *)bvh;
+	if (sz < sizeof(*h) || h->magic != BVH_MAGIC || h->numnodes == 0)
+		return 0;
+	size_t expect = sizeof(*h) + (size_t)h->numnodes * sizeof(struct bvh_node) + (size_t)h->numtriangles * sizeof(uint32_t);
+	switch (h->type) {
+	case MATH3D_BVH_TRIANGLES:
+		expect += (size_t)h->numtriangles * sizeof(struct triangle);
+		break;
+	case MATH3D_BVH_MESH:
+		break;
+	default:
+		return 0;
+	}
+	return sz == expect ? h->type : 0;
+}
+
+uint32_t
+math3d_bvh_numtriangles(const void *bvh) {
+	const struct bvh_header *h = (const struct bvh_header *)bvh;
+	return h->numtriangles;
+}
+
+static inline bool
+bvh_leaf_valid(const struct bvh_node &node, uint32_t numtriangles) {
+	return node.count <= numtriangles && node.first <= numtriangles - node.count;
+}
+
+// children are stored after the parent, so a walk always terminates
+static inline bool
+bvh_internal_valid(const struct bvh_node &node, uint32_t ni, uint32_t numnodes) {
+	return node.first > ni && node.first < numnodes - 1;
+}
+
+int
+math3d_bvh_check(const void *bvh, size_t sz) {
+	const int type = math3d_bvh_type(bvh, sz);
+	if (type == 0)
+		return 0;
+	const struct bvh_header *h = (const struct bvh_header *)bvh;
+	const uint32_t numnodes = h->numnodes;
+	const uint32_t numtriangles = h->numtriangles;
+	if (numnodes > bvh_maxnodes(numtriangles))
+		return 0;
+	if (numtriangles == 0)
+		return type;
+	const struct bvh_node *nodes = (const struct bvh_node *)(h + 1);
+	const uint32_t *index;
+	if (type == MATH3D_BVH_TRIANGLES)
+		index = (const uint32_t *)((const struct triangle *)(nodes + numnodes) + numtriangles);
+	else
+		index = (const uint32_t *)(nodes + numnodes);
+	struct { uint32_t node, depth; } stack[BVH_STACK];
+	int top = 0;
+	uint32_t visited = 0;
+	stack[top++] = { 0, 0 };
+	while (top > 0) {
+		--top;
+		const uint32_t ni = stack[top].node;
+		const uint32_t depth = stack[top].depth;
+		if (++visited > numnodes)
+			return 0;	// shared children
+		const struct bvh_node &node = nodes[ni];
+		if (node.count > 0) {
+			if (!bvh_leaf_valid(node, numtriangles))
+				return 0;
+		} else {
+			if (!bvh_internal_valid(node, ni, numnodes) || depth + 2 > BVH_STACK)
+				return 0;
+			stack[top++] = { node.first, depth + 1 };
+			stack[top++] = { node.first + 1, depth + 1 };
+		}
+	}
+	uint32_t i;
+	for (i=0;i<numtriangles;i++) {
+		if (index[i] >= numtriangles)
+			return 0;
+	}
+	return type;
+}
+
+static inline bool
+bvh_node_hit(const struct bvh_node &node, const glm::vec3 &ro, const glm::vec3 &invd, float tmax, float &tnear) {
+	const glm::vec3 t0 = (*(const glm::vec3 *)node.minv - ro) * invd;
+	const glm::vec3 t1 = (*(const glm::vec3 *)node.maxv - ro) * invd;
+	const glm::vec3 tmin3 = glm::min(t0, t1);
+	const glm::vec3 tmax3 = glm::max(t0, t1);
+	const float enter = glm::max(glm::max(tmin3.x, tmin3.y), glm::max(tmin3.z, 0.f));
+	const float leave = glm::min(glm::min(tmax3.x, tmax3.y), glm::min(tmax3.z, tmax));
+	tnear = enter;
+	return enter <= leave;
+}
+
+// leaf triangles are the i-th in the order of bvh, returns the position of the hit, UINT32_MAX : no hit
+// the nodes are checked on the way, a broken bvh (not passed math3d_bvh_check) misses but never reads out of bounds
+template <typename Source>
+static uint32_t
+bvh_traverse(const struct bvh_header *h, const Source &src, math_t o, math_t d, struct math_context *M, int anyhit, struct ray_triangle_interset_result &rr) {
+	const struct bvh_node *nodes = (const struct bvh_node *)(h + 1);
+	const glm::vec3 ro = VEC3(M, o);
+	const glm::vec3 rd = VEC3(M, d);
+	// avoid 0 * inf (NaN) in the slab test when the ray is parallel to an axis
+	glm::vec3 invd;
+	for (int i=0;i<3;i++) {
+		invd[i] = 1.0f / (rd[i] != 0 ? rd[i] : 1e-30f);
+	}
+
+	rr.t = FLT_MAX;
+	uint32_t hit = UINT32_MAX;
+	uint32_t stack[BVH_STACK];
+	int top = 0;
+	float tnear;
+	if (!bvh_node_hit(nodes[0], ro, invd, rr.t, tnear))
+		return hit;
+	stack[top++] = 0;
+	while (top > 0) {
+		const uint32_t ni = stack[--top];
+		const struct bvh_node &node = nodes[ni];
+		if (node.count > 0) {
+			if (!bvh_leaf_valid(node, h->numtriangles))
+				continue;
+			uint32_t i;
+			for (i=0;i<node.count;i++) {
+				glm::vec3 v[3];
+				src.get(node.first + i, v);
+				struct ray_triangle_interset_result rrr;
+				if (intersect_triangle3(ro, rd, v[0], v[1], v[2], rrr)
+					&& rrr.t >= 0.f && rrr.t < rr.t) {
+					rr = rrr;
+					hit = node.first + i;
+					if (anyhit)
+						return hit;
+				}
+			}
+		} else if (bvh_internal_valid(node, ni, h->numnodes) && top + 2 <= BVH_STACK) {
+			float t0, t1;
+			const bool h0 = bvh_node_hit(nodes[node.first], ro, invd, rr.t, t0);
+			const bool h1 = bvh_node_hit(nodes[node.first + 1], ro, invd, rr.t, t1);
+			// push the far one first
+			if (h0 && h1) {
+				if (t0 < t1) {
+					stack[top++] = node.first + 1;
+					stack[top++] = node.first;
+				} else {
+					stack[top++] = node.first;
+					stack[top++] = node.first + 1;
+				}
+			} else if (h0) {
+				stack[top++] = node.first;
+			} else if (h1) {
+				stack[top++] = node.first + 1;
+			}
+		}
+	}
+	return hit;
+}
+
+// the triangles of mesh in the order of bvh
+struct mesh_order_source {
+	mesh_source mesh;
+	const uint32_t *index;
+	void get(uint32_t i, glm::vec3 v[3]) const {
+		const uint32_t t = index[i];
+		if (t < mesh.mesh->numtriangles) {
+			mesh.get(t, v);
+		} else {
+			v[0] = v[1] = v[2] = glm::vec3(0);	// degenerated, never hit
+		}
+	}
+};
+
+int
+math3d_bvh_ray(struct math_context *M, math_t o, math_t d, const void *bvh, int anyhit, struct ray_triangle_interset_result *r, uint32_t *triangle_index) {
+	const struct bvh_header *h = (const struct bvh_header *)bvh;
+	assert(h->magic == BVH_MAGIC && h->type == MATH3D_BVH_TRIANGLES);
+	if (h->numtriangles == 0)
+		return 0;
+	const struct bvh_node *nodes = (const struct bvh_node *)(h + 1);
+	const struct triangle *tris = (const struct triangle *)(nodes + h->numnodes);
+	const uint32_t *index = (const uint32_t *)(tris + h->numtriangles);
+	const triangle_source src = { tris };
+	struct ray_triangle_interset_result rr;
+	const uint32_t hit = bvh_traverse(h, src, o, d, M, anyhit, rr);
+	if (hit == UINT32_MAX)
+		return 0;
+	*r = rr;
+	if (triangle_index)
+		*triangle_index = index[hit];
+	return 1;
+}
+
+int
+math3d_bvh_ray_mesh(struct math_context *M, math_t o, math_t d, const void *bvh, const struct math3d_mesh *mesh, int anyhit, struct ray_triangle_interset_result *r, uint32_t *triangle_index) {
+	const struct bvh_header *h = (const struct bvh_header *)bvh;
+	assert(h->magic == BVH_MAGIC && h->type == MATH3D_BVH_MESH);
+	assert(h->numtriangles == mesh->numtriangles);
+	if (h->numtriangles == 0)
+		return 0;
+	const struct bvh_node *nodes = (const struct bvh_node *)(h + 1);
+	const uint32_t *index = (const uint32_t *)(nodes + h->numnodes);
+	const mesh_order_source src = { { mesh }, index };
+	struct ray_triangle_interset_result rr;
+	const uint32_t hit = bvh_traverse(h, src, o, d, M, anyhit, rr);
+	if (hit == UINT32_MAX)
+		return 0;
+	*r = rr;
+	if (triangle_index)
+		*triangle_index = index[hit];
+	return 1;
+}
+
+int
+math3d_ray_mesh(struct math_context *M, math_t o, math_t d, const struct math3d_mesh *mesh, int anyhit, struct ray_triangle_interset_result *r, uint32_t *triangle_index) {
+	const glm::vec3 ro = VEC3(M, o);
+	const glm::vec3 rd = VEC3(M, d);
+	const mesh_source src = { mesh };
+	struct ray_triangle_interset_result rr;
+	rr.t = FLT_MAX;
+	uint32_t hit = UINT32_MAX;
+	uint32_t i;
+	for (i=0;i<mesh->numtriangles;i++) {
+		glm::vec3 v[3];
+		src.get(i, v);
+		struct ray_triangle_interset_result rrr;
+		if (intersect_triangle3(ro, rd, v[0], v[1], v[2], rrr) && rrr.t >= 0.f && rrr.t < rr.t) {
+			rr = rrr;
+			hit = i;
+			if (anyhit)
+				break;
+		}
+	}
+	if (hit == UINT32_MAX)
+		return 0;
+	*r = rr;
+	if (triangle_index)
+		*triangle_index = hit;
+	return 1;
+}
+
+// Packet of rays, structure of arrays. Use SSE2 (the baseline of x86-64) if available, or plain lane loops.
+
+#define RAY_PACKET 4
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAY_PACKET_SSE
+#include <emmintrin.h>
+#endif
+
+struct alignas(16) ray_packet {
+	float o[3][RAY_PACKET];
+	float d[3][RAY_PACKET];
+	float invd[3][RAY_PACKET];
+	float t[RAY_PACKET];	// closest hit so far, FLT_MAX : none, < 0 : inactive lane
+	float u[RAY_PACKET];
+	float v[RAY_PACKET];
+	uint32_t index[RAY_PACKET];
+};
+
+#ifdef RAY_PACKET_SSE
+
+// Moller-Trumbore, 4 rays at once. Each lane takes the same steps as intersect_triangle3 (bounds tested before
+// dividing by det), so the results are bitwise equal to the single ray version.
+static inline void
+packet_triangle(struct ray_packet &p, const struct triangle &tri, uint32_t index) {
+	const glm::vec3 &v0 = tri_vertex(tri, 0);
+	const glm::vec3 e1 = tri_vertex(tri, 1) - v0;
+	const glm::vec3 e2 = tri_vertex(tri, 2) - v0;
+	const __m128 e1x = _mm_set1_ps(e1.x), e1y = _mm_set1_ps(e1.y), e1z = _mm_set1_ps(e1.z);
+	const __m128 e2x = _mm_set1_ps(e2.x), e2y = _mm_set1_ps(e2.y), e2z = _mm_set1_ps(e2.z);
+	const __m128 dx = _mm_load_ps(p.d[0]), dy = _mm_load_ps(p.d[1]), dz = _mm_load_ps(p.d[2]);
+	// pvec = cross(dir, edge2)
+	const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+	const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+	const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+	const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	const __m128 pos = _mm_cmpgt_ps(det, _mm_set1_ps(1e-6f));
+	const __m128 neg = _mm_cmplt_ps(det, _mm_set1_ps(-1e-6f));
+	if (_mm_movemask_ps(_mm_or_ps(pos, neg)) == 0)
+		return;
+	const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+	// tvec = orig - v0, qvec = cross(tvec, edge1)
+	const __m128 tx = _mm_sub_ps(_mm_load_ps(p.o[0]), _mm_set1_ps(v0.x));
+	const __m128 ty = _mm_sub_ps(_mm_load_ps(p.o[1]), _mm_set1_ps(v0.y));
+	const __m128 tz = _mm_sub_ps(_mm_load_ps(p.o[2]), _mm_set1_ps(v0.z));
+	const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+	const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(e1z, tx));
+	const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(e1x, ty));
+	const __m128 u = _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz));
+	const __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz));
+	const __m128 uv = _mm_add_ps(u, v);
+	const __m128 zero = _mm_setzero_ps();
+	// the rejections of intersect_triangle3, a NaN is not rejected there either
+	const __m128 pos_reject = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, det)),
+		_mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(uv, det)));
+	const __m128 neg_reject = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmplt_ps(u, det)),
+		_mm_or_ps(_mm_cmpgt_ps(v, zero), _mm_cmplt_ps(uv, det)));
+	__m128 mask = _mm_or_ps(_mm_andnot_ps(pos_reject, pos), _mm_andnot_ps(neg_reject, neg));
+	const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+	const __m128 pt = _mm_load_ps(p.t);
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, pt)));
+	if (_mm_movemask_ps(mask) == 0)
+		return;
+	_mm_store_ps(p.t, _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, pt)));
+	_mm_store_ps(p.u, _mm_or_ps(_mm_and_ps(mask, _mm_mul_ps(u, inv_det)), _mm_andnot_ps(mask, _mm_load_ps(p.u))));
+	_mm_store_ps(p.v, _mm_or_ps(_mm_and_ps(mask, _mm_mul_ps(v, inv_det)), _mm_andnot_ps(mask, _mm_load_ps(p.v))));
+	const __m128i imask = _mm_castps_si128(mask);
+	const __m128i pi = _mm_load_si128((const __m128i *)p.index);
+	_mm_store_si128((__m128i *)p.index, _mm_or_si128(_mm_and_si128(imask, _mm_set1_epi32((int)index)), _mm_andnot_si128(imask, pi)));
+}
+
+// returns true if any ray in packet hits the node, tnear is the nearest entry
+static inline bool
+packet_node_hit(const struct ray_packet &p, const struct bvh_node &node, float &tnear) {
+	__m128 enter = _mm_setzero_ps();
+	__m128 leave = _mm_load_ps(p.t);
+	for (int a=0;a<3;a++) {
+		const __m128 o = _mm_load_ps(p.o[a]);
+		const __m128 invd = _mm_load_ps(p.invd[a]);
+		const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.minv[a]), o), invd);
+		const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.maxv[a]), o), invd);
+		enter = _mm_max_ps(enter, _mm_min_ps(t0, t1));
+		leave = _mm_min_ps(leave, _mm_max_ps(t0, t1));
+	}
+	const __m128 mask = _mm_cmple_ps(enter, leave);
+	if (_mm_movemask_ps(mask) == 0)
+		return false;
+	__m128 m = _mm_or_ps(_mm_and_ps(mask, enter), _mm_andnot_ps(mask, _mm_set1_ps(FLT_MAX)));
+	m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2,3,0,1)));
+	m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1,0,3,2)));
+	tnear = _mm_cvtss_f32(m);
+	return true;
+}
+
+#else
+
+static inline void
+packet_triangle(struct ray_packet &p, const struct triangle &tri, uint32_t index) {
+	for (int k=0;k<RAY_PACKET;k++) {
+		struct ray_triangle_interset_result r;
+		const glm::vec3 o(p.o[0][k], p.o[1][k], p.o[2][k]);
+		const glm::vec3 d(p.d[0][k], p.d[1][k], p.d[2][k]);
+		if (intersect_triangle3(o, d, tri_vertex(tri, 0), tri_vertex(tri, 1), tri_vertex(tri, 2), r)
+			&& r.t >= 0.f && r.t < p.t[k]) {
+			p.t[k] = r.t;
+			p.u[k] = r.u;
+			p.v[k] = r.v;
+			p.index[k] = index;
+		}
+	}
+}
+
+static inline bool
+packet_node_hit(const struct ray_packet &p, const struct bvh_node &node, float &tnear) {
+	bool any = false;
+	tnear = FLT_MAX;
+	for (int k=0;k<RAY_PACKET;k++) {
+		float enter = 0.f;
+		float leave = p.t[k];
+		for (int a=0;a<3;a++) {
+			const float t0 = (node.minv[a] - p.o[a][k]) * p.invd[a][k];
+			const float t1 = (node.maxv[a] - p.o[a][k]) * p.invd[a][k];
+			enter = glm::max(enter, glm::min(t0, t1));
+			leave = glm::min(leave, glm::max(t0, t1));
+		}
+		if (enter <= leave) {
+			any = true;
+			tnear = glm::min(tnear, enter);
+		}
+	}
+	return any;
+}
+
+#endif
+
+static void
+packet_bvh(struct ray_packet &p, const void *bvh) {
+	const struct bvh_header *h = (const struct bvh_header *)bvh;
+	assert(h->type == MATH3D_BVH_TRIANGLES);
+	const struct bvh_node *nodes = (const struct bvh_node *)(h + 1);
+	const struct triangle *tris = (const struct triangle *)(nodes + h->numnodes);
+	const uint32_t *index = (const uint32_t *)(tris + h->numtriangles);
+	uint32_t stack[BVH_STACK];
+	int top = 0;
+	float tnear;
+	if (h->numtriangles == 0 || !packet_node_hit(p, nodes[0], tnear))
+		return;
+	stack[top++] = 0;
+	while (top > 0) {
+		const uint32_t ni = stack[--top];
+		const struct bvh_node &node = nodes[ni];
+		if (node.count > 0) {
+			if (!bvh_leaf_valid(node, h->numtriangles))
+				continue;
+			uint32_t i;
+			for (i=0;i<node.count;i++) {
+				packet_triangle(p, tris[node.first + i], node.first + i);
+			}
+		} else if (bvh_internal_valid(node, ni, h->numnodes) && top + 2 <= BVH_STACK) {
+			float t0, t1;
+			const bool h0 = packet_node_hit(p, nodes[node.first], t0);
+			const bool h1 = packet_node_hit(p, nodes[node.first + 1], t1);
+			if (h0 && h1) {
+				if (t0 < t1) {
+					stack[top++] = node.first + 1;
+					stack[top++] = node.first;
+				} else {
+					stack[top++] = node.first;
+					stack[top++] = node.first + 1;
+				}
+			} else if (h0) {
+				stack[top++] = node.first;
+			} else if (h1) {
+				stack[top++] = node.first + 1;
+			}
+		}
+	}
+	for (int k=0;k<RAY_PACKET;k++) {
+		if (p.index[k] != UINT32_MAX)
+			p.index[k] = index[p.index[k]];
+	}
+}
+
+int
+math3d_rays_triangles(struct math_context *M, math_t origins, math_t dirs, const struct triangle *triangles, uint32_t numtriangles, const void *bvh, struct ray_triangle_interset_result *r, uint32_t *triangle_index) {
+	struct math_view ov, dv;
+	math_view(M, origins, &ov);
+	math_view(M, dirs, &dv);
+	const int n = ov.size > dv.size ? ov.size : dv.size;
+	assert((ov.size == n || ov.size == 1) && (dv.size == n || dv.size == 1));
+	int hits = 0;
+	int i;
+	for (i=0;i<n;i+=RAY_PACKET) {
+		struct ray_packet p;
+		int k, a;
+		for (k=0;k<RAY_PACKET;k++) {
+			const int ri = i + k < n ? i + k : n - 1;
+			const glm::vec4 o = VIEWVEC(ov, ov.size == 1 ? 0 : ri);
+			const glm::vec4 d = VIEWVEC(dv, dv.size == 1 ? 0 : ri);
+			for (a=0;a<3;a++) {
+				p.o[a][k] = o[a];
+				p.d[a][k] = d[a];
+				p.invd[a][k] = 1.0f / (d[a] != 0 ? d[a] : 1e-30f);
+			}
+			// the padding lanes can't hit anything
+			p.t[k] = i + k < n ? FLT_MAX : -1.f;
+			p.u[k] = p.v[k] = 0;
+			p.index[k] = UINT32_MAX;
+		}
+		if (bvh) {
+			packet_bvh(p, bvh);
+		} else {
+			uint32_t j;
+			for (j=0;j<numtriangles;j++) {
+				packet_triangle(p, triangles[j], j);
+			}
+		}
+		for (k=0;k<RAY_PACKET && i + k < n;k++) {
+			struct ray_triangle_interset_result *rr = &r[i + k];
+			if (p.index[k] != UINT32_MAX) {
+				rr->t = p.t[k];
+				rr->u = p.u[k];
+				rr->v = p.v[k];
+				++hits;
+			} else {
+				rr->t = -1.f;
+				rr->u = rr->v = 0;
+			}
+			if (triangle_index)
+				triangle_index[i + k] = p.index[k];
+		}
+	}
+	return hits;
+}
+
 // face normal point to box center
 static constexpr uint8_t FACE_INDICES[PN_count * 4] = {
 	BP_lbn, BP_ltn, BP_lbf, BP_ltf, //left
@@ -1801,4 +2852,312 @@ math3d_frstum_aabb_intersect_points(struct math_context * M, math_t m, math_t aa
 		assert(numpoint <= MAXPOINT);
 	}
 	return (numpoint > 0) ? math_import(M, (const float*)(&points), MATH_TYPE_VEC4, numpoint) : MATH_NULL;
-}
\ No newline at end of file
+}
+
+// compiled expression, each op is the same glm expression as the math3d function of the same name
+
+#define EXPR_NUMBER MATH_TYPE_NULL
+
+struct expr_reg {
+	int type;
+	int ident;
+	double n;
+	float v[16];
+};
+
+#define REGVEC(r) (*(glm::vec4 *)(r)->v)
+#define REGQUAT(r) (*(glm::quat *)(r)->v)
+#define REGMAT(r) (*(glm::mat4x4 *)(r)->v)
+
+static inline void
+expr_set_vec(struct expr_reg *r, const glm::vec4 &v) {
+	r->type = MATH_TYPE_VEC4;
+	r->ident = 0;
+	REGVEC(r) = v;
+}
+
+static inline void
+expr_set_number(struct expr_reg *r, double n) {
+	r->type = EXPR_NUMBER;
+	r->ident = 0;
+	r->n = n;
+}
+
+// get_vec_or_number of math3d.c
+static inline int
+expr_vec(const struct expr_reg *r, glm::vec4 &v) {
+	if (r->type == EXPR_NUMBER) {
+		v = glm::vec4((float)r->n);
+		return 1;
+	}
+	if (r->type != MATH_TYPE_VEC4)
+		return 0;
+	v = REGVEC(r);
+	return 1;
+}
+
+static const char *
+expr_op(const struct math3d_expr_inst *inst, struct expr_reg *reg) {
+	struct expr_reg *d = &reg[inst->dst];
+	const struct expr_reg *a = &reg[inst->arg[0]];
+	const struct expr_reg *b = inst->n > 1 ? &reg[inst->arg[1]] : NULL;
+	const struct expr_reg *c = inst->n > 2 ? &reg[inst->arg[2]] : NULL;
+	glm::vec4 va, vb, vc;
+	switch (inst->op) {
+	case MATH3D_EXPR_ADD:
+	case MATH3D_EXPR_SUB:
+		if (a->type == EXPR_NUMBER && b->type == EXPR_NUMBER) {
+			expr_set_number(d, inst->op == MATH3D_EXPR_ADD ? a->n + b->n : a->n - b->n);
+			break;
+		}
+		if (!expr_vec(a, va) || !expr_vec(b, vb))
+			return "Need vector or number";
+		expr_set_vec(d, inst->op == MATH3D_EXPR_ADD ? va + vb : va - vb);
+		break;
+	case MATH3D_EXPR_MUL:
+		switch (a->type) {
+		case EXPR_NUMBER:
+			if (b->type == EXPR_NUMBER) {
+				expr_set_number(d, a->n * b->n);
+				break;
+			}
+			// fall through
+		case MATH_TYPE_VEC4:
+			if (!expr_vec(a, va) || !expr_vec(b, vb))
+				return "Need vector";
+			expr_set_vec(d, va * vb);
+			break;
+		case MATH_TYPE_MAT:
+			if (b->type != MATH_TYPE_MAT)
+				return "Need matrix";
+			if (a->ident) {
+				*d = *b;
+			} else if (b->ident) {
+				*d = *a;
+			} else {
+				d->type = MATH_TYPE_MAT;
+				d->ident = 0;
+				REGMAT(d) = REGMAT(a) * REGMAT(b);
+			}
+			break;
+		case MATH_TYPE_QUAT:
+			if (b->type != MATH_TYPE_QUAT)
+				return "Need quat";
+			if (a->ident) {
+				*d = *b;
+			} else if (b->ident) {
+				*d = *a;
+			} else {
+				d->type = MATH_TYPE_QUAT;
+				d->ident = 0;
+				REGQUAT(d) = REGQUAT(a) * REGQUAT(b);
+			}
+			break;
+		default:
+			return "Need vector, quat or matrix";
+		}
+		break;
+	case MATH3D_EXPR_NEG:
+		// math3d.mul(-1, v)
+		if (a->type == EXPR_NUMBER) {
+			expr_set_number(d, -a->n);
+		} else if (a->type == MATH_TYPE_VEC4) {
+			expr_set_vec(d, glm::vec4(-1.0f) * REGVEC(a));
+		} else {
+			return "Need vector or number";
+		}
+		break;
+	case MATH3D_EXPR_MULADD:
+		if (!expr_vec(a, va) || !expr_vec(b, vb) || !expr_vec(c, vc))
+			return "Need vector or number";
+		va = va * vb;
+		expr_set_vec(d, va + vc);
+		break;
+	case MATH3D_EXPR_DOT:
+		if (a->type != MATH_TYPE_VEC4 || b->type != MATH_TYPE_VEC4)
+			return "Need vector";
+		expr_set_number(d, glm::dot(*(const glm::vec3 *)a->v, *(const glm::vec3 *)b->v));
+		break;
+	case MATH3D_EXPR_CROSS: {
+		if (a->type != MATH_TYPE_VEC4 || b->type != MATH_TYPE_VEC4)
+			return "Need vector";
+		glm::vec3 r = glm::cross(*(const glm::vec3 *)a->v, *(const glm::vec3 *)b->v);
+		expr_set_vec(d, glm::vec4(r, 0));
+		break; }
+	case MATH3D_EXPR_LENGTH:
+		if (a->type != MATH_TYPE_VEC4 || (b && b->type != MATH_TYPE_VEC4))
+			return "Need vector";
+		if (b) {
+			va = REGVEC(b) - REGVEC(a);
+			expr_set_number(d, glm::length(glm::vec3(va)));
+		} else {
+			expr_set_number(d, glm::length(*(const glm::vec3 *)a->v));
+		}
+		break;
+	case MATH3D_EXPR_NORMALIZE:
+		if (a->type == MATH_TYPE_VEC4) {
+			glm::vec3 r = glm::normalize(*(const glm::vec3 *)a->v);
+			expr_set_vec(d, glm::vec4(r, a->v[3]));
+		} else if (a->type == MATH_TYPE_QUAT) {
+			d->type = MATH_TYPE_QUAT;
+			d->ident = 0;
+			REGQUAT(d) = glm::normalize(REGQUAT(a));
+		} else {
+			return "Need vector or quat";
+		}
+		break;
+	case MATH3D_EXPR_INVERSE:
+		switch (a->type) {
+		case MATH_TYPE_VEC4:
+			expr_set_vec(d, glm::vec4(-a->v[0], -a->v[1], -a->v[2], a->v[3]));
+			break;
+		case MATH_TYPE_QUAT:
+			d->type = MATH_TYPE_QUAT;
+			d->ident = 0;
+			REGQUAT(d) = glm::inverse(REGQUAT(a));
+			break;
+		case MATH_TYPE_MAT:
+			d->type = MATH_TYPE_MAT;
+			d->ident = 0;
+			REGMAT(d) = glm::inverse(REGMAT(a));
+			break;
+		default:
+			return "Need vector, quat or matrix";
+		}
+		break;
+	case MATH3D_EXPR_TRANSPOSE:
+		if (a->type != MATH_TYPE_MAT)
+			return "Need matrix";
+		d->type = MATH_TYPE_MAT;
+		d->ident = 0;
+		REGMAT(d) = glm::transpose(REGMAT(a));
+		break;
+	case MATH3D_EXPR_TRANSFORM:
+		if (b->type != MATH_TYPE_VEC4)
+			return "Need vector";
+		vb = REGVEC(b);
+		if (c) {
+			if (c->type != EXPR_NUMBER)
+				return "Need number";
+			vb[3] = (float)c->n;
+		}
+		if (a->type == MATH_TYPE_QUAT) {
+			expr_set_vec(d, glm::rotate(REGQUAT(a), vb));
+		} else if (a->type == MATH_TYPE_MAT) {
+			expr_set_vec(d, REGMAT(a) * vb);
+		} else {
+			return "Need quat or matrix";
+		}
+		break;
+	case MATH3D_EXPR_TRANSFORMH:
+		if (a->type != MATH_TYPE_MAT || b->type != MATH_TYPE_VEC4)
+			return "Need matrix and vector";
+		vb = REGVEC(b);
+		if (vb[3] != 1.f) {
+			glm::vec4 tmp ( vb[0], vb[1], vb[2], 1 );
+			va = REGMAT(a) * tmp;
+		} else {
+			va = REGMAT(a) * vb;
+		}
+		if (va.w != 0) {
+			va /= fabs(va.w);
+			va.w = 1.f;
+		}
+		expr_set_vec(d, va);
+		break;
+	case MATH3D_EXPR_LERP:
+	case MATH3D_EXPR_SLERP:
+		if (c->type != EXPR_NUMBER)
+			return "Need number";
+		if (a->type != b->type)
+			return "Need the same type";
+		if (a->type == MATH_TYPE_QUAT) {
+			d->type = MATH_TYPE_QUAT;
+			d->ident = 0;
+			if (inst->op == MATH3D_EXPR_LERP) {
+				REGQUAT(d) = glm::lerp(REGQUAT(a), REGQUAT(b), (float)c->n);
+			} else {
+				REGQUAT(d) = glm::slerp(REGQUAT(a), REGQUAT(b), (float)c->n);
+			}
+		} else if (a->type == MATH_TYPE_VEC4 && inst->op == MATH3D_EXPR_LERP) {
+			expr_set_vec(d, glm::lerp(REGVEC(a), REGVEC(b), (float)c->n));
+		} else {
+			return inst->op == MATH3D_EXPR_LERP ? "Need vector or quat" : "Need quat";
+		}
+		break;
+	case MATH3D_EXPR_SRT: {
+		// math3d.matrix { s = a, r = b, t = c }
+		float scale[4];
+		const float *sv = a->v;
+		if (a->type == EXPR_NUMBER) {
+			scale[0] = scale[1] = scale[2] = (float)a->n;
+			scale[3] = 0;
+			sv = scale;
+		} else if (a->type != MATH_TYPE_VEC4) {
+			return "Need vector or number for s";
+		}
+		if (b->type != MATH_TYPE_QUAT)
+			return "Need quat for r";
+		if (c->type != MATH_TYPE_VEC4)
+			return "Need vector for t";
+		glm::mat4x4 m;
+		d->type = MATH_TYPE_MAT;
+		d->ident = make_srt(m, sv, b->v, c->v);
+		REGMAT(d) = m;
+		break; }
+	default:
+		return "Invalid op";
+	}
+	return NULL;
+}
+
+const char *
+math3d_expr_eval(struct math_context *M, const struct math3d_expr *e, const struct math3d_expr_arg *input, math_t *result, double *number) {
+	struct expr_reg reg[MATH3D_EXPR_MAXREG];
+	int i;
+	for (i=0;i<e->ninput;i++) {
+		struct expr_reg *r = &reg[i];
+		math_t id = input[i].id;
+		if (!(e->used & (1u << i)))
+			continue;
+		if (math_isnull(id)) {
+			expr_set_number(r, input[i].n);
+			continue;
+		}
+		if (math_size(M, id) != 1)
+			return "Need a single value, not an array";
+		r->type = math_type(M, id);
+		r->ident = math_isidentity(id);
+		memcpy(r->v, math_value(M, id), (r->type == MATH_TYPE_MAT ? 16 : 4) * sizeof(float));
+	}
+	for (i=0;i<e->nconst;i++) {
+		expr_set_number(&reg[e->ninput + i], e->constant[i]);
+	}
+	for (i=0;i<e->ninst;i++) {
+		const char *err = expr_op(&e->inst[i], reg);
+		if (err)
+			return err;
+	}
+	if (e->result < e->ninput) {
+		*result = input[e->result].id;
+		*number = input[e->result].n;
+		return NULL;
+	}
+	const struct expr_reg *r = &reg[e->result];
+	*result = MATH_NULL;
+	switch (r->type) {
+	case EXPR_NUMBER:
+		*number = r->n;
+		break;
+	case MATH_TYPE_MAT:
+		*result = r->ident ? math_identity(MATH_TYPE_MAT) : math_matrix(M, r->v);
+		break;
+	case MATH_TYPE_QUAT:
+		*result = r->ident ? math_identity(MATH_TYPE_QUAT) : math_quat(M, r->v);
+		break;
+	default:
+		*result = math_vec4(M, r->v);
+		break;
+	}
+	return NULL;
+}
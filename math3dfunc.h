@@ -12,6 +12,16 @@ math_t math3d_quat_between_2vectors(struct math_context *, math_t a, math_t b);
 math_t math3d_make_quat_from_euler(struct math_context *, math_t euler);
 math_t math3d_make_srt(struct math_context *, math_t s, math_t r, math_t t);
 void   math3d_decompose_matrix(struct math_context *, math_t mat, math_t v[3]);
+// s, r, t arrays (size n or 1, can be null) to a matrix array (output_ref or a new array)
+math_t math3d_make_srt_array(struct math_context *, math_t s, math_t r, math_t t, math_t output_ref);
+void   math3d_decompose_matrix_array(struct math_context *, math_t mat, math_t v[3]);	// v : s, r, t arrays
+// blend vec4 or quat arrays (a/b size n or 1, nweight n or 1) by MATH3D_BLEND_*, to output_ref or a new array
+math_t math3d_blend_array(struct math_context *, int mode, math_t a, math_t b, const float *weight, int nweight, math_t output_ref);
+// write the skinning palette of world/invbind matrix arrays (root can be null) into output (ostride 0 : packed), returns the number of matrices
+int    math3d_skin_palette(struct math_context *, math_t root, math_t world, math_t invbind, void *output, int ostride, int format);
+// pack the values of n ids (arrays are flattened, a matrix is 4 vec4 in MATH3D_EXPORT_VEC4) into output by MATH3D_EXPORT_*
+// returns the bytes written (output NULL : query only), or -1 if the type mismatches the format
+int    math3d_export(struct math_context *, const math_t *id, int n, int format, void *output);
 math_t math3d_decompose_scale(struct math_context *, math_t mat);
 math_t math3d_decompose_rot(struct math_context *, math_t mat);
 float  math3d_dot(struct math_context *, math_t v1, math_t v2);
@@ -21,6 +31,46 @@ math_t math3d_mul_vec(struct math_context *, math_t v1, math_t v2);
 math_t math3d_mul_quat(struct math_context *, math_t v1, math_t v2);
 math_t math3d_mul_matrix(struct math_context *, math_t v1, math_t v2);
 math_t math3d_mul_matrix_array(struct math_context *M, math_t mat, math_t array_mat, math_t output_ref);
+// world[i] = world[parent[i]] * local[i], parent[i] < i (-1 : root). local (mat array) or s/r/t arrays (size n or 1, can be null).
+// Only the dirty nodes (bitmask, NULL : all) and their descendants are recomputed, world (usually a ref) is updated in place.
+// returns the number of nodes recomputed
+int    math3d_transform_hierarchy(struct math_context *, math_t world, const int *parent, int n, math_t local, math_t s, math_t r, math_t t, const uint32_t *dirty);
+
+// simd kernels (math3dsimd.cpp), selected by cpuid
+#define MATH3D_SIMD_NONE 0
+#define MATH3D_SIMD_SSE41 1
+#define MATH3D_SIMD_AVX2 2
+#define MATH3D_SIMD_AVX512 3
+// The level is process wide (all the contexts and threads), it's for tests and benchmarks.
+// The kernels use mul + add (no fma), the results are the same at any level.
+int    math3d_simd(int level);	// limit the level (< 0 : query only), returns current level
+int    math3d_simd_support();	// the best level of the cpu
+const char * math3d_simd_name(int level);
+// out[i] = m1[i] * m2[i], strides in bytes (0 : the same matrix), returns 0 if no simd kernel.
+int    math3d_mul_matrix_batch(float *out, int ostride, const float *m1, int stride1, const float *m2, int stride2, int n);
+// Cull n aabbs (min, max vec4 pairs, stride in bytes between aabbs) by 6 planes.
+// Visible (inside or intersecting) ones are set in mask (uint32_t[(n+31)/32]) and/or written as 0-based index; mask/index can be NULL.
+// returns the number of visible aabbs
+int    math3d_frustum_cull_aabb(const float *planes, const float *aabb, int stride, int n, uint32_t *mask, uint32_t *index);
+// out[i] = T[i] * R[i] * S[i] (s/t vec4, r quat, NULL : identity), out must not overlap the inputs.
+void   math3d_srt_batch(float *out, int ostride, const float *s, int sstride, const float *r, int rstride, const float *t, int tstride, int n);
+// decompose n affine matrices into packed s (w = 0), r, t (w = 1) arrays, the same results as glm::decompose
+void   math3d_decompose_batch(const float *m, int stride, int n, float *s, float *r, float *t);
+// pose blending : out[i] = blend(a[i], b[i], w[i]), out can be a
+#define MATH3D_BLEND_LERP 0	// vec4 : lerp, quat : nlerp (the shortest path)
+#define MATH3D_BLEND_SLERP 1	// quat : slerp, vec4 : lerp
+#define MATH3D_BLEND_ADDITIVE 2	// vec4 : a + b * w, quat : a * nlerp(identity, b, w)
+void   math3d_blend_batch(int mode, int quat, float *out, int ostride, const float *a, int astride, const float *b, int bstride, const float *w, int wstride, int n);
+// skinning palette : out[i] = root * world[i] * invbind[i] (root can be NULL), out must not overlap the inputs
+#define MATH3D_PALETTE_MAT4 0	// column major float[16]
+#define MATH3D_PALETTE_3X4 1	// the first 3 rows, float[12] (row major 3x4 for gpu)
+void   math3d_skin_palette_batch(float *out, int ostride, int format, const float *root, const float *world, int wstride, const float *invbind, int bstride, int n);
+// gpu export : n elements (stride in bytes) packed into out
+#define MATH3D_EXPORT_MAT4 0	// column major float[16]
+#define MATH3D_EXPORT_3X4 1	// the first 3 rows, float[12] (row major 3x4 for gpu)
+#define MATH3D_EXPORT_VEC4 2	// float[4]
+#define MATH3D_EXPORT_HALF 4	// or'ed with the layout : half floats (binary16, round to nearest even)
+void   math3d_export_batch(void *out, int format, const float *v, int stride, int n);
 float  math3d_length(struct math_context *, math_t v);
 math_t math3d_floor(struct math_context *, math_t v);
 math_t math3d_ceil(struct math_context *, math_t v);
@@ -98,6 +148,38 @@ int math3d_ray_triangles(struct math_context *M, math_t o, math_t d, const struc
 
 int math3d_ray_triangle_interset(struct math_context *M, math_t s0, math_t s1, math_t v0, math_t v1, math_t v2, struct ray_triangle_interset_result *r);
 
+// indexed mesh : triangle i is the vertices index[i*3 .. i*3+2], position (float[3]) at the beginning of each vertex
+struct math3d_mesh {
+	const void *vertex;
+	uint32_t stride;	// bytes between vertices
+	const void *index;	// NULL : not indexed, 3 vertices per triangle
+	int index_size;	// 2 (uint16_t) or 4 (uint32_t)
+	uint32_t numtriangles;
+	uint32_t numvertices;	// a triangle with a vertex out of range is never hit
+};
+
+int math3d_mesh_check(const struct math3d_mesh *mesh);	// returns 0 if any vertex index is out of range
+// closest hit (or any hit if anyhit)
+int math3d_ray_mesh(struct math_context *M, math_t o, math_t d, const struct math3d_mesh *mesh, int anyhit, struct ray_triangle_interset_result *r, uint32_t *triangle_index);
+
+// bvh of triangles, a position independent binary blob (can be saved and loaded)
+#define MATH3D_BVH_TRIANGLES 1	// keeps a copy of triangles
+#define MATH3D_BVH_MESH 2	// reads the mesh in place
+size_t math3d_bvh_size(uint32_t numtriangles);	// buffer size for building
+size_t math3d_bvh_mesh_size(uint32_t numtriangles);
+size_t math3d_bvh_build(const struct triangle* triangles, uint32_t numtriangles, void *buffer);	// returns the size of bvh
+size_t math3d_bvh_build_mesh(const struct math3d_mesh *mesh, void *buffer);
+int math3d_bvh_type(const void *bvh, size_t sz);	// checks the header and the size only, returns the type of bvh, 0 : invalid
+int math3d_bvh_check(const void *bvh, size_t sz);	// validates the whole tree (for a loaded bvh), returns the type of bvh, 0 : invalid
+uint32_t math3d_bvh_numtriangles(const void *bvh);
+// closest hit (or any hit if anyhit), triangle_index (can be NULL) is the index in the triangles for building
+int math3d_bvh_ray(struct math_context *M, math_t o, math_t d, const void *bvh, int anyhit, struct ray_triangle_interset_result *r, uint32_t *triangle_index);
+// the mesh must have the same number of triangles as the one for building
+int math3d_bvh_ray_mesh(struct math_context *M, math_t o, math_t d, const void *bvh, const struct math3d_mesh *mesh, int anyhit, struct ray_triangle_interset_result *r, uint32_t *triangle_index);
+// closest hits of rays in packets, origins/dirs are vec4 arrays (size 1 : shared by all rays).
+// test bvh (MATH3D_BVH_TRIANGLES) if it's not NULL, or triangles. r[i].t < 0 (and triangle_index[i] == UINT32_MAX) : no hit, returns number of hits
+int math3d_rays_triangles(struct math_context *M, math_t origins, math_t dirs, const struct triangle* triangles, uint32_t numtriangles, const void *bvh, struct ray_triangle_interset_result *r, uint32_t *triangle_index);
+
 //plane
 float  math3d_point2plane(struct math_context *, math_t pt, math_t plane);
 int    math3d_plane_test_point(struct math_context * M, math_t plane, math_t p);
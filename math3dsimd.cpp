@@ -0,0 +1,1214 @@
+// SIMD kernels of the batch functions, selected by cpuid at load time.
+
+#include <cstddef>
+#include <cmath>
+#include <cstring>
+#include <atomic>
+
+extern "C" {
+	#include "mathid.h"
+	#include "math3dfunc.h"
+}
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SIMD_TARGET(isa)
+#else
+#include <cpuid.h>
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// All the matrices are column major float[16], stride in bytes, stride 0 : the same matrix for each element.
+
+#define MAT_AT(ptr, stride, i) ((const float *)((const char *)(ptr) + (size_t)(stride) * (i)))
+
+// An aabb is outside the frustum if it's behind any plane :
+// max(px * min.x, px * max.x) + max(py * min.y, py * max.y) + max(pz * min.z, pz * max.z) + pw < 0
+// The 6 planes are transposed (x[8], y[8], z[8], w[8]) and padded with (0,0,0,1) which never culls.
+
+struct cull_planes {
+	float x[8];
+	float y[8];
+	float z[8];
+	float w[8];
+};
+
+static void
+cull_planes_init(struct cull_planes *cp, const float *planes) {
+	int i;
+	for (i=0;i<8;i++) {
+		if (i < 6) {
+			cp->x[i] = planes[i*4+0];
+			cp->y[i] = planes[i*4+1];
+			cp->z[i] = planes[i*4+2];
+			cp->w[i] = planes[i*4+3];
+		} else {
+			cp->x[i] = cp->y[i] = cp->z[i] = 0;
+			cp->w[i] = 1;
+		}
+	}
+}
+
+static inline float
+maxf(float a, float b) {
+	return a > b ? a : b;
+}
+
+static void
+cull_scalar(const struct cull_planes *cp, const float *aabb, int stride, int n, unsigned char *visible) {
+	int i, j;
+	for (i=0;i<n;i++) {
+		const float *a = MAT_AT(aabb, stride, i);
+		int v = 1;
+		for (j=0;j<6;j++) {
+			float d = maxf(cp->x[j] * a[0], cp->x[j] * a[4])
+				+ maxf(cp->y[j] * a[1], cp->y[j] * a[5])
+				+ maxf(cp->z[j] * a[2], cp->z[j] * a[6])
+				+ cp->w[j];
+			if (d < 0) {
+				v = 0;
+				break;
+			}
+		}
+		visible[i] = v;
+	}
+}
+
+// m = T * R * S : the columns of the rotation matrix of the quaternion (x,y,z,w) scaled by s, t as the 4th column.
+// out must not overlap the inputs.
+
+static inline void
+srt_one(float *o, const float *s, const float *q, const float *t) {
+	float x = q[0], y = q[1], z = q[2], w = q[3];
+	o[0] = (1 - 2 * (y*y + z*z)) * s[0];
+	o[1] = 2 * (x*y + w*z) * s[0];
+	o[2] = 2 * (x*z - w*y) * s[0];
+	o[3] = 0;
+	o[4] = 2 * (x*y - w*z) * s[1];
+	o[5] = (1 - 2 * (x*x + z*z)) * s[1];
+	o[6] = 2 * (y*z + w*x) * s[1];
+	o[7] = 0;
+	o[8] = 2 * (x*z + w*y) * s[2];
+	o[9] = 2 * (y*z - w*x) * s[2];
+	o[10] = (1 - 2 * (x*x + y*y)) * s[2];
+	o[11] = 0;
+	o[12] = t[0];
+	o[13] = t[1];
+	o[14] = t[2];
+	o[15] = 1;
+}
+
+static void
+srt_scalar(float *out, int ostride, const float *s, int sstride, const float *r, int rstride, const float *t, int tstride, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		srt_one((float *)MAT_AT(out, ostride, i), MAT_AT(s, sstride, i), MAT_AT(r, rstride, i), MAT_AT(t, tstride, i));
+	}
+}
+
+// The same as glm::decompose for affine matrices : Gram-Schmidt for the scale (negative if the determinant is negative),
+// and the quaternion from the largest of w, x, y, z : each component is (value * 0.5 / sqrt(arg)), arg for the largest one.
+// s.w = 0, t.w = 1
+
+static inline void
+decompose_one(const float *m, float *s, float *q, float *t) {
+	float c[3][3];
+	int i, j;
+	for (i=0;i<3;i++)
+		for (j=0;j<3;j++)
+			c[i][j] = m[i*4+j];
+	float sc[3];
+	float k;
+	sc[0] = sqrtf(c[0][0]*c[0][0] + c[0][1]*c[0][1] + c[0][2]*c[0][2]);
+	for (j=0;j<3;j++) c[0][j] /= sc[0];
+	k = c[0][0]*c[1][0] + c[0][1]*c[1][1] + c[0][2]*c[1][2];
+	for (j=0;j<3;j++) c[1][j] -= c[0][j] * k;
+	sc[1] = sqrtf(c[1][0]*c[1][0] + c[1][1]*c[1][1] + c[1][2]*c[1][2]);
+	for (j=0;j<3;j++) c[1][j] /= sc[1];
+	k = c[0][0]*c[2][0] + c[0][1]*c[2][1] + c[0][2]*c[2][2];
+	for (j=0;j<3;j++) c[2][j] -= c[0][j] * k;
+	k = c[1][0]*c[2][0] + c[1][1]*c[2][1] + c[1][2]*c[2][2];
+	for (j=0;j<3;j++) c[2][j] -= c[1][j] * k;
+	sc[2] = sqrtf(c[2][0]*c[2][0] + c[2][1]*c[2][1] + c[2][2]*c[2][2]);
+	for (j=0;j<3;j++) c[2][j] /= sc[2];
+	float det = c[0][0] * (c[1][1]*c[2][2] - c[1][2]*c[2][1])
+		+ c[0][1] * (c[1][2]*c[2][0] - c[1][0]*c[2][2])
+		+ c[0][2] * (c[1][0]*c[2][1] - c[1][1]*c[2][0]);
+	if (det < 0) {
+		for (i=0;i<3;i++) {
+			sc[i] = -sc[i];
+			for (j=0;j<3;j++)
+				c[i][j] = -c[i][j];
+		}
+	}
+	float d12 = c[1][2] - c[2][1], d20 = c[2][0] - c[0][2], d01 = c[0][1] - c[1][0];
+	float s01 = c[0][1] + c[1][0], s02 = c[0][2] + c[2][0], s12 = c[1][2] + c[2][1];
+	float trace = c[0][0] + c[1][1] + c[2][2];
+	float arg, x, y, z, w;
+	if (trace > 0) {
+		arg = trace + 1;
+		x = d12; y = d20; z = d01; w = arg;
+	} else if (c[2][2] > (c[1][1] > c[0][0] ? c[1][1] : c[0][0])) {
+		arg = c[2][2] - c[0][0] - c[1][1] + 1;
+		x = s02; y = s12; z = arg; w = d01;
+	} else if (c[1][1] > c[0][0]) {
+		arg = c[1][1] - c[2][2] - c[0][0] + 1;
+		x = s01; y = arg; z = s12; w = d20;
+	} else {
+		arg = c[0][0] - c[1][1] - c[2][2] + 1;
+		x = arg; y = s01; z = s02; w = d12;
+	}
+	float h = 0.5f / sqrtf(arg);
+	q[0] = x * h;
+	q[1] = y * h;
+	q[2] = z * h;
+	q[3] = w * h;
+	s[0] = sc[0];
+	s[1] = sc[1];
+	s[2] = sc[2];
+	s[3] = 0;
+	t[0] = m[12];
+	t[1] = m[13];
+	t[2] = m[14];
+	t[3] = 1;
+}
+
+static void
+decompose_scalar(const float *m, int stride, int n, float *s, float *r, float *t) {
+	int i;
+	for (i=0;i<n;i++) {
+		decompose_one(MAT_AT(m, stride, i), s + i * 4, r + i * 4, t + i * 4);
+	}
+}
+
+// pose blending, a quat is (x,y,z,w)
+
+static inline void
+quat_mul(float *r, const float *a, const float *b) {
+	float x = a[3]*b[0] + a[0]*b[3] + a[1]*b[2] - a[2]*b[1];
+	float y = a[3]*b[1] + a[1]*b[3] + a[2]*b[0] - a[0]*b[2];
+	float z = a[3]*b[2] + a[2]*b[3] + a[0]*b[1] - a[1]*b[0];
+	float w = a[3]*b[3] - a[0]*b[0] - a[1]*b[1] - a[2]*b[2];
+	r[0] = x;
+	r[1] = y;
+	r[2] = z;
+	r[3] = w;
+}
+
+static inline void
+quat_nlerp(float *r, const float *a, const float *b, float w) {
+	float d = a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+	// the shortest path
+	float sb = d < 0 ? -1.0f : 1.0f;
+	float q[4];
+	int i;
+	for (i=0;i<4;i++)
+		q[i] = a[i] + (b[i] * sb - a[i]) * w;
+	float inv = 1.0f / sqrtf(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+	for (i=0;i<4;i++)
+		r[i] = q[i] * inv;
+}
+
+// the operation order of glm::slerp (glm::dot of quat is (w*w + x*x) + (y*y + z*z)), so it matches math3d_quat_slerp
+static inline void
+quat_slerp(float *r, const float *a, const float *b, float w) {
+	float d = (a[3]*b[3] + a[0]*b[0]) + (a[1]*b[1] + a[2]*b[2]);
+	float z[4];
+	int i;
+	if (d < 0) {
+		d = -d;
+		for (i=0;i<4;i++)
+			z[i] = -b[i];
+	} else {
+		for (i=0;i<4;i++)
+			z[i] = b[i];
+	}
+	if (d > 1.0f - 1.192092896e-07f) {
+		// glm::mix
+		for (i=0;i<4;i++)
+			r[i] = a[i] * (1.0f - w) + z[i] * w;
+	} else {
+		float angle = acosf(d);
+		float ka = sinf((1.0f - w) * angle);
+		float kb = sinf(w * angle);
+		float s = sinf(angle);
+		for (i=0;i<4;i++)
+			r[i] = (ka * a[i] + kb * z[i]) / s;
+	}
+}
+
+static void
+blend_scalar(int mode, int quat, float *out, int ostride, const float *a, int astride, const float *b, int bstride, const float *w, int wstride, int n) {
+	static const float identity[4] = { 0, 0, 0, 1 };
+	int i, j;
+	for (i=0;i<n;i++) {
+		float *o = (float *)MAT_AT(out, ostride, i);
+		const float *av = MAT_AT(a, astride, i);
+		const float *bv = MAT_AT(b, bstride, i);
+		float wv = *MAT_AT(w, wstride, i);
+		if (!quat) {
+			if (mode == MATH3D_BLEND_ADDITIVE) {
+				for (j=0;j<4;j++)
+					o[j] = av[j] + bv[j] * wv;
+			} else {
+				for (j=0;j<4;j++)
+					o[j] = av[j] + (bv[j] - av[j]) * wv;
+			}
+		} else {
+			switch (mode) {
+			case MATH3D_BLEND_LERP:
+				quat_nlerp(o, av, bv, wv);
+				break;
+			case MATH3D_BLEND_SLERP:
+				quat_slerp(o, av, bv, wv);
+				break;
+			case MATH3D_BLEND_ADDITIVE: {
+				float d[4];
+				quat_nlerp(d, identity, bv, wv);
+				quat_mul(o, av, d);
+				break;
+			}
+			}
+		}
+	}
+}
+
+// skinning palette : root * world[i] * invbind[i], column major mat4 or the first 3 rows (transposed 3x4)
+
+static inline void
+mat_mul_scalar(float *o, const float *a, const float *b) {
+	int i, j;
+	for (j=0;j<4;j++) {
+		for (i=0;i<4;i++) {
+			o[j*4+i] = a[i] * b[j*4] + a[4+i] * b[j*4+1] + a[8+i] * b[j*4+2] + a[12+i] * b[j*4+3];
+		}
+	}
+}
+
+static void
+skin_scalar(float *out, int ostride, int format, const float *root, const float *world, int wstride, const float *invbind, int bstride, int n) {
+	int i, j;
+	for (i=0;i<n;i++) {
+		float m[16], r[16];
+		mat_mul_scalar(m, MAT_AT(world, wstride, i), MAT_AT(invbind, bstride, i));
+		const float *p = m;
+		if (root) {
+			mat_mul_scalar(r, root, m);
+			p = r;
+		}
+		float *o = (float *)MAT_AT(out, ostride, i);
+		if (format == MATH3D_PALETTE_3X4) {
+			for (j=0;j<4;j++) {
+				o[j] = p[j*4];
+				o[4+j] = p[j*4+1];
+				o[8+j] = p[j*4+2];
+			}
+		} else {
+			for (j=0;j<16;j++)
+				o[j] = p[j];
+		}
+	}
+}
+
+// gpu export : mat4, the first 3 rows (transposed 3x4) or vec4, packed in float or half float
+
+static inline int
+export_count(int layout) {
+	switch (layout) {
+	case MATH3D_EXPORT_3X4:
+		return 12;
+	case MATH3D_EXPORT_VEC4:
+		return 4;
+	default:
+		return 16;
+	}
+}
+
+// the same result as F16C (vcvtps2ph) with round to nearest even
+static inline uint16_t
+float_to_half(float f) {
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	uint16_t sign = (uint16_t)((u >> 16) & 0x8000);
+	uint32_t a = u & 0x7fffffff;
+	if (a >= 0x7f800000) {
+		// inf, or a quiet nan keeps the high bits of payload
+		return sign | 0x7c00 | (a > 0x7f800000 ? 0x200 | ((a >> 13) & 0x3ff) : 0);
+	}
+	if (a >= 0x47800000)	// >= 65536, overflow
+		return sign | 0x7c00;
+	uint32_t h, rem, halfway;
+	if (a >= 0x38800000) {
+		// normal, rebias the exponent (127 -> 15), the carry of rounding may overflow to inf
+		h = (a - 0x38000000) >> 13;
+		rem = a & 0x1fff;
+		halfway = 0x1000;
+	} else {
+		// subnormal : round(f * 2^24)
+		int shift = 126 - (int)(a >> 23);
+		if (shift > 24)
+			return sign;
+		uint32_t m = (a & 0x7fffff) | 0x800000;
+		h = m >> shift;
+		rem = m & ((1u << shift) - 1);
+		halfway = 1u << (shift - 1);
+	}
+	if (rem > halfway || (rem == halfway && (h & 1)))
+		++h;
+	return sign | (uint16_t)h;
+}
+
+static void
+export_scalar(void *out, int format, const float *v, int stride, int n) {
+	int layout = format & ~MATH3D_EXPORT_HALF;
+	int count = export_count(layout);
+	char *o = (char *)out;
+	int i, j;
+	for (i=0;i<n;i++) {
+		const float *p = MAT_AT(v, stride, i);
+		float t[16];
+		if (layout == MATH3D_EXPORT_3X4) {
+			for (j=0;j<4;j++) {
+				t[j] = p[j*4];
+				t[4+j] = p[j*4+1];
+				t[8+j] = p[j*4+2];
+			}
+			p = t;
+		}
+		if (format & MATH3D_EXPORT_HALF) {
+			uint16_t h[16];
+			for (j=0;j<count;j++)
+				h[j] = float_to_half(p[j]);
+			memcpy(o, h, count * sizeof(uint16_t));
+			o += count * sizeof(uint16_t);
+		} else {
+			memcpy(o, p, count * sizeof(float));
+			o += count * sizeof(float);
+		}
+	}
+}
+
+#ifdef SIMD_X86
+
+SIMD_TARGET("sse4.1") static void
+mul_array_sse41(float *out, int ostride, const float *m1, int stride1, const float *m2, int stride2, int n) {
+	int i, j;
+	for (i=0;i<n;i++) {
+		const float *a = MAT_AT(m1, stride1, i);
+		const float *b = MAT_AT(m2, stride2, i);
+		float *o = (float *)MAT_AT(out, ostride, i);
+		__m128 a0 = _mm_loadu_ps(a);
+		__m128 a1 = _mm_loadu_ps(a + 4);
+		__m128 a2 = _mm_loadu_ps(a + 8);
+		__m128 a3 = _mm_loadu_ps(a + 12);
+		__m128 c[4];
+		for (j=0;j<4;j++) {
+			__m128 bc = _mm_loadu_ps(b + j * 4);
+			__m128 s = _mm_mul_ps(a0, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(0,0,0,0)));
+			s = _mm_add_ps(s, _mm_mul_ps(a1, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(1,1,1,1))));
+			s = _mm_add_ps(s, _mm_mul_ps(a2, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(2,2,2,2))));
+			s = _mm_add_ps(s, _mm_mul_ps(a3, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(3,3,3,3))));
+			c[j] = s;
+		}
+		// store after all the loads, out may alias m1 or m2
+		for (j=0;j<4;j++) {
+			_mm_storeu_ps(o + j * 4, c[j]);
+		}
+	}
+}
+
+SIMD_TARGET("sse4.1") static void
+cull_sse41(const struct cull_planes *cp, const float *aabb, int stride, int n, unsigned char *visible) {
+	int i, j;
+	__m128 px[2], py[2], pz[2], pw[2];
+	for (j=0;j<2;j++) {
+		px[j] = _mm_loadu_ps(cp->x + j * 4);
+		py[j] = _mm_loadu_ps(cp->y + j * 4);
+		pz[j] = _mm_loadu_ps(cp->z + j * 4);
+		pw[j] = _mm_loadu_ps(cp->w + j * 4);
+	}
+	__m128 zero = _mm_setzero_ps();
+	for (i=0;i<n;i++) {
+		const float *a = MAT_AT(aabb, stride, i);
+		__m128 minx = _mm_set1_ps(a[0]), miny = _mm_set1_ps(a[1]), minz = _mm_set1_ps(a[2]);
+		__m128 maxx = _mm_set1_ps(a[4]), maxy = _mm_set1_ps(a[5]), maxz = _mm_set1_ps(a[6]);
+		int out = 0;
+		for (j=0;j<2;j++) {
+			__m128 d = _mm_add_ps(pw[j], _mm_max_ps(_mm_mul_ps(px[j], minx), _mm_mul_ps(px[j], maxx)));
+			d = _mm_add_ps(d, _mm_max_ps(_mm_mul_ps(py[j], miny), _mm_mul_ps(py[j], maxy)));
+			d = _mm_add_ps(d, _mm_max_ps(_mm_mul_ps(pz[j], minz), _mm_mul_ps(pz[j], maxz)));
+			out |= _mm_movemask_ps(_mm_cmplt_ps(d, zero));
+		}
+		visible[i] = (out == 0);
+	}
+}
+
+// 8 planes per 256bit register
+SIMD_TARGET("avx2,fma") static void
+cull_avx2(const struct cull_planes *cp, const float *aabb, int stride, int n, unsigned char *visible) {
+	int i;
+	__m256 px = _mm256_loadu_ps(cp->x);
+	__m256 py = _mm256_loadu_ps(cp->y);
+	__m256 pz = _mm256_loadu_ps(cp->z);
+	__m256 pw = _mm256_loadu_ps(cp->w);
+	__m256 zero = _mm256_setzero_ps();
+	for (i=0;i<n;i++) {
+		const float *a = MAT_AT(aabb, stride, i);
+		__m256 d = _mm256_add_ps(pw, _mm256_max_ps(_mm256_mul_ps(px, _mm256_broadcast_ss(a+0)), _mm256_mul_ps(px, _mm256_broadcast_ss(a+4))));
+		d = _mm256_add_ps(d, _mm256_max_ps(_mm256_mul_ps(py, _mm256_broadcast_ss(a+1)), _mm256_mul_ps(py, _mm256_broadcast_ss(a+5))));
+		d = _mm256_add_ps(d, _mm256_max_ps(_mm256_mul_ps(pz, _mm256_broadcast_ss(a+2)), _mm256_mul_ps(pz, _mm256_broadcast_ss(a+6))));
+		visible[i] = (_mm256_movemask_ps(_mm256_cmp_ps(d, zero, _CMP_LT_OQ)) == 0);
+	}
+}
+
+// the same vec4 in both lanes, the pointer may be unaligned
+SIMD_TARGET("avx2,fma") static inline __m256
+broadcast4_avx2(const float *p) {
+	__m128 v = _mm_loadu_ps(p);
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(v), v, 1);
+}
+
+// two columns per 256bit register, mul + add (no fma) keeps the same rounding as the scalar (glm) version
+SIMD_TARGET("avx2,fma") static void
+mul_array_avx2(float *out, int ostride, const float *m1, int stride1, const float *m2, int stride2, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		const float *a = MAT_AT(m1, stride1, i);
+		const float *b = MAT_AT(m2, stride2, i);
+		float *o = (float *)MAT_AT(out, ostride, i);
+		__m256 a0 = broadcast4_avx2(a);
+		__m256 a1 = broadcast4_avx2(a + 4);
+		__m256 a2 = broadcast4_avx2(a + 8);
+		__m256 a3 = broadcast4_avx2(a + 12);
+		__m256 b01 = _mm256_loadu_ps(b);
+		__m256 b23 = _mm256_loadu_ps(b + 8);
+		__m256 c01 = _mm256_mul_ps(a0, _mm256_permute_ps(b01, _MM_SHUFFLE(0,0,0,0)));
+		__m256 c23 = _mm256_mul_ps(a0, _mm256_permute_ps(b23, _MM_SHUFFLE(0,0,0,0)));
+		c01 = _mm256_add_ps(c01, _mm256_mul_ps(a1, _mm256_permute_ps(b01, _MM_SHUFFLE(1,1,1,1))));
+		c23 = _mm256_add_ps(c23, _mm256_mul_ps(a1, _mm256_permute_ps(b23, _MM_SHUFFLE(1,1,1,1))));
+		c01 = _mm256_add_ps(c01, _mm256_mul_ps(a2, _mm256_permute_ps(b01, _MM_SHUFFLE(2,2,2,2))));
+		c23 = _mm256_add_ps(c23, _mm256_mul_ps(a2, _mm256_permute_ps(b23, _MM_SHUFFLE(2,2,2,2))));
+		c01 = _mm256_add_ps(c01, _mm256_mul_ps(a3, _mm256_permute_ps(b01, _MM_SHUFFLE(3,3,3,3))));
+		c23 = _mm256_add_ps(c23, _mm256_mul_ps(a3, _mm256_permute_ps(b23, _MM_SHUFFLE(3,3,3,3))));
+		_mm256_storeu_ps(o, c01);
+		_mm256_storeu_ps(o + 8, c23);
+	}
+}
+
+// the whole matrix in a 512bit register, mul + add as mul_array_avx2. The mask versions avoid the undefined source of gcc's intrinsics
+SIMD_TARGET("avx512f") static void
+mul_array_avx512(float *out, int ostride, const float *m1, int stride1, const float *m2, int stride2, int n) {
+	int i;
+	for (i=0;i<n;i++) {
+		const float *a = MAT_AT(m1, stride1, i);
+		const float *b = MAT_AT(m2, stride2, i);
+		float *o = (float *)MAT_AT(out, ostride, i);
+		__m512 am = _mm512_loadu_ps(a);
+		__m512 a0 = _mm512_mask_shuffle_f32x4(am, 0xffff, am, am, _MM_SHUFFLE(0,0,0,0));
+		__m512 a1 = _mm512_mask_shuffle_f32x4(am, 0xffff, am, am, _MM_SHUFFLE(1,1,1,1));
+		__m512 a2 = _mm512_mask_shuffle_f32x4(am, 0xffff, am, am, _MM_SHUFFLE(2,2,2,2));
+		__m512 a3 = _mm512_mask_shuffle_f32x4(am, 0xffff, am, am, _MM_SHUFFLE(3,3,3,3));
+		__m512 bm = _mm512_loadu_ps(b);
+		__m512 c = _mm512_mul_ps(a0, _mm512_mask_permute_ps(bm, 0xffff, bm, _MM_SHUFFLE(0,0,0,0)));
+		c = _mm512_add_ps(c, _mm512_mul_ps(a1, _mm512_mask_permute_ps(bm, 0xffff, bm, _MM_SHUFFLE(1,1,1,1))));
+		c = _mm512_add_ps(c, _mm512_mul_ps(a2, _mm512_mask_permute_ps(bm, 0xffff, bm, _MM_SHUFFLE(2,2,2,2))));
+		c = _mm512_add_ps(c, _mm512_mul_ps(a3, _mm512_mask_permute_ps(bm, 0xffff, bm, _MM_SHUFFLE(3,3,3,3))));
+		_mm512_storeu_ps(o, c);
+	}
+}
+
+// 4 matrices a time in SoA : transpose the inputs of 4 elements into x,y,z,w registers, and transpose the columns back.
+SIMD_TARGET("sse4.1") static void
+srt_sse41(float *out, int ostride, const float *s, int sstride, const float *r, int rstride, const float *t, int tstride, int n) {
+	int i, j;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 two = _mm_set1_ps(2.0f);
+	for (i=0;i+4<=n;i+=4) {
+		__m128 x = _mm_loadu_ps(MAT_AT(r, rstride, i));
+		__m128 y = _mm_loadu_ps(MAT_AT(r, rstride, i+1));
+		__m128 z = _mm_loadu_ps(MAT_AT(r, rstride, i+2));
+		__m128 w = _mm_loadu_ps(MAT_AT(r, rstride, i+3));
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		__m128 sx = _mm_loadu_ps(MAT_AT(s, sstride, i));
+		__m128 sy = _mm_loadu_ps(MAT_AT(s, sstride, i+1));
+		__m128 sz = _mm_loadu_ps(MAT_AT(s, sstride, i+2));
+		__m128 sw = _mm_loadu_ps(MAT_AT(s, sstride, i+3));
+		_MM_TRANSPOSE4_PS(sx, sy, sz, sw);
+		__m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+		__m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+		__m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+		__m128 c[3][4];
+		c[0][0] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx);
+		c[0][1] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx);
+		c[0][2] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx);
+		c[1][0] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy);
+		c[1][1] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy);
+		c[1][2] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy);
+		c[2][0] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz);
+		c[2][1] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz);
+		c[2][2] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz);
+		for (j=0;j<3;j++) {
+			c[j][3] = zero;
+			_MM_TRANSPOSE4_PS(c[j][0], c[j][1], c[j][2], c[j][3]);
+		}
+		for (j=0;j<4;j++) {
+			float *o = (float *)MAT_AT(out, ostride, i+j);
+			_mm_storeu_ps(o, c[0][j]);
+			_mm_storeu_ps(o + 4, c[1][j]);
+			_mm_storeu_ps(o + 8, c[2][j]);
+			// t.w is ignored
+			_mm_storeu_ps(o + 12, _mm_blend_ps(_mm_loadu_ps(MAT_AT(t, tstride, i+j)), one, 8));
+		}
+	}
+	srt_scalar((float *)MAT_AT(out, ostride, i), ostride, MAT_AT(s, sstride, i), sstride, MAT_AT(r, rstride, i), rstride, MAT_AT(t, tstride, i), tstride, n - i);
+}
+
+SIMD_TARGET("sse4.1") static inline __m128
+dot3_sse41(const __m128 a[3], const __m128 b[3]) {
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+SIMD_TARGET("sse4.1") static inline void
+scale3_sse41(__m128 a[3], __m128 k) {
+	a[0] = _mm_mul_ps(a[0], k);
+	a[1] = _mm_mul_ps(a[1], k);
+	a[2] = _mm_mul_ps(a[2], k);
+}
+
+// a -= b * k
+SIMD_TARGET("sse4.1") static inline void
+sub3_sse41(__m128 a[3], const __m128 b[3], __m128 k) {
+	a[0] = _mm_sub_ps(a[0], _mm_mul_ps(b[0], k));
+	a[1] = _mm_sub_ps(a[1], _mm_mul_ps(b[1], k));
+	a[2] = _mm_sub_ps(a[2], _mm_mul_ps(b[2], k));
+}
+
+// the same steps of decompose_one, branches are blends
+SIMD_TARGET("sse4.1") static void
+decompose_sse41(const float *m, int stride, int n, float *s, float *r, float *t) {
+	int i, j;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	for (i=0;i+4<=n;i+=4) {
+		const float *mat[4];
+		__m128 c[4][4];
+		for (j=0;j<4;j++)
+			mat[j] = MAT_AT(m, stride, i+j);
+		for (j=0;j<3;j++) {
+			c[j][0] = _mm_loadu_ps(mat[0] + j * 4);
+			c[j][1] = _mm_loadu_ps(mat[1] + j * 4);
+			c[j][2] = _mm_loadu_ps(mat[2] + j * 4);
+			c[j][3] = _mm_loadu_ps(mat[3] + j * 4);
+			_MM_TRANSPOSE4_PS(c[j][0], c[j][1], c[j][2], c[j][3]);
+		}
+		__m128 sx = _mm_sqrt_ps(dot3_sse41(c[0], c[0]));
+		scale3_sse41(c[0], _mm_div_ps(one, sx));
+		sub3_sse41(c[1], c[0], dot3_sse41(c[0], c[1]));
+		__m128 sy = _mm_sqrt_ps(dot3_sse41(c[1], c[1]));
+		scale3_sse41(c[1], _mm_div_ps(one, sy));
+		sub3_sse41(c[2], c[0], dot3_sse41(c[0], c[2]));
+		sub3_sse41(c[2], c[1], dot3_sse41(c[1], c[2]));
+		__m128 sz = _mm_sqrt_ps(dot3_sse41(c[2], c[2]));
+		scale3_sse41(c[2], _mm_div_ps(one, sz));
+		__m128 det = _mm_mul_ps(c[0][0], _mm_sub_ps(_mm_mul_ps(c[1][1], c[2][2]), _mm_mul_ps(c[1][2], c[2][1])));
+		det = _mm_add_ps(det, _mm_mul_ps(c[0][1], _mm_sub_ps(_mm_mul_ps(c[1][2], c[2][0]), _mm_mul_ps(c[1][0], c[2][2]))));
+		det = _mm_add_ps(det, _mm_mul_ps(c[0][2], _mm_sub_ps(_mm_mul_ps(c[1][0], c[2][1]), _mm_mul_ps(c[1][1], c[2][0]))));
+		__m128 flip = _mm_and_ps(_mm_cmplt_ps(det, zero), sign);
+		sx = _mm_xor_ps(sx, flip);
+		sy = _mm_xor_ps(sy, flip);
+		sz = _mm_xor_ps(sz, flip);
+		for (j=0;j<3;j++) {
+			c[j][0] = _mm_xor_ps(c[j][0], flip);
+			c[j][1] = _mm_xor_ps(c[j][1], flip);
+			c[j][2] = _mm_xor_ps(c[j][2], flip);
+		}
+		__m128 d12 = _mm_sub_ps(c[1][2], c[2][1]), d20 = _mm_sub_ps(c[2][0], c[0][2]), d01 = _mm_sub_ps(c[0][1], c[1][0]);
+		__m128 s01 = _mm_add_ps(c[0][1], c[1][0]), s02 = _mm_add_ps(c[0][2], c[2][0]), s12 = _mm_add_ps(c[1][2], c[2][1]);
+		__m128 trace = _mm_add_ps(_mm_add_ps(c[0][0], c[1][1]), c[2][2]);
+		__m128 ismax1 = _mm_cmpgt_ps(c[1][1], c[0][0]);
+		__m128 ismax2 = _mm_cmpgt_ps(c[2][2], _mm_max_ps(c[0][0], c[1][1]));
+		__m128 isw = _mm_cmpgt_ps(trace, zero);
+		// x is the largest
+		__m128 arg = _mm_add_ps(_mm_sub_ps(_mm_sub_ps(c[0][0], c[1][1]), c[2][2]), one);
+		__m128 qx = arg, qy = s01, qz = s02, qw = d12;
+		// y
+		arg = _mm_blendv_ps(arg, _mm_add_ps(_mm_sub_ps(_mm_sub_ps(c[1][1], c[2][2]), c[0][0]), one), ismax1);
+		qx = _mm_blendv_ps(qx, s01, ismax1);
+		qy = _mm_blendv_ps(qy, arg, ismax1);
+		qz = _mm_blendv_ps(qz, s12, ismax1);
+		qw = _mm_blendv_ps(qw, d20, ismax1);
+		// z
+		arg = _mm_blendv_ps(arg, _mm_add_ps(_mm_sub_ps(_mm_sub_ps(c[2][2], c[0][0]), c[1][1]), one), ismax2);
+		qx = _mm_blendv_ps(qx, s02, ismax2);
+		qy = _mm_blendv_ps(qy, s12, ismax2);
+		qz = _mm_blendv_ps(qz, arg, ismax2);
+		qw = _mm_blendv_ps(qw, d01, ismax2);
+		// w
+		arg = _mm_blendv_ps(arg, _mm_add_ps(trace, one), isw);
+		qx = _mm_blendv_ps(qx, d12, isw);
+		qy = _mm_blendv_ps(qy, d20, isw);
+		qz = _mm_blendv_ps(qz, d01, isw);
+		qw = _mm_blendv_ps(qw, arg, isw);
+		__m128 h = _mm_div_ps(half, _mm_sqrt_ps(arg));
+		qx = _mm_mul_ps(qx, h);
+		qy = _mm_mul_ps(qy, h);
+		qz = _mm_mul_ps(qz, h);
+		qw = _mm_mul_ps(qw, h);
+		__m128 sw = zero;
+		_MM_TRANSPOSE4_PS(sx, sy, sz, sw);
+		_MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+		float *so = s + i * 4, *ro = r + i * 4, *to = t + i * 4;
+		_mm_storeu_ps(so, sx);
+		_mm_storeu_ps(so + 4, sy);
+		_mm_storeu_ps(so + 8, sz);
+		_mm_storeu_ps(so + 12, sw);
+		_mm_storeu_ps(ro, qx);
+		_mm_storeu_ps(ro + 4, qy);
+		_mm_storeu_ps(ro + 8, qz);
+		_mm_storeu_ps(ro + 12, qw);
+		for (j=0;j<4;j++) {
+			_mm_storeu_ps(to + j * 4, _mm_blend_ps(_mm_loadu_ps(mat[j] + 12), one, 8));
+		}
+	}
+	decompose_scalar(MAT_AT(m, stride, i), stride, n - i, s + i * 4, r + i * 4, t + i * 4);
+}
+
+// one vec4/quat per register, slerp is left to blend_scalar
+SIMD_TARGET("sse4.1") static void
+blend_sse41(int mode, int quat, float *out, int ostride, const float *a, int astride, const float *b, int bstride, const float *w, int wstride, int n) {
+	if (quat && mode == MATH3D_BLEND_SLERP) {
+		blend_scalar(mode, quat, out, ostride, a, astride, b, bstride, w, wstride, n);
+		return;
+	}
+	int i;
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 identity = _mm_set_ps(1, 0, 0, 0);
+	const __m128 sign13 = _mm_set_ps(-0.0f, 0, -0.0f, 0);
+	const __m128 sign23 = _mm_set_ps(-0.0f, -0.0f, 0, 0);
+	const __m128 sign03 = _mm_set_ps(-0.0f, 0, 0, -0.0f);
+	for (i=0;i<n;i++) {
+		__m128 av = _mm_loadu_ps(MAT_AT(a, astride, i));
+		__m128 bv = _mm_loadu_ps(MAT_AT(b, bstride, i));
+		__m128 wv = _mm_set1_ps(*MAT_AT(w, wstride, i));
+		__m128 r;
+		if (!quat) {
+			if (mode == MATH3D_BLEND_ADDITIVE) {
+				r = _mm_add_ps(av, _mm_mul_ps(bv, wv));
+			} else {
+				r = _mm_add_ps(av, _mm_mul_ps(_mm_sub_ps(bv, av), wv));
+			}
+		} else {
+			__m128 from = mode == MATH3D_BLEND_ADDITIVE ? identity : av;
+			// nlerp(from, b, w), b is negated if dot(from, b) < 0
+			bv = _mm_xor_ps(bv, _mm_and_ps(_mm_cmplt_ps(_mm_dp_ps(from, bv, 0xff), zero), sign));
+			r = _mm_add_ps(from, _mm_mul_ps(_mm_sub_ps(bv, from), wv));
+			r = _mm_div_ps(r, _mm_sqrt_ps(_mm_dp_ps(r, r, 0xff)));
+			if (mode == MATH3D_BLEND_ADDITIVE) {
+				// a * r
+				__m128 q = _mm_mul_ps(_mm_shuffle_ps(av, av, _MM_SHUFFLE(3,3,3,3)), r);
+				q = _mm_add_ps(q, _mm_mul_ps(_mm_shuffle_ps(av, av, _MM_SHUFFLE(0,0,0,0)),
+					_mm_xor_ps(_mm_shuffle_ps(r, r, _MM_SHUFFLE(0,1,2,3)), sign13)));
+				q = _mm_add_ps(q, _mm_mul_ps(_mm_shuffle_ps(av, av, _MM_SHUFFLE(1,1,1,1)),
+					_mm_xor_ps(_mm_shuffle_ps(r, r, _MM_SHUFFLE(1,0,3,2)), sign23)));
+				q = _mm_add_ps(q, _mm_mul_ps(_mm_shuffle_ps(av, av, _MM_SHUFFLE(2,2,2,2)),
+					_mm_xor_ps(_mm_shuffle_ps(r, r, _MM_SHUFFLE(2,3,0,1)), sign03)));
+				r = q;
+			}
+		}
+		_mm_storeu_ps((float *)MAT_AT(out, ostride, i), r);
+	}
+}
+
+// c = a * b, a in registers
+SIMD_TARGET("sse4.1") static inline void
+mat_mul_sse41(__m128 c[4], const __m128 a[4], const float *b) {
+	int j;
+	for (j=0;j<4;j++) {
+		__m128 bc = _mm_loadu_ps(b + j * 4);
+		__m128 s = _mm_mul_ps(a[0], _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(0,0,0,0)));
+		s = _mm_add_ps(s, _mm_mul_ps(a[1], _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(1,1,1,1))));
+		s = _mm_add_ps(s, _mm_mul_ps(a[2], _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(2,2,2,2))));
+		s = _mm_add_ps(s, _mm_mul_ps(a[3], _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(3,3,3,3))));
+		c[j] = s;
+	}
+}
+
+SIMD_TARGET("sse4.1") static void
+skin_sse41(float *out, int ostride, int format, const float *root, const float *world, int wstride, const float *invbind, int bstride, int n) {
+	int i, j;
+	__m128 rm[4];
+	if (root) {
+		for (j=0;j<4;j++)
+			rm[j] = _mm_loadu_ps(root + j * 4);
+	}
+	for (i=0;i<n;i++) {
+		const float *w = MAT_AT(world, wstride, i);
+		__m128 wm[4], c[4];
+		for (j=0;j<4;j++)
+			wm[j] = _mm_loadu_ps(w + j * 4);
+		mat_mul_sse41(c, wm, MAT_AT(invbind, bstride, i));
+		if (root) {
+			// root * c, column by column
+			for (j=0;j<4;j++) {
+				__m128 s = _mm_mul_ps(rm[0], _mm_shuffle_ps(c[j], c[j], _MM_SHUFFLE(0,0,0,0)));
+				s = _mm_add_ps(s, _mm_mul_ps(rm[1], _mm_shuffle_ps(c[j], c[j], _MM_SHUFFLE(1,1,1,1))));
+				s = _mm_add_ps(s, _mm_mul_ps(rm[2], _mm_shuffle_ps(c[j], c[j], _MM_SHUFFLE(2,2,2,2))));
+				s = _mm_add_ps(s, _mm_mul_ps(rm[3], _mm_shuffle_ps(c[j], c[j], _MM_SHUFFLE(3,3,3,3))));
+				c[j] = s;
+			}
+		}
+		float *o = (float *)MAT_AT(out, ostride, i);
+		if (format == MATH3D_PALETTE_3X4) {
+			_MM_TRANSPOSE4_PS(c[0], c[1], c[2], c[3]);
+			_mm_storeu_ps(o, c[0]);
+			_mm_storeu_ps(o + 4, c[1]);
+			_mm_storeu_ps(o + 8, c[2]);
+		} else {
+			for (j=0;j<4;j++)
+				_mm_storeu_ps(o + j * 4, c[j]);
+		}
+	}
+}
+
+// two columns per 256bit register, as mul_array_avx2 (mul + add, no fma) : c01, c23 = a * (b01, b23)
+SIMD_TARGET("avx2,fma") static inline void
+mat_mul_avx2(__m256 c[2], const __m256 a[4], __m256 b01, __m256 b23) {
+	__m256 c01 = _mm256_mul_ps(a[0], _mm256_permute_ps(b01, _MM_SHUFFLE(0,0,0,0)));
+	__m256 c23 = _mm256_mul_ps(a[0], _mm256_permute_ps(b23, _MM_SHUFFLE(0,0,0,0)));
+	c01 = _mm256_add_ps(c01, _mm256_mul_ps(a[1], _mm256_permute_ps(b01, _MM_SHUFFLE(1,1,1,1))));
+	c23 = _mm256_add_ps(c23, _mm256_mul_ps(a[1], _mm256_permute_ps(b23, _MM_SHUFFLE(1,1,1,1))));
+	c01 = _mm256_add_ps(c01, _mm256_mul_ps(a[2], _mm256_permute_ps(b01, _MM_SHUFFLE(2,2,2,2))));
+	c23 = _mm256_add_ps(c23, _mm256_mul_ps(a[2], _mm256_permute_ps(b23, _MM_SHUFFLE(2,2,2,2))));
+	c01 = _mm256_add_ps(c01, _mm256_mul_ps(a[3], _mm256_permute_ps(b01, _MM_SHUFFLE(3,3,3,3))));
+	c23 = _mm256_add_ps(c23, _mm256_mul_ps(a[3], _mm256_permute_ps(b23, _MM_SHUFFLE(3,3,3,3))));
+	c[0] = c01;
+	c[1] = c23;
+}
+
+SIMD_TARGET("avx2,fma") static void
+skin_avx2(float *out, int ostride, int format, const float *root, const float *world, int wstride, const float *invbind, int bstride, int n) {
+	int i, j;
+	__m256 rm[4];
+	if (root) {
+		for (j=0;j<4;j++)
+			rm[j] = broadcast4_avx2(root + j * 4);
+	}
+	for (i=0;i<n;i++) {
+		const float *w = MAT_AT(world, wstride, i);
+		const float *b = MAT_AT(invbind, bstride, i);
+		__m256 wm[4], c[2];
+		for (j=0;j<4;j++)
+			wm[j] = broadcast4_avx2(w + j * 4);
+		mat_mul_avx2(c, wm, _mm256_loadu_ps(b), _mm256_loadu_ps(b + 8));
+		if (root)
+			mat_mul_avx2(c, rm, c[0], c[1]);
+		float *o = (float *)MAT_AT(out, ostride, i);
+		if (format == MATH3D_PALETTE_3X4) {
+			// (c0x c2x c0y c2y | c1x c3x c1y c3y), (c0z c2z c0w c2w | c1z c3z c1w c3w)
+			__m256 xy = _mm256_unpacklo_ps(c[0], c[1]);
+			__m256 zw = _mm256_unpackhi_ps(c[0], c[1]);
+			__m128 xy0 = _mm256_castps256_ps128(xy), xy1 = _mm256_extractf128_ps(xy, 1);
+			__m128 zw0 = _mm256_castps256_ps128(zw), zw1 = _mm256_extractf128_ps(zw, 1);
+			_mm_storeu_ps(o, _mm_unpacklo_ps(xy0, xy1));
+			_mm_storeu_ps(o + 4, _mm_unpackhi_ps(xy0, xy1));
+			_mm_storeu_ps(o + 8, _mm_unpacklo_ps(zw0, zw1));
+		} else {
+			_mm256_storeu_ps(o, c[0]);
+			_mm256_storeu_ps(o + 8, c[1]);
+		}
+	}
+}
+
+// no F16C before avx2, the half floats are converted by export_scalar
+SIMD_TARGET("sse4.1") static void
+export_sse41(void *out, int format, const float *v, int stride, int n) {
+	if (format & MATH3D_EXPORT_HALF) {
+		export_scalar(out, format, v, stride, n);
+		return;
+	}
+	float *o = (float *)out;
+	int i, j;
+	switch (format) {
+	case MATH3D_EXPORT_3X4:
+		for (i=0;i<n;i++) {
+			const float *p = MAT_AT(v, stride, i);
+			__m128 c0 = _mm_loadu_ps(p);
+			__m128 c1 = _mm_loadu_ps(p + 4);
+			__m128 c2 = _mm_loadu_ps(p + 8);
+			__m128 c3 = _mm_loadu_ps(p + 12);
+			_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+			_mm_storeu_ps(o, c0);
+			_mm_storeu_ps(o + 4, c1);
+			_mm_storeu_ps(o + 8, c2);
+			o += 12;
+		}
+		break;
+	case MATH3D_EXPORT_VEC4:
+		for (i=0;i<n;i++) {
+			_mm_storeu_ps(o, _mm_loadu_ps(MAT_AT(v, stride, i)));
+			o += 4;
+		}
+		break;
+	default:
+		for (i=0;i<n;i++) {
+			const float *p = MAT_AT(v, stride, i);
+			for (j=0;j<4;j++)
+				_mm_storeu_ps(o + j * 4, _mm_loadu_ps(p + j * 4));
+			o += 16;
+		}
+		break;
+	}
+}
+
+SIMD_TARGET("avx2,fma,f16c") static inline void
+export_store256(char *o, int half, __m256 v) {
+	if (half)
+		_mm_storeu_si128((__m128i *)o, _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+	else
+		_mm256_storeu_ps((float *)o, v);
+}
+
+SIMD_TARGET("avx2,fma,f16c") static inline void
+export_store128(char *o, int half, __m128 v) {
+	if (half)
+		_mm_storel_epi64((__m128i *)o, _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+	else
+		_mm_storeu_ps((float *)o, v);
+}
+
+SIMD_TARGET("avx2,fma,f16c") static inline __m256
+pair_avx2(__m128 lo, __m128 hi) {
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+SIMD_TARGET("avx2,fma,f16c") static void
+export_avx2(void *out, int format, const float *v, int stride, int n) {
+	int half = format & MATH3D_EXPORT_HALF;
+	int esize = half ? sizeof(uint16_t) : sizeof(float);
+	char *o = (char *)out;
+	int i;
+	switch (format & ~MATH3D_EXPORT_HALF) {
+	case MATH3D_EXPORT_3X4:
+		for (i=0;i<n;i++) {
+			const float *p = MAT_AT(v, stride, i);
+			// the same transpose as skin_avx2
+			__m256 c01 = _mm256_loadu_ps(p);
+			__m256 c23 = _mm256_loadu_ps(p + 8);
+			__m256 xy = _mm256_unpacklo_ps(c01, c23);
+			__m256 zw = _mm256_unpackhi_ps(c01, c23);
+			__m128 xy0 = _mm256_castps256_ps128(xy), xy1 = _mm256_extractf128_ps(xy, 1);
+			__m128 zw0 = _mm256_castps256_ps128(zw), zw1 = _mm256_extractf128_ps(zw, 1);
+			export_store256(o, half, pair_avx2(_mm_unpacklo_ps(xy0, xy1), _mm_unpackhi_ps(xy0, xy1)));
+			export_store128(o + 8 * esize, half, _mm_unpacklo_ps(zw0, zw1));
+			o += 12 * esize;
+		}
+		break;
+	case MATH3D_EXPORT_VEC4:
+		for (i=0;i+1<n;i+=2) {
+			export_store256(o, half, pair_avx2(_mm_loadu_ps(MAT_AT(v, stride, i)), _mm_loadu_ps(MAT_AT(v, stride, i+1))));
+			o += 8 * esize;
+		}
+		if (i < n)
+			export_store128(o, half, _mm_loadu_ps(MAT_AT(v, stride, i)));
+		break;
+	default:
+		for (i=0;i<n;i++) {
+			const float *p = MAT_AT(v, stride, i);
+			export_store256(o, half, _mm256_loadu_ps(p));
+			export_store256(o + 8 * esize, half, _mm256_loadu_ps(p + 8));
+			o += 16 * esize;
+		}
+		break;
+	}
+}
+
+static void
+cpuid(int leaf, int sub, unsigned r[4]) {
+#if defined(_MSC_VER)
+	__cpuidex((int *)r, leaf, sub);
+#else
+	__cpuid_count(leaf, sub, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+static unsigned long long
+xgetbv0() {
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned lo, hi;
+	__asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+static int
+cpu_level() {
+	unsigned r[4];
+	cpuid(0, 0, r);
+	int maxleaf = (int)r[0];
+	if (maxleaf < 1)
+		return MATH3D_SIMD_NONE;
+	cpuid(1, 0, r);
+	if (!(r[2] & (1u << 19)))	// sse4.1
+		return MATH3D_SIMD_NONE;
+	int fma = (r[2] >> 12) & 1;
+	int f16c = (r[2] >> 29) & 1;
+	// avx needs the os saving the ymm (and zmm) states
+	if (!(r[2] & (1u << 27)) || !(r[2] & (1u << 28)) || maxleaf < 7)
+		return MATH3D_SIMD_SSE41;
+	unsigned long long xcr0 = xgetbv0();
+	if ((xcr0 & 6) != 6)
+		return MATH3D_SIMD_SSE41;
+	cpuid(7, 0, r);
+	if (!(r[1] & (1u << 5)) || !fma || !f16c)	// avx2 (and f16c for half float export)
+		return MATH3D_SIMD_SSE41;
+	if ((r[1] & (1u << 16)) && (xcr0 & 0xe6) == 0xe6)	// avx512f
+		return MATH3D_SIMD_AVX512;
+	return MATH3D_SIMD_AVX2;
+}
+
+#else
+
+static int
+cpu_level() {
+	return MATH3D_SIMD_NONE;
+}
+
+#endif
+
+typedef void (*mul_array_func)(float *out, int ostride, const float *m1, int stride1, const float *m2, int stride2, int n);
+
+static mul_array_func
+mul_array_kernel(int level) {
+	switch (level) {
+#ifdef SIMD_X86
+	case MATH3D_SIMD_AVX512:
+		return mul_array_avx512;
+	case MATH3D_SIMD_AVX2:
+		return mul_array_avx2;
+	case MATH3D_SIMD_SSE41:
+		return mul_array_sse41;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+typedef void (*cull_func)(const struct cull_planes *cp, const float *aabb, int stride, int n, unsigned char *visible);
+
+static cull_func
+cull_kernel(int level) {
+	switch (level) {
+#ifdef SIMD_X86
+	case MATH3D_SIMD_AVX512:
+	case MATH3D_SIMD_AVX2:
+		return cull_avx2;
+	case MATH3D_SIMD_SSE41:
+		return cull_sse41;
+#endif
+	default:
+		return cull_scalar;
+	}
+}
+
+typedef void (*srt_func)(float *out, int ostride, const float *s, int sstride, const float *r, int rstride, const float *t, int tstride, int n);
+typedef void (*decompose_func)(const float *m, int stride, int n, float *s, float *r, float *t);
+
+// 4 matrices per step in SoA form, AVX2 and AVX-512 levels use the SSE4.1 kernels
+static srt_func
+srt_kernel(int level) {
+#ifdef SIMD_X86
+	if (level >= MATH3D_SIMD_SSE41)
+		return srt_sse41;
+#endif
+	return srt_scalar;
+}
+
+static decompose_func
+decompose_kernel(int level) {
+#ifdef SIMD_X86
+	if (level >= MATH3D_SIMD_SSE41)
+		return decompose_sse41;
+#endif
+	return decompose_scalar;
+}
+
+typedef void (*blend_func)(int mode, int quat, float *out, int ostride, const float *a, int astride, const float *b, int bstride, const float *w, int wstride, int n);
+
+static blend_func
+blend_kernel(int level) {
+#ifdef SIMD_X86
+	if (level >= MATH3D_SIMD_SSE41)
+		return blend_sse41;
+#endif
+	return blend_scalar;
+}
+
+typedef void (*skin_func)(float *out, int ostride, int format, const float *root, const float *world, int wstride, const float *invbind, int bstride, int n);
+
+static skin_func
+skin_kernel(int level) {
+#ifdef SIMD_X86
+	if (level >= MATH3D_SIMD_AVX2)
+		return skin_avx2;
+	if (level >= MATH3D_SIMD_SSE41)
+		return skin_sse41;
+#endif
+	return skin_scalar;
+}
+
+typedef void (*export_func)(void *out, int format, const float *v, int stride, int n);
+
+static export_func
+export_kernel(int level) {
+#ifdef SIMD_X86
+	if (level >= MATH3D_SIMD_AVX2)
+		return export_avx2;
+	if (level >= MATH3D_SIMD_SSE41)
+		return export_sse41;
+#endif
+	return export_scalar;
+}
+
+static const int s_cpu_level = cpu_level();
+// process wide, shared by all the contexts and threads. The kernels are selected by it at each call.
+static std::atomic<int> s_level(s_cpu_level);
+
+static inline int
+simd_level() {
+	return s_level.load(std::memory_order_relaxed);
+}
+
+int
+math3d_simd(int level) {
+	if (level >= 0) {
+		if (level > s_cpu_level)
+			level = s_cpu_level;
+		s_level.store(level, std::memory_order_relaxed);
+	}
+	return simd_level();
+}
+
+int
+math3d_simd_support() {
+	return s_cpu_level;
+}
+
+const char *
+math3d_simd_name(int level) {
+	switch (level) {
+	case MATH3D_SIMD_NONE:
+		return "none";
+	case MATH3D_SIMD_SSE41:
+		return "sse4.1";
+	case MATH3D_SIMD_AVX2:
+		return "avx2";
+	case MATH3D_SIMD_AVX512:
+		return "avx512";
+	default:
+		return NULL;
+	}
+}
+
+int
+math3d_mul_matrix_batch(float *out, int ostride, const float *m1, int stride1, const float *m2, int stride2, int n) {
+	mul_array_func f = mul_array_kernel(simd_level());
+	if (f == NULL)
+		return 0;
+	f(out, ostride, m1, stride1, m2, stride2, n);
+	return 1;
+}
+
+#define CULL_BATCH 256
+
+int
+math3d_frustum_cull_aabb(const float *planes, const float *aabb, int stride, int n, uint32_t *mask, uint32_t *index) {
+	struct cull_planes cp;
+	cull_planes_init(&cp, planes);
+	cull_func cull = cull_kernel(simd_level());
+	unsigned char visible[CULL_BATCH];
+	int count = 0;
+	int i, j;
+	if (mask) {
+		for (i=0;i<(n+31)/32;i++)
+			mask[i] = 0;
+	}
+	for (i=0;i<n;i+=CULL_BATCH) {
+		int batch = n - i < CULL_BATCH ? n - i : CULL_BATCH;
+		cull(&cp, MAT_AT(aabb, stride, i), stride, batch, visible);
+		for (j=0;j<batch;j++) {
+			if (visible[j]) {
+				int id = i + j;
+				if (mask)
+					mask[id / 32] |= 1u << (id % 32);
+				if (index)
+					index[count] = id;
+				++count;
+			}
+		}
+	}
+	return count;
+}
+
+static const float s_identity[8] = { 1, 1, 1, 0, 0, 0, 0, 1 };
+
+void
+math3d_srt_batch(float *out, int ostride, const float *s, int sstride, const float *r, int rstride, const float *t, int tstride, int n) {
+	if (s == NULL) {
+		s = s_identity;
+		sstride = 0;
+	}
+	if (t == NULL) {
+		t = s_identity + 4;
+		tstride = 0;
+	}
+	if (r == NULL) {
+		// no rotation, only the diagonal and the translation
+		int i;
+		for (i=0;i<n;i++) {
+			const float *sv = MAT_AT(s, sstride, i);
+			const float *tv = MAT_AT(t, tstride, i);
+			float *o = (float *)MAT_AT(out, ostride, i);
+			float m[16] = {
+				sv[0], 0, 0, 0,
+				0, sv[1], 0, 0,
+				0, 0, sv[2], 0,
+				tv[0], tv[1], tv[2], 1,
+			};
+			int j;
+			for (j=0;j<16;j++)
+				o[j] = m[j];
+		}
+		return;
+	}
+	srt_kernel(simd_level())(out, ostride, s, sstride, r, rstride, t, tstride, n);
+}
+
+void
+math3d_decompose_batch(const float *m, int stride, int n, float *s, float *r, float *t) {
+	decompose_kernel(simd_level())(m, stride, n, s, r, t);
+}
+
+void
+math3d_blend_batch(int mode, int quat, float *out, int ostride, const float *a, int astride, const float *b, int bstride, const float *w, int wstride, int n) {
+	blend_kernel(simd_level())(mode, quat, out, ostride, a, astride, b, bstride, w, wstride, n);
+}
+
+void
+math3d_skin_palette_batch(float *out, int ostride, int format, const float *root, const float *world, int wstride, const float *invbind, int bstride, int n) {
+	skin_kernel(simd_level())(out, ostride, format, root, world, wstride, invbind, bstride, n);
+}
+
+void
+math3d_export_batch(void *out, int format, const float *v, int stride, int n) {
+	export_kernel(simd_level())(out, format, v, stride, n);
+}
@@ -9,6 +9,31 @@
 #define PAGE_SIZE 2048
 #define UNMARK_SIZE 1024
 #define INVALID_MARK_COUNT 255
+// the mark count is saturated at MARK_COUNT_OVERFLOW, the rest is kept in struct mark_overflow
+#define MARK_COUNT_OVERFLOW (INVALID_MARK_COUNT - 1)
+#define INDEX_MAP_INIT 64
+#define PROFILE_SITE_INIT 64
+#define CONSTANT_HASH_INIT 256
+// transient pages up to the high water mark are kept for so many frames
+#define DEFAULT_TRANSIENT_RETENTION 64
+#define PAGE_ALIGN 64
+// a marked page used less than this is a candidate for compaction
+#define COMPACT_THRESHOLD (PAGE_SIZE / 2)
+// free marked blocks of 1..MARKED_SMALL_BIN vec4 have their own exact size bin,
+// larger blocks are binned by power of two : (16,32] (32,64] ... (1024,2048]
+#define MARKED_SMALL_BIN 16
+#define MARKED_BIN_N (MARKED_SMALL_BIN + 7)
+// arrays larger than a page live in their own block, the index of them is
+// [1 : large flag] [13 : slot] [14 : vec4 offset], so math_index can add the offset as usual.
+// The slot of a constant is in the constant slot table, others are in the transient/marked slot table.
+#define LARGE_OBJECT_BIT 27
+#define LARGE_OFFSET_BITS 14
+#define LARGE_SLOT_MAX (1 << (LARGE_OBJECT_BIT - LARGE_OFFSET_BITS))
+#define LARGE_INDEX(slot) ((1 << LARGE_OBJECT_BIT) | ((slot) << LARGE_OFFSET_BITS))
+#define LARGE_FREE 0
+#define LARGE_TRANSIENT 1
+#define LARGE_MARKED 2
+#define LARGE_CONSTANT 3
 
 struct page {
 	float v[PAGE_SIZE][4];
@@ -16,22 +41,54 @@ struct page {
 
 struct marked_count {
 	uint8_t count[PAGE_SIZE];
+	uint32_t freehead[PAGE_SIZE/32];	// bit set : first slot of a free block
+	uint32_t freetail[PAGE_SIZE/32];	// bit set : last slot of a free block
+	int used;	// slots used by live blocks
 #ifdef MATHIDSOURCE
 	const char * filename[PAGE_SIZE];
 	int line[PAGE_SIZE];
 #endif
 };
 
+// modification stamps of a marked page, allocated when a block in it is stamped, see math_track
+struct marked_stamp {
+	uint32_t stamp[PAGE_SIZE];	// the stamp of the last write, at the first slot of a block. 0 : not tracked
+	uint16_t shape[PAGE_SIZE];	// type and size of the block, to rebuild the id, see SHAPE
+};
+
+// header of a free block, stored in its first vec4.
+// The last vec4 of the block keeps a copy of .size, so the block can be found from its tail.
 struct marked_freelist {
-	struct marked_freelist *next;
-	int page;
+	int next;	// index of the next free block in the same bin, -1 for end
+	int prev;
 	int size;
+	int bin;
+};
+
+struct large_object {
+	float (*v)[4];
+	int size;	// vec4 number
+	int type;	// LARGE_FREE/TRANSIENT/MARKED/CONSTANT
+	int frame;	// the frame of transient object
+	int next;	// next transient object, or next free slot
+	uint8_t count;	// mark count of marked object, see struct marked_count
+	uint16_t shape;
+	uint32_t stamp;
+#ifdef MATHIDSOURCE
+	const char * filename;
+	int line;
+#endif
 };
 
+#define REF_STRIDE_BITS 24
+
+// fits in one vec4 slot
 struct math_ref {
 	const float * ptr;
 	int size;
-	int type;
+	unsigned stride : REF_STRIDE_BITS;	// in bytes
+	unsigned type : 4;
+	unsigned flags : 4;
 };
 
 struct math_unmarked {
@@ -41,17 +98,87 @@ struct math_unmarked {
 	int64_t tmp[UNMARK_SIZE];
 };
 
+struct constant_key {
+	uint32_t hash;
+	int size;	// 0 : empty slot
+	int index;
+};
+
+struct constant_hash {
+	int cap;
+	int n;
+	int hit;
+	int miss;
+	struct constant_key *slot;
+};
+
+struct index_map_slot {
+	int index;	// the index of marked id, -1 : empty
+	int value;
+};
+
+// index of marked id -> value
+struct index_map {
+	int cap;
+	int n;
+	struct index_map_slot *slot;
+};
+
+struct profile_site {
+	const char *filename;
+	int line;
+	int live;
+};
+
+// sampling profiler of marked values
+struct math_profile {
+	int sample;	// record 1 of sample marks, 0 : off
+	int tick;
+	int site_n;
+	int site_cap;
+	struct profile_site *site;
+	int *site_hash;	// (filename, line) -> site, size of site_cap * 2
+	struct index_map record;	// index -> site
+};
+
 struct pages {
 	struct page * constant;
 	struct page * transient;
 	struct page * marked;
 	struct marked_count *count;
+	struct marked_stamp *stamp;	// NULL : no block in the page is tracked
+	int *forward;	// offset -> current index of the blocks moved out by compaction, -1 : not moved
+	int *origin;	// offset -> original index of the blocks moved in, -1 : native
+	int forward_live;	// alive blocks in forward
 };
 
 struct math_context {
+	struct math_allocator alloc;
+	struct math_context *shared;	// read only constant pool, NULL : use its own
+	int published;	// constants (include the large ones) are read only, it can be shared
 	struct pages *p;
 	struct math_unmarked unmarked;
-	struct marked_freelist *freelist;
+	struct constant_hash chash;
+	struct index_map overflow;	// mark count over MARK_COUNT_OVERFLOW
+	struct math_profile profile;
+	int freelist[MARKED_BIN_N];
+	struct large_object *large;	// transient and marked large objects
+	struct large_object *large_constant;	// constant large objects, frozen by math_publish
+	int large_n;
+	int large_cap;
+	int large_constant_n;
+	int large_constant_cap;
+	int large_live;
+	int large_freeslot;
+	int large_transient;	// list of transient large objects
+	int transient_retention;	// frames to hold the high water mark, 0 : free unused pages at once
+	int transient_peak;	// the peak of transient vectors used in this frame
+	int transient_hwm;	// high water mark of transient pages per frame
+	int transient_hwm_age;
+	int transient_pages;	// transient pages allocated, include the spare pages
+	struct page *transient_spare;	// retained pages, linked by the first pointer in the page
+	int transient_alloc;	// page churn counters
+	int transient_free;
 	int maxpage;
 	int frame;
 	int last_frame;
@@ -60,9 +187,17 @@ struct math_context {
 	int top;
 	int marked_page;
 	int marked_n;
+	int compact_budget;	// slots moved per frame, 0 : no compaction
+	int compact_page;	// the page in evacuation, -1 : none
+	int compact_aborted;	// the page aborted last time, skip it until it's used less
+	int compact_aborted_used;
+	int compact_offset;
+	int compact_moved;
 	int marked_slot;
 	int constant_n;
 	int ref_n;
+	uint32_t stamp;	// increases every frame, see math_stamp
+	int track;	// stamp the marked values, see math_track
 	uint32_t flags;
 };
 
@@ -85,11 +220,34 @@ math_info(struct math_context *M, int what) {
 		case MATH_INFO_MARKED:
 			return M->marked_n;
 		case MATH_INFO_CONSTANT:
-			return M->constant_n;
+			return M->shared ? M->shared->constant_n : M->constant_n;
 		case MATH_INFO_REF:
 			return M->ref_n;
 		case MATH_INFO_SLOT:
 			return M->marked_slot;
+		case MATH_INFO_CONSTANT_HIT:
+			return M->chash.hit;
+		case MATH_INFO_CONSTANT_MISS:
+			return M->chash.miss;
+		case MATH_INFO_LARGE:
+			return M->large_live;
+		case MATH_INFO_TRANSIENT_ALLOC:
+			return M->transient_alloc;
+		case MATH_INFO_TRANSIENT_FREE:
+			return M->transient_free;
+		case MATH_INFO_TRANSIENT_RETAIN:
+			return M->transient_hwm;
+		case MATH_INFO_MARKED_PAGE: {
+			int i;
+			int n = 0;
+			for (i=0;i<M->marked_page;i++) {
+				if (M->p[i].marked)
+					++n;
+			}
+			return n;
+		}
+		case MATH_INFO_COMPACT_MOVED:
+			return M->compact_moved;
 		default:
 			return -1;
 	}
@@ -129,30 +287,118 @@ math_unmarked_size(struct math_unmarked *u) {
 	return 0;
 }
 
+// default allocator, over-allocate and keep the original pointer before the aligned block
+static void *
+default_alloc(void *ud, size_t size, size_t align) {
+	char * ptr = (char *)malloc(size + align + sizeof(void *));
+	if (ptr == NULL)
+		return NULL;
+	uintptr_t addr = (uintptr_t)(ptr + sizeof(void *) + align - 1) & ~(uintptr_t)(align - 1);
+	((void **)addr)[-1] = ptr;
+	return (void *)addr;
+}
+
+static void
+default_free(void *ud, void *ptr, size_t size) {
+	free(((void **)ptr)[-1]);
+}
+
+static inline void *
+page_alloc(struct math_context *M, size_t size) {
+	void * ptr = M->alloc.alloc(M->alloc.ud, size, PAGE_ALIGN);
+	assert(ptr != NULL && ((uintptr_t)ptr & (PAGE_ALIGN - 1)) == 0);
+	return ptr;
+}
+
+static inline void
+page_free(struct math_context *M, void *ptr, size_t size) {
+	M->alloc.free(M->alloc.ud, ptr, size);
+}
+
 struct math_context *
 math_new(int maxpage) {
+	return math_new_ex(maxpage, NULL);
+}
+
+struct math_context *
+math_new_ex(int maxpage, const struct math_allocator *alloc) {
 	struct math_context * m = (struct math_context *)malloc(sizeof(*m));
+	int i;
+	m->shared = NULL;
+	m->published = 0;
+	if (alloc) {
+		m->alloc = *alloc;
+	} else {
+		m->alloc.alloc = default_alloc;
+		m->alloc.free = default_free;
+		m->alloc.ud = NULL;
+	}
 	if (maxpage <= 0)
 		maxpage = DEFAULT_MAX_PAGE;
+	assert((int64_t)maxpage * PAGE_SIZE < (1 << LARGE_OBJECT_BIT));
 	m->maxpage = maxpage;
 	m->frame = 0;
 	m->last_frame = 0;
 	m->n = 0;
 	m->marked_page = 0;
-	m->freelist = NULL;
+	m->compact_budget = 0;
+	m->compact_page = -1;
+	m->compact_aborted = -1;
+	m->compact_aborted_used = 0;
+	m->compact_offset = 0;
+	m->compact_moved = 0;
+	for (i=0;i<MARKED_BIN_N;i++) {
+		m->freelist[i] = -1;
+	}
 	m->p = (struct pages *)malloc(sizeof(struct pages) * maxpage);
 	memset(m->p, 0, sizeof(struct pages) * maxpage);
 	m->marked_n = 0;
 	m->marked_slot = 0;
 	m->constant_n = 0;
 	m->ref_n = 0;
+	m->stamp = 1;
+	m->track = 0;
 	m->flags = 0;
 	m->base = 0;
 	m->top = 0;
 	math_unmarked_init(&m->unmarked);
+	memset(&m->chash, 0, sizeof(m->chash));
+	memset(&m->overflow, 0, sizeof(m->overflow));
+	memset(&m->profile, 0, sizeof(m->profile));
+	m->large = NULL;
+	m->large_constant = NULL;
+	m->large_n = 0;
+	m->large_cap = 0;
+	m->large_constant_n = 0;
+	m->large_constant_cap = 0;
+	m->large_live = 0;
+	m->large_freeslot = -1;
+	m->large_transient = -1;
+	m->transient_retention = DEFAULT_TRANSIENT_RETENTION;
+	m->transient_peak = 0;
+	m->transient_hwm = 0;
+	m->transient_hwm_age = 0;
+	m->transient_pages = 0;
+	m->transient_spare = NULL;
+	m->transient_alloc = 0;
+	m->transient_free = 0;
 	return m;
 }
 
+void
+math_publish(struct math_context *M) {
+	assert(M->shared == NULL);
+	M->published = 1;
+}
+
+struct math_context *
+math_new_shared(struct math_context *pool, int maxpage) {
+	assert(pool->published);
+	struct math_context *M = math_new_ex(maxpage, &pool->alloc);
+	M->shared = pool;
+	return M;
+}
+
 void
 math_set_flag(struct math_context *M, int flag_id, int v) {
 	assert(flag_id >=0 && flag_id < 32);
@@ -163,6 +409,12 @@ math_set_flag(struct math_context *M, int flag_id, int v) {
 	}
 }
 
+void
+math_set_transient_retention(struct math_context *M, int frames) {
+	assert(frames >= 0);
+	M->transient_retention = frames;
+}
+
 int
 math_get_flag(struct math_context *M, int flag_id) {
 	uint32_t mask = 1 << flag_id;
@@ -179,24 +431,41 @@ math_delete(struct math_context *M) {
 		if (M->p[i].constant == NULL) {
 			break;
 		}
-		free(M->p[i].constant);
+		page_free(M, M->p[i].constant, sizeof(struct page));
 	}
 	for (i=0;i<maxpage;i++) {
-		free(M->p[i].transient);
+		if (M->p[i].transient)
+			page_free(M, M->p[i].transient, sizeof(struct page));
 	}
-	for (i=0;i<maxpage;i++) {
-		if (M->p[i].marked == NULL) {
-			break;
-		}
-		free(M->p[i].marked);
+	while (M->transient_spare) {
+		struct page *p = M->transient_spare;
+		M->transient_spare = *(struct page **)p;
+		page_free(M, p, sizeof(struct page));
 	}
-	for (i=0;i<maxpage;i++) {
-		if (M->p[i].count == NULL) {
-			break;
+	// compaction may leave holes in marked pages
+	for (i=0;i<M->marked_page;i++) {
+		if (M->p[i].marked) {
+			page_free(M, M->p[i].marked, sizeof(struct page));
+			page_free(M, M->p[i].count, sizeof(struct marked_count));
 		}
-		free(M->p[i].count);
+		if (M->p[i].stamp)
+			page_free(M, M->p[i].stamp, sizeof(struct marked_stamp));
+		free(M->p[i].forward);
+		free(M->p[i].origin);
 	}
+	for (i=0;i<M->large_n;i++) {
+		if (M->large[i].type != LARGE_FREE)
+			page_free(M, M->large[i].v, M->large[i].size * 4 * sizeof(float));
+	}
+	free(M->large);
+	for (i=0;i<M->large_constant_n;i++) {
+		page_free(M, M->large_constant[i].v, M->large_constant[i].size * 4 * sizeof(float));
+	}
+	free(M->large_constant);
 	math_unmarked_deinit(&M->unmarked);
+	free(M->chash.slot);
+	free(M->overflow.slot);
+	math_profile(M, 0);
 	free(M->p);
 	free(M);
 }
@@ -218,22 +487,176 @@ math_memsize(struct math_context *M) {
 			sz += sizeof(struct page);
 		}
 	}
-	for (i=0;i<maxpage;i++) {
-		if (M->p[i].marked == NULL) {
-			break;
-		}
+	struct page *spare;
+	for (spare = M->transient_spare; spare; spare = *(struct page **)spare) {
 		sz += sizeof(struct page);
 	}
-	for (i=0;i<maxpage;i++) {
-		if (M->p[i].count == NULL) {
-			break;
+	for (i=0;i<M->marked_page;i++) {
+		if (M->p[i].marked) {
+			sz += sizeof(struct page) + sizeof(struct marked_count);
+		}
+		if (M->p[i].stamp) {
+			sz += sizeof(struct marked_stamp);
+		}
+		if (M->p[i].forward) {
+			sz += PAGE_SIZE * sizeof(int);
+		}
+		if (M->p[i].origin) {
+			sz += PAGE_SIZE * sizeof(int);
 		}
-		sz += sizeof(struct marked_count);
 	}
 	sz += math_unmarked_size(&M->unmarked);
+	sz += M->chash.cap * sizeof(struct constant_key);
+	sz += M->overflow.cap * sizeof(struct index_map_slot);
+	sz += M->profile.record.cap * sizeof(struct index_map_slot);
+	sz += M->profile.site_cap * (sizeof(struct profile_site) + 2 * sizeof(int));
+	sz += M->large_cap * sizeof(struct large_object);
+	for (i=0;i<M->large_n;i++) {
+		if (M->large[i].type != LARGE_FREE) {
+			sz += M->large[i].size * 4 * sizeof(float);
+		}
+	}
+	sz += M->large_constant_cap * sizeof(struct large_object);
+	for (i=0;i<M->large_constant_n;i++) {
+		sz += M->large_constant[i].size * 4 * sizeof(float);
+	}
 	return sz;
 }
 
+static int inline
+frame_alive(struct math_context *M, int f) {
+	return (M->frame == f) || (M->last_frame == f);
+}
+
+static inline int
+is_large(int index) {
+	return (index >> LARGE_OBJECT_BIT) & 1;
+}
+
+static inline int
+large_slot(int index) {
+	return (index >> LARGE_OFFSET_BITS) & (LARGE_SLOT_MAX - 1);
+}
+
+// the current index of a marked block, it may be moved by compaction
+static inline int
+marked_resolve(struct math_context *M, int index) {
+	if (!is_large(index)) {
+		const int *forward = M->p[index / PAGE_SIZE].forward;
+		if (forward && forward[index % PAGE_SIZE] >= 0)
+			return forward[index % PAGE_SIZE];
+	}
+	return index;
+}
+
+static inline struct large_object *
+get_large(struct math_context *M, int index) {
+	int slot = large_slot(index);
+	assert(slot < M->large_n);
+	return &M->large[slot];
+}
+
+static inline struct large_object *
+get_large_constant(struct math_context *M, int index) {
+	int slot = large_slot(index);
+	assert(slot < M->large_constant_n);
+	return &M->large_constant[slot];
+}
+
+static inline float *
+large_offset(struct large_object *obj, int index) {
+	int offset = index & ((1 << LARGE_OFFSET_BITS) - 1);
+	assert(obj->type != LARGE_FREE && offset < obj->size);
+	return obj->v[offset];
+}
+
+static inline float *
+large_value(struct math_context *M, int index) {
+	return large_offset(get_large(M, index), index);
+}
+
+static void
+init_large(struct math_context *M, struct large_object *obj, int size, int type) {
+	assert(size <= (1 << LARGE_OFFSET_BITS));
+	obj->v = (float (*)[4])page_alloc(M, size * 4 * sizeof(float));
+	obj->size = size;
+	obj->type = type;
+	obj->frame = M->frame;
+	obj->next = -1;
+	obj->count = INVALID_MARK_COUNT;
+	++M->large_live;
+}
+
+// Constants are never freed, and the table doesn't change after math_publish,
+// so the shared contexts in other threads can read it without locks.
+static int
+alloc_large_constant(struct math_context *M, int size) {
+	assert(!M->published);
+	if (M->large_constant_n >= M->large_constant_cap) {
+		int newcap = M->large_constant_cap ? M->large_constant_cap * 2 : 16;
+		assert(newcap <= LARGE_SLOT_MAX);
+		M->large_constant = (struct large_object *)realloc(M->large_constant, newcap * sizeof(struct large_object));
+		M->large_constant_cap = newcap;
+	}
+	int slot = M->large_constant_n++;
+	init_large(M, &M->large_constant[slot], size, LARGE_CONSTANT);
+	return LARGE_INDEX(slot);
+}
+
+// transient or marked large object, only the owner of the context reads them
+static int
+alloc_large(struct math_context *M, int size, int type) {
+	assert(type == LARGE_TRANSIENT || type == LARGE_MARKED);
+	int slot = M->large_freeslot;
+	if (slot >= 0) {
+		M->large_freeslot = M->large[slot].next;
+	} else {
+		if (M->large_n >= M->large_cap) {
+			int newcap = M->large_cap ? M->large_cap * 2 : 16;
+			assert(newcap <= LARGE_SLOT_MAX);
+			M->large = (struct large_object *)realloc(M->large, newcap * sizeof(struct large_object));
+			M->large_cap = newcap;
+		}
+		slot = M->large_n++;
+	}
+	struct large_object *obj = &M->large[slot];
+	init_large(M, obj, size, type);
+	if (type == LARGE_TRANSIENT) {
+		obj->next = M->large_transient;
+		M->large_transient = slot;
+	}
+	return LARGE_INDEX(slot);
+}
+
+static void
+free_large(struct math_context *M, int slot) {
+	struct large_object *obj = &M->large[slot];
+	assert(obj->type != LARGE_FREE);
+	page_free(M, obj->v, obj->size * 4 * sizeof(float));
+	obj->v = NULL;
+	obj->type = LARGE_FREE;
+	obj->count = INVALID_MARK_COUNT;
+	obj->next = M->large_freeslot;
+	M->large_freeslot = slot;
+	--M->large_live;
+}
+
+// transient large objects live as long as the transient pages : this frame and the last frame
+static void
+free_transient_large(struct math_context *M) {
+	int *prev = &M->large_transient;
+	int slot;
+	while ((slot = *prev) >= 0) {
+		struct large_object *obj = &M->large[slot];
+		if (frame_alive(M, obj->frame)) {
+			prev = &obj->next;
+		} else {
+			*prev = obj->next;
+			free_large(M, slot);
+		}
+	}
+}
+
 static void
 alloc_transient_page(struct math_context *M, int page_id) {
 	int top_page = M->top / PAGE_SIZE;
@@ -250,7 +673,15 @@ alloc_transient_page(struct math_context *M, int page_id) {
 			return;
 		}
 	}
-	M->p[page_id].transient = (struct page *)malloc(sizeof(struct page));
+	if (M->transient_spare) {
+		struct page *p = M->transient_spare;
+		M->transient_spare = *(struct page **)p;
+		M->p[page_id].transient = p;
+		return;
+	}
+	M->p[page_id].transient = (struct page *)page_alloc(M, sizeof(struct page));
+	++M->transient_alloc;
+	++M->transient_pages;
 }
 
 static void *
@@ -275,6 +706,9 @@ allocvec(struct math_context *M, int size, int *index) {
 	}
 	*index = n;
 	M->n = n + size;
+	int used = transient_used(M, M->n);
+	if (used > M->transient_peak)
+		M->transient_peak = used;
 	if (rewind) {
 		// transient pages overflow, too mant trabsient vectors
 		assert(M->n < M->top);
@@ -285,7 +719,13 @@ allocvec(struct math_context *M, int size, int *index) {
 static inline int
 import(struct math_context *M, const float *v, int size) {
 	int index;
-	void * ptr = allocvec(M, size, &index);
+	void * ptr;
+	if (size > PAGE_SIZE) {
+		index = alloc_large(M, size, LARGE_TRANSIENT);
+		ptr = large_value(M, index);
+	} else {
+		ptr = allocvec(M, size, &index);
+	}
 	if (v) {
 		memcpy(ptr, v, size * 4 * sizeof(float));
 	}
@@ -320,19 +760,33 @@ math_import(struct math_context *M, const float *v, int type, int size) {
 	return u.id;
 }
 
+static inline int
+ref_stride(int type, int flags) {
+	if (type == MATH_TYPE_MAT)
+		return 16 * sizeof(float);
+	if (flags & MATH_REF_VEC3)
+		return 3 * sizeof(float);
+	return 4 * sizeof(float);
+}
+
 math_t
-math_ref(struct math_context *M, const float *v, int type, int size) {
+math_ref_stride(struct math_context *M, const void *v, int type, int size, int stride, int flags) {
 	union {
 		math_t id;
 		struct math_id s;
 	} u;
-	assert(check_size(size));
+	assert(size > 0);
 	int index;
+	assert(stride >= 0 && stride < (1 << REF_STRIDE_BITS));
 	struct math_ref * r = (struct math_ref *)allocvec(M, 1, &index);
-	r->ptr = v;
+	r->ptr = (const float *)v;
 	r->size = size;
 	assert(type == MATH_TYPE_MAT || type == MATH_TYPE_VEC4 || type == MATH_TYPE_QUAT);
+	assert(!(flags & MATH_REF_VEC3) || type == MATH_TYPE_VEC4);
 	r->type = type;
+	r->flags = flags;
+	r->stride = stride ? stride : ref_stride(type, flags);
+	assert((int)r->stride >= ref_stride(type, flags));
 
 	u.s.index = index;
 	u.s.frame = M->frame;
@@ -342,21 +796,90 @@ math_ref(struct math_context *M, const float *v, int type, int size) {
 	return u.id;
 }
 
+math_t
+math_ref(struct math_context *M, const float *v, int type, int size) {
+	assert(check_size(size));
+	return math_ref_stride(M, v, type, size, 0, 0);
+}
+
 float *
 get_transient(struct math_context *M, int index) {
+	if (is_large(index))
+		return large_value(M, index);
 	int page_id = index / PAGE_SIZE;
 	return M->p[page_id].transient->v[index % PAGE_SIZE];
 }
 
+static inline int
+ref_packed(struct math_ref *r) {
+	return !(r->flags & MATH_REF_VEC3) && r->stride == ref_stride(r->type, 0);
+}
+
+static inline void
+ref_load(struct math_ref *r, int offset, float *v) {
+	const float * p = (const float *)((const char *)r->ptr + (size_t)r->stride * offset);
+	if (r->flags & MATH_REF_VEC3) {
+		v[0] = p[0];
+		v[1] = p[1];
+		v[2] = p[2];
+		v[3] = 1.0f;
+	} else {
+		memcpy(v, p, (r->type == MATH_TYPE_MAT ? 16 : 4) * sizeof(float));
+	}
+}
+
 float *
 get_reference(struct math_context *M, int index, int offset) {
 	struct math_ref * r = (struct math_ref *)get_transient(M, index);
 	assert(offset >= 0 && offset < r->size);
-	float * base = (float *)r->ptr;
-	if (r->type == MATH_TYPE_MAT) {
-		return base + 16 * offset;
+	if (r->flags & MATH_REF_VEC3) {
+		int tmp;
+		float * v = allocvec(M, 1, &tmp);
+		ref_load(r, offset, v);
+		return v;
+	}
+	return (float *)((const char *)r->ptr + (size_t)r->stride * offset);
+}
+
+// The whole array of a ref : the external buffer itself if it's packed, or gather it into a transient array.
+static const float *
+get_reference_array(struct math_context *M, int index) {
+	struct math_ref * r = (struct math_ref *)get_transient(M, index);
+	if (r->size == 1 || ref_packed(r))
+		return get_reference(M, index, 0);
+	int n = r->type == MATH_TYPE_MAT ? 4 : 1;
+	float * v = get_transient(M, import(M, NULL, n * r->size));
+	int i;
+	for (i=0;i<r->size;i++) {
+		ref_load(r, i, v + i * n * 4);
+	}
+	return v;
+}
+
+void
+math_view(struct math_context *M, math_t id, struct math_view *view) {
+	union {
+		math_t id;
+		struct math_id s;
+	} u;
+	u.id = id;
+	if (u.s.type == MATH_TYPE_REF) {
+		assert(frame_alive(M, u.s.frame));
+		struct math_ref * r = (struct math_ref *)get_transient(M, u.s.index);
+		view->stride = r->stride;
+		view->vec3 = (r->flags & MATH_REF_VEC3) ? 1 : 0;
+		if (u.s.size == 0) {
+			view->ptr = r->ptr;
+			view->size = r->size;
+		} else {
+			view->ptr = (const float *)((const char *)r->ptr + (size_t)r->stride * (u.s.size - 1));
+			view->size = 1;
+		}
 	} else {
-		return base + 4 * offset;
+		view->ptr = math_value(M, id);
+		view->size = u.s.size + 1;
+		view->stride = ref_stride(u.s.type, 0);
+		view->vec3 = 0;
 	}
 }
 
@@ -374,11 +897,6 @@ math_ref_type_(struct math_context *M, struct math_id id) {
 	return r->type;
 }
 
-static int inline
-frame_alive(struct math_context *M, int f) {
-	return (M->frame == f) || (M->last_frame == f);
-}
-
 int
 math_valid(struct math_context *M, math_t id) {
 	union {
@@ -389,6 +907,14 @@ math_valid(struct math_context *M, math_t id) {
 	if (u.s.transient) {
 		return frame_alive(M, u.s.frame);
 	} else {
+		if (u.s.frame == 0 && M->shared)
+			return math_valid(M->shared, id);
+		if (is_large(u.s.index)) {
+			int slot = large_slot(u.s.index);
+			if (u.s.frame == 0)
+				return slot < M->large_constant_n;
+			return slot < M->large_n && M->large[slot].type == LARGE_MARKED;
+		}
 		if (u.s.frame == 0) {
 			// constant
 			return u.s.index <= M->constant_n;
@@ -411,10 +937,18 @@ math_marked(struct math_context *M, math_t id) {
 		return 0;
 	}
 	int index = u.s.index;
+	if (is_large(index)) {
+		int slot = large_slot(index);
+		return slot < M->large_n && M->large[slot].count != INVALID_MARK_COUNT && M->large[slot].count > 0;
+	}
 	int page_id = index / PAGE_SIZE;
-	index %= PAGE_SIZE;
 	if (page_id >= M->marked_page)
 		return 0;
+	index = marked_resolve(M, index);
+	page_id = index / PAGE_SIZE;
+	index %= PAGE_SIZE;
+	if (M->p[page_id].count == NULL)
+		return 0;
 	return M->p[page_id].count->count[index] > 0;
 }
 
@@ -425,8 +959,26 @@ math_marked_next(struct math_context *M, struct math_marked_iter *iter) {
 	int index = iter->iter;
 	for (;;) {
 		int page_id = index / PAGE_SIZE;
-		if (page_id >= M->marked_page)
+		if (page_id >= M->marked_page) {
+			// then the large objects
+			int slot = index - M->marked_page * PAGE_SIZE;
+			for (;slot < M->large_n; slot++) {
+				struct large_object *obj = &M->large[slot];
+				if (obj->type == LARGE_MARKED && obj->count != INVALID_MARK_COUNT) {
+					iter->iter = M->marked_page * PAGE_SIZE + slot + 1;
+					iter->count = obj->count;
+					iter->filename = obj->filename;
+					iter->line = obj->line;
+					return 1;
+				}
+			}
 			return 0;
+		}
+		if (M->p[page_id].count == NULL) {
+			// released by compaction
+			index = (page_id + 1) * PAGE_SIZE;
+			continue;
+		}
 		int page_index = index % PAGE_SIZE;
 		int count = M->p[page_id].count->count[page_index];
 		if (count != INVALID_MARK_COUNT) {
@@ -452,6 +1004,8 @@ math_marked_next(struct math_context *M, struct math_marked_iter *iter) {
 
 static float *
 get_marked(struct math_context *M, int index) {
+	if (is_large(index))
+		return large_value(M, index);
 	int page_id = index / PAGE_SIZE;
 	index %= PAGE_SIZE;
 	assert (page_id < M->marked_page);
@@ -460,12 +1014,165 @@ get_marked(struct math_context *M, int index) {
 
 static inline const float *
 get_constant(struct math_context *M, int index) {
+	if (M->shared)
+		M = M->shared;
+	if (is_large(index))
+		return large_offset(get_large_constant(M, index), index);
 	assert(index < M->constant_n);
 	int page_id = index / PAGE_SIZE;
 	index %= PAGE_SIZE;
 	return M->p[page_id].constant->v[index];
 }
 
+static inline uint8_t *
+get_mark_count(struct math_context *M, int index) {
+	if (is_large(index))
+		return &get_large(M, index)->count;
+	int page_id = index / PAGE_SIZE;
+	assert (page_id < M->marked_page);
+	return &M->p[page_id].count->count[index % PAGE_SIZE];
+}
+
+// the size of marked block is no more than 4096 (see check_size), keep size - 1 in 12 bits
+#define SHAPE(type, size) ((uint16_t)(((type) << 12) | ((size) - 1)))
+#define SHAPE_TYPE(shape) ((shape) >> 12)
+#define SHAPE_SIZE(shape) (((shape) & 0xfff) + 1)
+
+// stamp the block at index (the first slot), if the tracking is on
+static void
+stamp_block(struct math_context *M, int index, uint16_t shape) {
+	if (!M->track)
+		return;
+	if (is_large(index)) {
+		struct large_object *obj = get_large(M, index);
+		obj->stamp = M->stamp;
+		obj->shape = shape;
+		return;
+	}
+	struct pages *p = &M->p[index / PAGE_SIZE];
+	if (p->stamp == NULL) {
+		p->stamp = (struct marked_stamp *)page_alloc(M, sizeof(struct marked_stamp));
+		memset(p->stamp->stamp, 0, sizeof(p->stamp->stamp));
+	}
+	p->stamp->stamp[index % PAGE_SIZE] = M->stamp;
+	p->stamp->shape[index % PAGE_SIZE] = shape;
+}
+
+static uint32_t
+get_stamp(struct math_context *M, int index) {
+	if (is_large(index))
+		return get_large(M, index)->stamp;
+	struct marked_stamp *s = M->p[index / PAGE_SIZE].stamp;
+	return s ? s->stamp[index % PAGE_SIZE] : 0;
+}
+
+uint32_t
+math_stamp(struct math_context *M) {
+	return M->stamp;
+}
+
+void
+math_track(struct math_context *M, int enable) {
+	if (enable) {
+		M->track = 1;
+		return;
+	}
+	M->track = 0;
+	int i;
+	for (i=0;i<M->marked_page;i++) {
+		if (M->p[i].stamp) {
+			page_free(M, M->p[i].stamp, sizeof(struct marked_stamp));
+			M->p[i].stamp = NULL;
+		}
+	}
+	for (i=0;i<M->large_n;i++) {
+		M->large[i].stamp = 0;
+	}
+}
+
+uint32_t
+math_modified(struct math_context *M, math_t id) {
+	union {
+		math_t id;
+		struct math_id s;
+	} u;
+	u.id = id;
+	if (u.s.transient)
+		return M->stamp;
+	if (u.s.frame == 0 || !M->track)
+		return 0;	// constant, or not tracked
+	return get_stamp(M, marked_resolve(M, u.s.index));
+}
+
+static inline int
+stamp_since(uint32_t stamp, uint32_t since) {
+	return (int32_t)(stamp - since) >= 0;
+}
+
+static inline math_t
+changed_id(int index, uint16_t shape) {
+	union {
+		math_t id;
+		struct math_id s;
+	} u;
+	u.s.index = index;
+	u.s.size = SHAPE_SIZE(shape) - 1;
+	u.s.frame = 1;
+	u.s.type = SHAPE_TYPE(shape);
+	u.s.transient = 0;
+	return u.id;
+}
+
+int
+math_changed_next(struct math_context *M, uint32_t since, int *iter, math_t *id) {
+	if (!M->track)
+		return 0;
+	int index = *iter;
+	for (;;) {
+		int page_id = index / PAGE_SIZE;
+		if (page_id >= M->marked_page) {
+			// then the large objects
+			int slot = index - M->marked_page * PAGE_SIZE;
+			for (;slot < M->large_n; slot++) {
+				struct large_object *obj = &M->large[slot];
+				if (obj->type == LARGE_MARKED && obj->count != INVALID_MARK_COUNT && obj->count > 0
+					&& obj->stamp != 0 && stamp_since(obj->stamp, since)) {
+					*iter = M->marked_page * PAGE_SIZE + slot + 1;
+					*id = changed_id(LARGE_INDEX(slot), obj->shape);
+					return 1;
+				}
+			}
+			*iter = M->marked_page * PAGE_SIZE + M->large_n;
+			return 0;
+		}
+		struct pages *p = &M->p[page_id];
+		if (p->count == NULL || p->stamp == NULL) {
+			// released by compaction, or no block is tracked
+			index = (page_id + 1) * PAGE_SIZE;
+			continue;
+		}
+		int offset = index % PAGE_SIZE;
+		int count = p->count->count[offset];
+		if (count == INVALID_MARK_COUNT || count == 0 || p->stamp->stamp[offset] == 0) {
+			// free slot, unmarked in this frame, or not tracked. The other slots of a block are free-like
+			++index;
+			continue;
+		}
+		uint16_t shape = p->stamp->shape[offset];
+		int vecsize = SHAPE_SIZE(shape);
+		if (SHAPE_TYPE(shape) == MATH_TYPE_MAT)
+			vecsize *= 4;
+		if (stamp_since(p->stamp->stamp[offset], since)) {
+			// the ids refer to the original index of the moved blocks
+			int origin = (p->origin && p->origin[offset] >= 0) ? p->origin[offset] : index;
+			*iter = index + vecsize;
+			*id = changed_id(origin, shape);
+			return 1;
+		}
+		index += vecsize;
+	}
+}
+
 math_t
 math_index(struct math_context *M, math_t id, int index) {
 	union {
@@ -477,6 +1184,7 @@ math_index(struct math_context *M, math_t id, int index) {
 	assert(index < size);
 	if (u.s.type == MATH_TYPE_REF) {
 		assert(u.s.size == 0);
+		assert(check_size(index + 2));	// the size field keeps index + 1
 		u.s.size = index + 1;
 		return u.id;
 	} else if (!u.s.transient && u.s.frame > 0) {
@@ -514,8 +1222,8 @@ get_identity(int type) {
 }
 
 static inline int
-marked_index(struct math_id s) {
-	int index = s.index;
+marked_index(struct math_context *M, struct math_id s) {
+	int index = marked_resolve(M, s.index);
 	if (s.frame > 1) {
 		// indexed array
 		int offset = s.frame - 2;
@@ -540,13 +1248,13 @@ math_value(struct math_context *M, math_t id) {
 		if (u.s.type == MATH_TYPE_REF) {
 			int index = u.s.size;
 			if (index == 0)
-				index = 1;
+				return get_reference_array(M, u.s.index);
 			return get_reference(M, u.s.index, index - 1);
 		}
 		return get_transient(M, u.s.index);
 	} else {
 		if (u.s.frame) {
-			return get_marked(M, marked_index(u.s));
+			return get_marked(M, marked_index(M, u.s));
 		} else {
 			if (u.s.index == 0) {
 				return get_identity(u.s.type);
@@ -565,86 +1273,323 @@ math_init(struct math_context *M, math_t id) {
 	} u;
 	u.id = id;
 	assert (u.s.transient || u.s.frame == 1);
+	if (u.s.type == MATH_TYPE_REF) {
+		// write through a ref in place only, math_value may return a gathered copy
+		struct math_ref * r = (struct math_ref *)get_transient(M, u.s.index);
+		assert(!(r->flags & MATH_REF_VEC3));
+		assert(u.s.size > 0 || r->size == 1 || ref_packed(r));
+	} else if (!u.s.transient && M->track) {
+		int index = marked_resolve(M, u.s.index);
+		// only the first slot of a block, the block marked before the tracking gets its shape from the id
+		if (is_large(index) || M->p[index / PAGE_SIZE].count->count[index % PAGE_SIZE] != INVALID_MARK_COUNT)
+			stamp_block(M, index, SHAPE(u.s.type, u.s.size + 1));
+	}
 	return (float *)math_value(M, id);
 }
 
-static struct marked_freelist *
-new_marked_page(struct math_context *M) {
-	int maxpage = M->maxpage;
-	assert (M->marked_page < maxpage);
-	int page = M->marked_page++;
-	if (M->marked_page < maxpage) {
-		M->p[M->marked_page].marked = NULL;
-		M->p[M->marked_page].count = NULL;
-	}
-	assert(M->p[page].marked == NULL);
-	M->p[page].marked = (struct page *)malloc(sizeof(struct page));
-	assert(M->p[page].count == NULL);
-	M->p[page].count = (struct marked_count *)malloc(sizeof(struct marked_count));
-	memset(M->p[page].count, INVALID_MARK_COUNT, sizeof(struct marked_count));
+static inline int
+bit_test(const uint32_t *bits, int i) {
+	return (bits[i / 32] >> (i % 32)) & 1;
+}
 
-	struct marked_freelist *node = (struct marked_freelist *)M->p[page].marked;
-	node->next = NULL;
-	node->page = page;
-	node->size = PAGE_SIZE;
-	return node;
+static inline void
+bit_set(uint32_t *bits, int i) {
+	bits[i / 32] |= 1u << (i % 32);
 }
 
-static int
-alloc_vecarray(struct math_context *M, int vecsize) {
-	struct marked_freelist **prev = &M->freelist;
-	float * mem = NULL;
-	int page_id = 0;
-	for (;;) {
-		struct marked_freelist *node = *prev;
-		if (node == NULL) {
-			node = new_marked_page(M);
-			*prev = node;
-		}
-		if (node->size < vecsize) {
-			prev = &node->next;
-			node = node->next;
-		} else if (node->size == vecsize) {
-			// use this node
-			*prev = node->next;
-			mem = (float *)node;
-			page_id = node->page;
-			break;
-		} else {
-			// split this node
-			assert(sizeof(*node) <= sizeof(float) * 4);
-			mem = (float *)node + (node->size - vecsize) * 4;
-			node->size -= vecsize;
-			page_id = node->page;
-			break;
-		}
-	}
-	struct page *p = M->p[page_id].marked;
-	int index = (int)((mem - &p->v[0][0]) / 4);
-	return index + page_id * PAGE_SIZE;
+static inline void
+bit_clear(uint32_t *bits, int i) {
+	bits[i / 32] &= ~(1u << (i % 32));
 }
 
-static void
+static inline int
+freelist_bin(int size) {
+	if (size <= MARKED_SMALL_BIN)
+		return size - 1;
+	int bin = MARKED_SMALL_BIN;
+	int s = (size - 1) / (MARKED_SMALL_BIN * 2);
+	while (s) {
+		++bin;
+		s >>= 1;
+	}
+	assert(bin < MARKED_BIN_N);
+	return bin;
+}
+
+static inline struct marked_freelist *
+freelist_node(struct math_context *M, int index) {
+	return (struct marked_freelist *)get_marked(M, index);
+}
+
+static void
+freelist_insert(struct math_context *M, int index, int size) {
+	struct marked_count *c = M->p[index / PAGE_SIZE].count;
+	int offset = index % PAGE_SIZE;
+	assert(sizeof(struct marked_freelist) <= sizeof(float) * 4);
+	assert(offset + size <= PAGE_SIZE);
+	struct marked_freelist *node = freelist_node(M, index);
+	int bin = freelist_bin(size);
+	node->size = size;
+	node->bin = bin;
+	node->prev = -1;
+	node->next = M->freelist[bin];
+	if (node->next >= 0) {
+		freelist_node(M, node->next)->prev = index;
+	}
+	M->freelist[bin] = index;
+	// tail tag
+	freelist_node(M, index + size - 1)->size = size;
+	bit_set(c->freehead, offset);
+	bit_set(c->freetail, offset + size - 1);
+}
+
+static void
+freelist_remove(struct math_context *M, int index) {
+	struct marked_count *c = M->p[index / PAGE_SIZE].count;
+	int offset = index % PAGE_SIZE;
+	struct marked_freelist *node = freelist_node(M, index);
+	if (node->prev >= 0) {
+		freelist_node(M, node->prev)->next = node->next;
+	} else {
+		assert(M->freelist[node->bin] == index);
+		M->freelist[node->bin] = node->next;
+	}
+	if (node->next >= 0) {
+		freelist_node(M, node->next)->prev = node->prev;
+	}
+	bit_clear(c->freehead, offset);
+	bit_clear(c->freetail, offset + node->size - 1);
+}
+
+static int
+freelist_find(struct math_context *M, int vecsize) {
+	int bin = freelist_bin(vecsize);
+	if (bin >= MARKED_SMALL_BIN) {
+		// first fit in the range bin
+		int index = M->freelist[bin];
+		while (index >= 0) {
+			struct marked_freelist *node = freelist_node(M, index);
+			if (node->size >= vecsize)
+				return index;
+			index = node->next;
+		}
+		++bin;
+	}
+	// any block in the bins above is large enough
+	for (;bin < MARKED_BIN_N; bin++) {
+		if (M->freelist[bin] >= 0)
+			return M->freelist[bin];
+	}
+	return -1;
+}
+
+// put [index, index + size) back to free list, coalesce with free neighbors in the same page
+static void
+free_vecarray(struct math_context *M, int index, int size) {
+	struct marked_count *c = M->p[index / PAGE_SIZE].count;
+	int offset = index % PAGE_SIZE;
+	if (offset + size < PAGE_SIZE && bit_test(c->freehead, offset + size)) {
+		int next = index + size;
+		size += freelist_node(M, next)->size;
+		freelist_remove(M, next);
+	}
+	if (offset > 0 && bit_test(c->freetail, offset - 1)) {
+		int prev = index - freelist_node(M, index - 1)->size;
+		size += freelist_node(M, prev)->size;
+		freelist_remove(M, prev);
+		index = prev;
+	}
+	freelist_insert(M, index, size);
+}
+
+static void
+new_marked_page(struct math_context *M) {
+	int maxpage = M->maxpage;
+	int page;
+	// reuse the page released by compaction
+	for (page=0;page<M->marked_page;page++) {
+		if (M->p[page].marked == NULL && M->p[page].forward == NULL)
+			break;
+	}
+	if (page == M->marked_page) {
+		assert (M->marked_page < maxpage);
+		page = M->marked_page++;
+		if (M->marked_page < maxpage) {
+			M->p[M->marked_page].marked = NULL;
+			M->p[M->marked_page].count = NULL;
+		}
+	}
+	assert(M->p[page].marked == NULL);
+	M->p[page].marked = (struct page *)page_alloc(M, sizeof(struct page));
+	assert(M->p[page].count == NULL);
+	struct marked_count *c = (struct marked_count *)page_alloc(M, sizeof(struct marked_count));
+	memset(c, INVALID_MARK_COUNT, sizeof(struct marked_count));
+	memset(c->freehead, 0, sizeof(c->freehead));
+	memset(c->freetail, 0, sizeof(c->freetail));
+	c->used = 0;
+	M->p[page].count = c;
+
+	freelist_insert(M, page * PAGE_SIZE, PAGE_SIZE);
+}
+
+static int
+alloc_freeblock(struct math_context *M, int vecsize) {
+	int index = freelist_find(M, vecsize);
+	if (index < 0)
+		return -1;
+	int size = freelist_node(M, index)->size;
+	freelist_remove(M, index);
+	if (size > vecsize) {
+		// split this node, use the tail
+		freelist_insert(M, index, size - vecsize);
+		index += size - vecsize;
+	}
+	return index;
+}
+
+static int
+alloc_vecarray(struct math_context *M, int vecsize) {
+	int index = alloc_freeblock(M, vecsize);
+	if (index < 0) {
+		new_marked_page(M);
+		index = alloc_freeblock(M, vecsize);
+		assert(index >= 0);
+	}
+	M->p[index / PAGE_SIZE].count->used += vecsize;
+	return index;
+}
+
+static void
 prepare_constant_page(struct math_context *M, int page) {
 	int maxpage = M->maxpage;
 	assert(page < maxpage);
 	if (M->p[page].constant == NULL) {
-		M->p[page].constant = (struct page *)malloc(sizeof(struct page));
+		M->p[page].constant = (struct page *)page_alloc(M, sizeof(struct page));
 		if (page + 1 < maxpage) {
 			M->p[page+1].constant = NULL;
 		}
 	}
 }
 
+static uint32_t
+constant_hash(const float *v, int n) {
+	const uint32_t *p = (const uint32_t *)v;
+	uint32_t h = 2166136261u ^ (uint32_t)n;
+	int i;
+	for (i=0;i<n*4;i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	// final mix
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+static int
+constant_hash_find(struct math_context *M, const float *v, int n, uint32_t h) {
+	struct constant_hash *c = &M->chash;
+	if (c->cap == 0)
+		return -1;
+	int mask = c->cap - 1;
+	int i = h & mask;
+	for (;;) {
+		struct constant_key *k = &c->slot[i];
+		if (k->size == 0)
+			return -1;
+		if (k->hash == h && k->size == n && memcmp(v, get_constant(M, k->index), n * 4 * sizeof(float)) == 0)
+			return k->index;
+		i = (i + 1) & mask;
+	}
+}
+
+static void
+constant_hash_set(struct constant_hash *c, uint32_t h, int n, int index) {
+	int mask = c->cap - 1;
+	int i = h & mask;
+	while (c->slot[i].size != 0) {
+		i = (i + 1) & mask;
+	}
+	c->slot[i].hash = h;
+	c->slot[i].size = n;
+	c->slot[i].index = index;
+	++c->n;
+}
+
+static void
+constant_hash_insert(struct math_context *M, uint32_t h, int n, int index) {
+	struct constant_hash *c = &M->chash;
+	if ((c->n + 1) * 2 > c->cap) {
+		// rehash, keep load factor <= 0.5
+		int oldcap = c->cap;
+		struct constant_key *old = c->slot;
+		c->cap = oldcap ? oldcap * 2 : CONSTANT_HASH_INIT;
+		c->n = 0;
+		c->slot = (struct constant_key *)malloc(c->cap * sizeof(struct constant_key));
+		memset(c->slot, 0, c->cap * sizeof(struct constant_key));
+		int i;
+		for (i=0;i<oldcap;i++) {
+			if (old[i].size)
+				constant_hash_set(c, old[i].hash, old[i].size, old[i].index);
+		}
+		free(old);
+	}
+	constant_hash_set(c, h, n, index);
+}
+
+// Index each vec4 and each matrix-aligned window of an array, so a single vector or matrix can be shared with it.
+// Other windows (a part of a matrix, an unaligned matrix, or a window across two constants) are not indexed,
+// they are new constants.
+static void
+constant_index_array(struct math_context *M, const float *v, int n, int index) {
+	int last = n;
+	if (is_large(index) && last >= (1 << LARGE_OFFSET_BITS)) {
+		// the id of a constant is index + 1, keep it in the offset bits
+		last = (1 << LARGE_OFFSET_BITS) - 1;
+	}
+	int i;
+	for (i=0;i<last;i++) {
+		const float *vv = v + i * 4;
+		uint32_t hh = constant_hash(vv, 1);
+		if (constant_hash_find(M, vv, 1, hh) < 0) {
+			constant_hash_insert(M, hh, 1, index + i);
+		}
+	}
+	if (n > 4) {
+		for (i=0;i+4<=n && i<last;i+=4) {
+			const float *vv = v + i * 4;
+			uint32_t hh = constant_hash(vv, 4);
+			if (constant_hash_find(M, vv, 4, hh) < 0) {
+				constant_hash_insert(M, hh, 4, index + i);
+			}
+		}
+	}
+}
+
 static int
 alloc_constant(struct math_context *M, const float *v, int n) {
-	assert(n <= PAGE_SIZE);
 	// search v first
-	int i;
-	for (i=0;i<=M->constant_n - n;i++) {
-		const float * vv = get_constant(M, i);
-		if (memcmp(v, vv, n * 4 * sizeof(float))== 0)
-			return i;
+	uint32_t h = constant_hash(v, n);
+	if (M->shared) {
+		// the shared pool is read only, don't touch the counters
+		// can't add constant to the shared pool, returns -1 if v is not in it
+		return constant_hash_find(M->shared, v, n, h);
+	}
+	if (M->published)
+		return constant_hash_find(M, v, n, h);
+	int i = constant_hash_find(M, v, n, h);
+	if (i >= 0) {
+		++M->chash.hit;
+		return i;
+	}
+	++M->chash.miss;
+
+	if (n > PAGE_SIZE) {
+		int index = alloc_large_constant(M, n);
+		memcpy(large_offset(get_large_constant(M, index), index), v, n * 4 * sizeof(float));
+		constant_hash_insert(M, h, n, index);
+		constant_index_array(M, v, n, index);
+		return index;
 	}
 
 	int page_id = M->constant_n / PAGE_SIZE;
@@ -660,7 +1605,11 @@ alloc_constant(struct math_context *M, const float *v, int n) {
 	}
 	memcpy(M->p[page_id].constant->v[index], v, n * 4 * sizeof(float));
 
-	return M->constant_n - n;
+	index = M->constant_n - n;
+	constant_hash_insert(M, h, n, index);
+	if (n > 1)
+		constant_index_array(M, v, n, index);
+	return index;
 }
 
 static int
@@ -701,6 +1650,8 @@ math_constant(struct math_context *M, math_t v) {
 		assert(0);
 		return MATH_NULL;
 	}
+	if (offset < 0)
+		return MATH_NULL;
 	union {
 		math_t id;
 		struct math_id s;
@@ -713,6 +1664,191 @@ math_constant(struct math_context *M, math_t v) {
 	return u.id;
 }
 
+static inline int
+index_hash(int index, int mask) {
+	return (int)(((uint32_t)index * 2654435761u) >> 8) & mask;
+}
+
+static struct index_map_slot *
+index_map_find(struct index_map *m, int index) {
+	if (m->cap == 0)
+		return NULL;
+	int mask = m->cap - 1;
+	int i = index_hash(index, mask);
+	for (;;) {
+		struct index_map_slot *slot = &m->slot[i];
+		if (slot->index == index)
+			return slot;
+		if (slot->index < 0)
+			return NULL;
+		i = (i + 1) & mask;
+	}
+}
+
+static void
+index_map_set(struct index_map *m, int index, int value) {
+	int mask = m->cap - 1;
+	int i = index_hash(index, mask);
+	while (m->slot[i].index >= 0) {
+		i = (i + 1) & mask;
+	}
+	m->slot[i].index = index;
+	m->slot[i].value = value;
+	++m->n;
+}
+
+// index should not be in the map
+static void
+index_map_insert(struct index_map *m, int index, int value) {
+	if ((m->n + 1) * 2 > m->cap) {
+		int oldcap = m->cap;
+		struct index_map_slot *old = m->slot;
+		m->cap = oldcap ? oldcap * 2 : INDEX_MAP_INIT;
+		m->n = 0;
+		m->slot = (struct index_map_slot *)malloc(m->cap * sizeof(struct index_map_slot));
+		memset(m->slot, 0xff, m->cap * sizeof(struct index_map_slot));
+		int i;
+		for (i=0;i<oldcap;i++) {
+			if (old[i].index >= 0)
+				index_map_set(m, old[i].index, old[i].value);
+		}
+		free(old);
+	}
+	index_map_set(m, index, value);
+}
+
+static void
+index_map_remove(struct index_map *m, struct index_map_slot *slot) {
+	// shift the following slots back
+	int mask = m->cap - 1;
+	int i = (int)(slot - m->slot);
+	int j = i;
+	for (;;) {
+		j = (j + 1) & mask;
+		if (m->slot[j].index < 0)
+			break;
+		int k = index_hash(m->slot[j].index, mask);
+		// move slot j to the hole i, if its home k is not in (i, j]
+		if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			m->slot[i] = m->slot[j];
+			i = j;
+		}
+	}
+	m->slot[i].index = -1;
+	--m->n;
+}
+
+static void
+overflow_inc(struct index_map *o, int index) {
+	struct index_map_slot *slot = index_map_find(o, index);
+	if (slot) {
+		++slot->value;
+	} else {
+		index_map_insert(o, index, 1);
+	}
+}
+
+// returns the overflow count before decrease, 0 : no overflow
+static int
+overflow_dec(struct index_map *o, int index) {
+	struct index_map_slot *slot = index_map_find(o, index);
+	if (slot == NULL)
+		return 0;
+	int count = slot->value--;
+	if (slot->value == 0)
+		index_map_remove(o, slot);
+	return count;
+}
+
+static int
+profile_site(struct math_profile *P, const char *filename, int line) {
+	int mask = P->site_cap * 2 - 1;
+	int i;
+	if (P->site_cap > 0) {
+		i = (int)(((uintptr_t)filename ^ ((uintptr_t)line * 2654435761u)) & mask);
+		for (;;) {
+			int id = P->site_hash[i];
+			if (id < 0)
+				break;
+			if (P->site[id].filename == filename && P->site[id].line == line)
+				return id;
+			i = (i + 1) & mask;
+		}
+	}
+	if (P->site_n >= P->site_cap) {
+		P->site_cap = P->site_cap ? P->site_cap * 2 : PROFILE_SITE_INIT;
+		P->site = (struct profile_site *)realloc(P->site, P->site_cap * sizeof(struct profile_site));
+		free(P->site_hash);
+		P->site_hash = (int *)malloc(P->site_cap * 2 * sizeof(int));
+		memset(P->site_hash, 0xff, P->site_cap * 2 * sizeof(int));
+		mask = P->site_cap * 2 - 1;
+		for (i=0;i<P->site_n;i++) {
+			int h = (int)(((uintptr_t)P->site[i].filename ^ ((uintptr_t)P->site[i].line * 2654435761u)) & mask);
+			while (P->site_hash[h] >= 0)
+				h = (h + 1) & mask;
+			P->site_hash[h] = i;
+		}
+	}
+	int id = P->site_n++;
+	P->site[id].filename = filename;
+	P->site[id].line = line;
+	P->site[id].live = 0;
+	i = (int)(((uintptr_t)filename ^ ((uintptr_t)line * 2654435761u)) & mask);
+	while (P->site_hash[i] >= 0)
+		i = (i + 1) & mask;
+	P->site_hash[i] = id;
+	return id;
+}
+
+static void
+profile_mark(struct math_profile *P, int index, const char *filename, int line) {
+	P->tick = P->sample;
+	int site = profile_site(P, filename, line);
+	++P->site[site].live;
+	index_map_insert(&P->record, index, site);
+}
+
+static void
+profile_unmark(struct math_profile *P, int index) {
+	struct index_map_slot *slot = index_map_find(&P->record, index);
+	if (slot) {
+		--P->site[slot->value].live;
+		index_map_remove(&P->record, slot);
+	}
+}
+
+void
+math_profile(struct math_context *M, int sample) {
+	struct math_profile *P = &M->profile;
+	assert(sample >= 0);
+	if (sample == 0) {
+		free(P->site);
+		free(P->site_hash);
+		free(P->record.slot);
+		memset(P, 0, sizeof(*P));
+	} else {
+		P->sample = sample;
+		P->tick = sample;
+	}
+}
+
+int
+math_profile_pending(struct math_context *M) {
+	return M->profile.tick == 1;
+}
+
+int
+math_profile_report(struct math_context *M, struct math_profile_site *site, int n) {
+	struct math_profile *P = &M->profile;
+	int i;
+	for (i=0;i<P->site_n && i<n;i++) {
+		site[i].filename = P->site[i].filename;
+		site[i].line = P->site[i].line;
+		site[i].live = P->site[i].live;
+	}
+	return P->site_n;
+}
+
 static math_t
 alloc_marked(struct math_context *M, const float *v, int type, int size, const char *filename, int line) {
 	union {
@@ -726,7 +1862,12 @@ alloc_marked(struct math_context *M, const float *v, int type, int size, const c
 
 	M->marked_slot += vecsize;
 
-	int index = alloc_vecarray(M, vecsize);
+	int index;
+	if (vecsize > PAGE_SIZE) {
+		index = alloc_large(M, vecsize, LARGE_MARKED);
+	} else {
+		index = alloc_vecarray(M, vecsize);
+	}
 
 	u.s.index = index;
 	u.s.size = size - 1;
@@ -739,12 +1880,25 @@ alloc_marked(struct math_context *M, const float *v, int type, int size, const c
 		memcpy(ptr, v, vecsize * 4 * sizeof(float));
 	}
 
-	int page_id = index / PAGE_SIZE;
-	index %= PAGE_SIZE;
-	M->p[page_id].count->count[index] = 1;
+	*get_mark_count(M, index) = 1;
+	if (is_large(index))
+		get_large(M, index)->stamp = 0;
+	stamp_block(M, index, SHAPE(type, size));
+	if (M->profile.sample && --M->profile.tick <= 0) {
+		profile_mark(&M->profile, index, (filename != NULL) ? filename : "(null)", line);
+	}
 #ifdef MATHIDSOURCE
-	M->p[page_id].count->filename[index] = (filename != NULL) ? filename : "(null)";
-	M->p[page_id].count->line[index] = line;
+	if (filename == NULL)
+		filename = "(null)";
+	if (is_large(index)) {
+		get_large(M, index)->filename = filename;
+		get_large(M, index)->line = line;
+	} else {
+		int page_id = index / PAGE_SIZE;
+		index %= PAGE_SIZE;
+		M->p[page_id].count->filename[index] = filename;
+		M->p[page_id].count->line[index] = line;
+	}
 #endif
 	return u.id;
 }
@@ -756,21 +1910,17 @@ get_marked_id(struct math_context *M, math_t id, const char *filename, int line)
 		struct math_id s;
 	} u;
 	u.id = id;
-	int index = u.s.index;
-	int page_id = index / PAGE_SIZE;
-	index %= PAGE_SIZE;
-	assert (page_id < M->marked_page);
-	int count = M->p[page_id].count->count[index];
-	if (count >= (INVALID_MARK_COUNT-1)) {
-		assert(count != INVALID_MARK_COUNT);	// unmarked id
-		const float *v = math_value(M, id);
-		int size = math_size(M, id);
-		return alloc_marked(M, v, u.s.type, size, filename, line);
+	uint8_t *count_ptr = get_mark_count(M, marked_resolve(M, u.s.index));
+	int count = *count_ptr;
+	assert(count != INVALID_MARK_COUNT);	// unmarked id
+	if (count == MARK_COUNT_OVERFLOW) {
+		// the original index is the key, it doesn't change by compaction
+		overflow_inc(&M->overflow, u.s.index);
 	} else {
 		// add reference count
-		++M->p[page_id].count->count[index];
-		return id;
+		++*count_ptr;
 	}
+	return id;
 }
 
 math_t
@@ -855,18 +2005,14 @@ math_unmark(struct math_context *M, math_t id) {
 	if (u.s.transient != 0 || u.s.frame != 1) {
 		return -1;
 	}
-	int index = u.s.index;
-	int page_id = index / PAGE_SIZE;
-	index %= PAGE_SIZE;
-	assert(page_id < M->marked_page);
-	int vecsize = u.s.size + 1;
 	M->marked_n--;
-	if (u.s.type == MATH_TYPE_MAT) {
-		vecsize *= 4;
-	}
-	assert(vecsize + index <= PAGE_SIZE);
-	uint8_t * count = &M->p[page_id].count->count[index];
+	uint8_t * count = get_mark_count(M, marked_resolve(M, u.s.index));
 	int c = *count;
+	if (c == MARK_COUNT_OVERFLOW) {
+		int extra = overflow_dec(&M->overflow, u.s.index);
+		if (extra > 0)
+			return c + extra;
+	}
 	if (c <= 1 || c == INVALID_MARK_COUNT) {
 		if (c == 1) {
 			// The last reference
@@ -886,81 +2032,58 @@ math_premark(struct math_context *M, int type, int size) {
 		struct math_id s;
 	} u;
 	u.id = alloc_marked(M, NULL, type, size, "PREMARK", 0);
-
-	int index = u.s.index;
-	int page_id = index / PAGE_SIZE;
-	index %= PAGE_SIZE;
-	assert(page_id < M->marked_page);
-
-	int vecsize = u.s.size + 1;
-	if (u.s.type == MATH_TYPE_MAT) {
-		vecsize *= 4;
-	}
-	assert(vecsize + index <= PAGE_SIZE);
-	M->p[page_id].count->count[index] = 0;
+	*get_mark_count(M, u.s.index) = 0;
 	math_unmarked_insert(&M->unmarked, u.s);
 	return u.id;
 }
 
-static int
-int64_compr(const void *a, const void *b) {
-	const int64_t * aa = (const int64_t *)a;
-	const int64_t * bb = (const int64_t *)b;
-	return (int)((*aa >> 32) - (*bb >> 32));
-}
-
-static int64_t *
-block_size(int64_t *ptr, int64_t *endptr, int *r_index, int *r_size) {
-	int size;
-	int index = math_unmark_index_(*ptr, &size);
-	*r_index = index;
-	*r_size = size;
-	for (;;) {
-		++ptr;
-		if (ptr >= endptr)
-			return ptr;
-		int next_size;
-		int next_index = math_unmark_index_(*ptr, &next_size);
-		if (index + size == next_index && (index / PAGE_SIZE == next_index / PAGE_SIZE)) {
-			// continuous block and at the same page
-			*r_size += next_size;
-			size = next_size;
-			index = next_index;
-		} else {
-			return ptr;
-		}
+static inline void
+dump_unmarked(struct math_unmarked *unmarked) {
+	int i;
+	for (i=0;i<unmarked->n;i++) {
+		uint64_t v = unmarked->index[i];
+		printf("(%d/%d)", (int)(v>>32), (int)(v & 0xffffffff));
 	}
+	printf("\n");
 }
 
+static void free_vecarray(struct math_context *M, int index, int size);
+
+// the block moved out from origin is freed, the slots at origin can be reused now
 static void
-merge_freelist(struct math_context *M, struct math_unmarked *unmarked, const struct math_unmarked *u, struct marked_freelist *freelist) {
-	int i = 0;
-	while (freelist) {
-		int page_id = freelist->page;
-		int index = ((float *)freelist - &M->p[page_id].marked->v[0][0]) / 4;
-		index += page_id * PAGE_SIZE;
-		int64_t id = (int64_t)index << 32 | freelist->size;
-		while ( i < u->n && u->index[i] < id) {
-			math_unmarked_insert_(unmarked, u->index[i]);
-			++i;
-		}
-		math_unmarked_insert_(unmarked, id);
-		freelist = freelist->next;
+forward_release(struct math_context *M, int origin, int size) {
+	int page = origin / PAGE_SIZE;
+	struct pages *p = &M->p[page];
+	p->forward[origin % PAGE_SIZE] = -1;
+	if (p->marked) {
+		// the evacuation of this page was aborted
+		if (page == M->compact_page)
+			bit_set(p->count->freehead, origin % PAGE_SIZE);
+		else
+			free_vecarray(M, origin, size);
 	}
-	while ( i < u->n ) {
-		math_unmarked_insert_(unmarked, u->index[i]);
-		++i;
+	if (--p->forward_live == 0 && p->marked == NULL) {
+		// no id refers to this page, it can be reused
+		free(p->forward);
+		p->forward = NULL;
 	}
 }
 
-static inline void
-dump_unmarked(struct math_unmarked *unmarked) {
-	int i;
-	for (i=0;i<unmarked->n;i++) {
-		uint64_t v = unmarked->index[i];
-		printf("(%d/%d)", (int)(v>>32), (int)(v & 0xffffffff));
+static void
+free_marked_block(struct math_context *M, int index, int size) {
+	struct pages *p = &M->p[index / PAGE_SIZE];
+	int offset = index % PAGE_SIZE;
+	p->count->used -= size;
+	if (p->origin && p->origin[offset] >= 0) {
+		forward_release(M, p->origin[offset], size);
+		p->origin[offset] = -1;
+	}
+	if (index / PAGE_SIZE == M->compact_page) {
+		// don't reuse the page in evacuation, the free head bit keeps the boundary of the blocks
+		bit_set(p->count->freehead, offset);
+	} else {
+		free_vecarray(M, index, size);
 	}
-	printf("\n");
 }
 
 static void
@@ -968,91 +2091,311 @@ free_unmarked(struct math_context *M) {
 	int n = M->unmarked.n;
 	if (n == 0)
 		return;
-	qsort(M->unmarked.index, n, sizeof(int64_t), int64_compr);
 
-	// remove alive and dup index
+//	dump_unmarked(&M->unmarked);
+
+	// free_vecarray coalesces with free neighbors by the boundary tags, so the order doesn't matter.
 	int i;
-	int p = 0;
-	int sz;
-	int last = math_unmark_index_(M->unmarked.index[0], &sz);
-	int page_id = last / PAGE_SIZE;
-	uint8_t *count = &M->p[page_id].count->count[last % PAGE_SIZE];
-	if (*count == 0) {
-		*count = INVALID_MARK_COUNT;
-		++p;
-		M->marked_slot -= sz;
-	}
-	for (i=1;i<n;i++) {
-		int current = math_unmark_index_(M->unmarked.index[i], &sz);
-		if (current != last) {
+	for (i=0;i<n;i++) {
+		int sz;
+		int origin = math_unmark_index_(M->unmarked.index[i], &sz);
+		int index = marked_resolve(M, origin);
+		if (!is_large(index) && M->p[index / PAGE_SIZE].count == NULL) {
+			// duplicated index of a block moved and freed
+			continue;
+		}
+		uint8_t *count = get_mark_count(M, index);
+		// skip alive (marked again) and duplicated index
+		if (*count == 0) {
+			*count = INVALID_MARK_COUNT;
 			M->marked_slot -= sz;
-			last = current;
-			page_id = current / PAGE_SIZE;
-			uint8_t *count = &M->p[page_id].count->count[current % PAGE_SIZE];
-			if (*count == 0) {
-				*count = INVALID_MARK_COUNT;
-				M->unmarked.index[p++] = M->unmarked.index[i];
+			if (M->profile.record.n > 0)
+				profile_unmark(&M->profile, origin);
+			if (is_large(index)) {
+				free_large(M, large_slot(index));
+			} else {
+				free_marked_block(M, index, sz);
 			}
 		}
 	}
 
-	M->unmarked.n = p;
+	M->unmarked.n = 0;
+}
 
-	if (p == 0)
-		return;
+static inline int
+check_freelist(struct math_context *M) {
+	int bin;
+	for (bin=0;bin<MARKED_BIN_N;bin++) {
+		int index = M->freelist[bin];
+		int prev = -1;
+		while (index >= 0) {
+			int pageid = index / PAGE_SIZE;
+			if (pageid >= M->marked_page || M->p[pageid].marked == NULL)
+				return 0;
+			struct marked_freelist *node = freelist_node(M, index);
+			struct marked_count *c = M->p[pageid].count;
+			int offset = index % PAGE_SIZE;
+			if (node->prev != prev || node->bin != bin || freelist_bin(node->size) != bin)
+				return 0;
+			if (offset + node->size > PAGE_SIZE)
+				return 0;
+			if (!bit_test(c->freehead, offset) || !bit_test(c->freetail, offset + node->size - 1))
+				return 0;
+			if (freelist_node(M, index + node->size - 1)->size != node->size)
+				return 0;
+			prev = index;
+			index = node->next;
+		}
+	}
+	return 1;
+}
 
-	struct math_unmarked tmp;
-	struct math_unmarked *unmarked;
-	math_unmarked_init(&tmp);
-	if (M->freelist) {
-		unmarked = &tmp;
-		merge_freelist(M, unmarked, &M->unmarked, M->freelist);
-	} else {
-		unmarked = &M->unmarked;
+static int *
+new_index_map() {
+	int *m = (int *)malloc(PAGE_SIZE * sizeof(int));
+	memset(m, 0xff, PAGE_SIZE * sizeof(int));
+	return m;
+}
+
+// the size of the live block at offset, a block ends at the next live block or free block
+static int
+block_extent(struct marked_count *c, int offset) {
+	int end = offset + 1;
+	while (end < PAGE_SIZE && c->count[end] == INVALID_MARK_COUNT && !bit_test(c->freehead, end))
+		++end;
+	return end - offset;
+}
+
+// choose the emptiest page, when the other pages have room for its blocks
+static int
+compact_select(struct math_context *M) {
+	int i;
+	int page = -1;
+	int used = COMPACT_THRESHOLD;
+	int room = 0;
+	for (i=0;i<M->marked_page;i++) {
+		struct marked_count *c = M->p[i].count;
+		if (c) {
+			room += PAGE_SIZE - c->used;
+			if (i == M->compact_aborted && c->used >= M->compact_aborted_used)
+				continue;
+			if (c->used < used) {
+				used = c->used;
+				page = i;
+			}
+		}
 	}
+	if (page < 0 || room - (PAGE_SIZE - used) < used)
+		return -1;
+	return page;
+}
 
-//	dump_unmarked(unmarked);
+static void
+compact_begin(struct math_context *M, int page) {
+	struct marked_count *c = M->p[page].count;
+	const int *forward = M->p[page].forward;
+	int offset = 0;
+	// take the free blocks away from the free list, keep the free head bits as the boundary
+	while (offset < PAGE_SIZE) {
+		if (bit_test(c->freehead, offset)) {
+			int index = page * PAGE_SIZE + offset;
+			int size = freelist_node(M, index)->size;
+			freelist_remove(M, index);
+			bit_set(c->freehead, offset);
+			offset += size;
+		} else {
+			if (forward && forward[offset] >= 0) {
+				// moved out by the aborted evacuation, it's a boundary too
+				bit_set(c->freehead, offset);
+			}
+			++offset;
+		}
+	}
+	M->compact_page = page;
+	M->compact_offset = 0;
+}
 
-	int64_t *ptr = unmarked->index;
-	int64_t *endptr = unmarked->index + unmarked->n;
+static inline int
+is_forwarded(const int *forward, int offset) {
+	return forward && forward[offset] >= 0;
+}
 
-	struct marked_freelist **list_next = &M->freelist;
+// put the free slots of the page in evacuation back to the free list.
+// The slots moved out are still referred by the ids (through forward), forward_release frees them.
+static void
+compact_abort(struct math_context *M) {
+	int page = M->compact_page;
+	struct marked_count *c = M->p[page].count;
+	const int *forward = M->p[page].forward;
+	int offset = 0;
+	while (offset < PAGE_SIZE) {
+		if (c->count[offset] != INVALID_MARK_COUNT) {
+			offset += block_extent(c, offset);
+		} else if (is_forwarded(forward, offset)) {
+			int size = block_extent(c, offset);
+			bit_clear(c->freehead, offset);
+			offset += size;
+		} else {
+			int from = offset;
+			while (offset < PAGE_SIZE && c->count[offset] == INVALID_MARK_COUNT && !is_forwarded(forward, offset)) {
+				bit_clear(c->freehead, offset);
+				++offset;
+			}
+			freelist_insert(M, page * PAGE_SIZE + from, offset - from);
+		}
+	}
+	M->compact_page = -1;
+	M->compact_aborted = page;
+	M->compact_aborted_used = c->used;
+}
 
-	while (ptr < endptr) {
-		int index;
-		int sz;
-		ptr = block_size(ptr, endptr, &index, &sz);
-		struct marked_freelist * node = (struct marked_freelist *)get_marked(M, index);
-		*list_next = node;
-		list_next = &node->next;
-		node->size = sz;
-		node->page = index / PAGE_SIZE;
+static void
+compact_release(struct math_context *M) {
+	struct pages *p = &M->p[M->compact_page];
+	assert(p->count->used == 0);
+	page_free(M, p->marked, sizeof(struct page));
+	page_free(M, p->count, sizeof(struct marked_count));
+	if (p->stamp)
+		page_free(M, p->stamp, sizeof(struct marked_stamp));
+	p->marked = NULL;
+	p->count = NULL;
+	p->stamp = NULL;
+	free(p->origin);
+	p->origin = NULL;
+	if (p->forward_live == 0) {
+		free(p->forward);
+		p->forward = NULL;
 	}
-	*list_next = NULL;
-	math_unmarked_deinit(&tmp);
+	M->compact_page = -1;
+}
 
-	M->unmarked.n = 0;
+// move the block at offset of the page in evacuation, returns 0 when there is no room
+static int
+compact_move(struct math_context *M, int offset, int size) {
+	int page = M->compact_page;
+	struct pages *p = &M->p[page];
+	int from = page * PAGE_SIZE + offset;
+	int to = alloc_freeblock(M, size);
+	if (to < 0)
+		return 0;
+	struct pages *dest = &M->p[to / PAGE_SIZE];
+	int dest_offset = to % PAGE_SIZE;
+	memcpy(dest->marked->v[dest_offset], p->marked->v[offset], size * 4 * sizeof(float));
+	dest->count->count[dest_offset] = p->count->count[offset];
+	if (p->stamp && p->stamp->stamp[offset]) {
+		stamp_block(M, to, p->stamp->shape[offset]);
+		dest->stamp->stamp[dest_offset] = p->stamp->stamp[offset];
+	} else if (dest->stamp) {
+		dest->stamp->stamp[dest_offset] = 0;
+	}
+	dest->count->used += size;
+#ifdef MATHIDSOURCE
+	dest->count->filename[dest_offset] = p->count->filename[offset];
+	dest->count->line[dest_offset] = p->count->line[offset];
+#endif
+	p->count->count[offset] = INVALID_MARK_COUNT;
+	p->count->used -= size;
+	bit_set(p->count->freehead, offset);
+
+	int origin = from;
+	if (p->origin && p->origin[offset] >= 0) {
+		// moved again, the ids refer to the original index
+		origin = p->origin[offset];
+		p->origin[offset] = -1;
+	} else {
+		if (p->forward == NULL)
+			p->forward = new_index_map();
+		++p->forward_live;
+	}
+	M->p[origin / PAGE_SIZE].forward[origin % PAGE_SIZE] = to;
+	if (dest->origin == NULL)
+		dest->origin = new_index_map();
+	dest->origin[dest_offset] = origin;
+	M->compact_moved += size;
+	return 1;
 }
 
-static inline int
-check_freelist(struct math_context *M) {
-	struct marked_freelist *list = M->freelist;
-	while (list) {
-		int pageid = list->page;
-		if (pageid < 0 || pageid >= M->marked_page) {
-			return 0;
+// move live blocks out of the emptiest page, no more than compact_budget slots per frame
+static void
+compact_marked(struct math_context *M) {
+	if (M->compact_page < 0) {
+		int page = compact_select(M);
+		if (page < 0)
+			return;
+		compact_begin(M, page);
+	}
+	struct marked_count *c = M->p[M->compact_page].count;
+	int budget = M->compact_budget;
+	int offset = M->compact_offset;
+	while (offset < PAGE_SIZE && budget > 0) {
+		if (c->count[offset] == INVALID_MARK_COUNT) {
+			++offset;
+		} else {
+			int size = block_extent(c, offset);
+			if (!compact_move(M, offset, size)) {
+				// no room in the other pages
+				compact_abort(M);
+				return;
+			}
+			offset += size;
+			budget -= size;
 		}
-		struct page * p = M->p[pageid].marked;
+	}
+	if (offset >= PAGE_SIZE) {
+		compact_release(M);
+	} else {
+		M->compact_offset = offset;
+	}
+}
+
+void
+math_set_compaction(struct math_context *M, int budget) {
+	assert(budget >= 0);
+	M->compact_budget = budget;
+	if (budget == 0 && M->compact_page >= 0)
+		compact_abort(M);
+}
+
+// returns how many transient pages can be kept.
+// The peak pages of each frame raise the high water mark; it's held for transient_retention frames,
+// and then decays one page per frame. The current frame and the last frame are alive, each may straddle one more page.
+static int
+transient_retain_pages(struct math_context *M) {
+	int peak = (M->transient_peak + PAGE_SIZE - 1) / PAGE_SIZE;
+	M->transient_peak = 0;
+	if (M->transient_retention == 0) {
+		M->transient_hwm = 0;
+		return 0;
+	}
+	if (peak >= M->transient_hwm) {
+		M->transient_hwm = peak;
+		M->transient_hwm_age = 0;
+	} else if (++M->transient_hwm_age > M->transient_retention) {
+		--M->transient_hwm;
+	}
+	return (M->transient_hwm + 1) * 2;
+}
+
+// release the unused transient pages after the current one, keep some of them as spare pages
+static void
+free_transient_pages(struct math_context *M) {
+	int retain = transient_retain_pages(M);
+	int i;
+	for (i=(M->n / PAGE_SIZE) + 1; i < M->maxpage; i ++) {
+		struct page *p = M->p[i].transient;
 		if (p == NULL)
-			return 0;
-		uintptr_t begin = (uintptr_t)p;
-		uintptr_t end = (uintptr_t)(p+1);
-		uintptr_t address = (uintptr_t)list;
-		if (address < begin || address >= end)
-			return 0;
-		list = list->next;
+			break;
+		M->p[i].transient = NULL;
+		*(struct page **)p = M->transient_spare;
+		M->transient_spare = p;
+	}
+	while (M->transient_spare && M->transient_pages > retain) {
+		struct page *p = M->transient_spare;
+		M->transient_spare = *(struct page **)p;
+		page_free(M, p, sizeof(struct page));
+		--M->transient_pages;
+		++M->transient_free;
 	}
-	return 1;
 }
 
 void
@@ -1067,14 +2410,13 @@ math_frame(struct math_context *M) {
 	if (M->frame > u.s.frame) {
 		M->frame = 0;
 	}
-	int i;
-	for (i=(M->n / PAGE_SIZE) + 1; i < M->maxpage; i ++) {
-		if (M->p[i].transient == NULL)
-			break;
-		free(M->p[i].transient);
-		M->p[i].transient = NULL;
-	}
+	if (++M->stamp == 0)
+		M->stamp = 1;
+	free_transient_pages(M);
 	free_unmarked(M);
+	if (M->compact_budget > 0)
+		compact_marked(M);
+	free_transient_large(M);
 	M->top = M->base;
 	M->base = M->n;
 //	assert(check_freelist(M));
@@ -1166,10 +2508,7 @@ math_print(struct math_context *M, math_t id) {
 			int offset = u.s.frame - 2;
 			printf("<%d/?>) :", offset);
 		} else {
-			int index = u.s.index;
-			int page = index / PAGE_SIZE;
-			index %= PAGE_SIZE;
-			int c = M->p[page].count->count[index];
+			int c = *get_mark_count(M, marked_resolve(M, u.s.index));
 			printf("/%d) :", c);
 		}
 	}
@@ -1196,6 +2535,511 @@ math_print(struct math_context *M, math_t id) {
 
 #ifdef TEST_MATHID
 
+#include <time.h>
+
+static math_t
+bench_object(struct math_context *M, int r) {
+	// 1 vec4, aabb (2 vec4), matrix, and sometimes a 64 matrices skeleton
+	if (r % 64 == 0)
+		return math_mark(M, math_import(M, NULL, MATH_TYPE_MAT, 64));
+	switch (r % 3) {
+	case 0:
+		return math_mark(M, math_import(M, NULL, MATH_TYPE_VEC4, 1));
+	case 1:
+		return math_mark(M, math_import(M, NULL, MATH_TYPE_VEC4, 2));
+	default:
+		return math_mark(M, math_import(M, NULL, MATH_TYPE_MAT, 1));
+	}
+}
+
+static void
+test_large(struct math_context *M) {
+	int n = 1000;	// 4000 vec4, larger than a page
+	float *buf = (float *)malloc(n * 16 * sizeof(float));
+	int i;
+	for (i=0;i<n*16;i++) {
+		buf[i] = (float)i;
+	}
+	math_t t = math_import(M, buf, MATH_TYPE_MAT, n);
+	assert(math_size(M, t) == n);
+	assert(math_value(M, math_index(M, t, n-1))[0] == (float)((n-1) * 16));
+	math_t m = math_mark(M, t);
+	math_t c = math_constant(M, t);
+	assert(math_issame(c, math_constant(M, t)));
+	assert(math_size(M, m) == n && math_size(M, c) == n);
+	assert(math_value(M, math_index(M, m, n-1))[0] == (float)((n-1) * 16));
+	assert(math_value(M, math_index(M, c, n-1))[15] == (float)(n * 16 - 1));
+	assert(math_marked(M, m) && math_valid(M, c));
+	assert(math_info(M, MATH_INFO_LARGE) == 3);
+	math_frame(M);
+	math_frame(M);
+	// the transient one is gone
+	assert(math_info(M, MATH_INFO_LARGE) == 2);
+	math_unmark(M, m);
+	math_frame(M);
+	assert(math_info(M, MATH_INFO_LARGE) == 1);
+	assert(memcmp(math_value(M, c), buf, n * 16 * sizeof(float)) == 0);
+	printf("large : %d\n", math_info(M, MATH_INFO_LARGE));
+	free(buf);
+}
+
+struct test_allocator {
+	int n;
+	size_t size;
+};
+
+static void *
+test_alloc(void *ud, size_t size, size_t align) {
+	struct test_allocator *a = (struct test_allocator *)ud;
+	++a->n;
+	a->size += size;
+	return default_alloc(NULL, size, align);
+}
+
+static void
+test_free(void *ud, void *ptr, size_t size) {
+	struct test_allocator *a = (struct test_allocator *)ud;
+	--a->n;
+	a->size -= size;
+	default_free(NULL, ptr, size);
+}
+
+static void
+test_allocator() {
+	struct test_allocator a = { 0, 0 };
+	struct math_allocator alloc = { test_alloc, test_free, &a };
+	struct math_context *M = math_new_ex(0, &alloc);
+	math_mark(M, math_import(M, NULL, MATH_TYPE_MAT, 1));
+	assert(((uintptr_t)M->p[0].transient & (PAGE_ALIGN - 1)) == 0);
+	assert(((uintptr_t)M->p[0].marked & (PAGE_ALIGN - 1)) == 0);
+	math_constant(M, math_import(M, NULL, MATH_TYPE_MAT, 1000));
+	printf("allocator : %d blocks %d bytes\n", a.n, (int)a.size);
+	math_delete(M);
+	assert(a.n == 0 && a.size == 0);
+}
+
+static void
+test_shared() {
+	struct math_context *pool = math_new(0);
+	float v[4] = { 1,2,3,4 };
+	float *buf = (float *)calloc(1000 * 16, sizeof(float));
+	buf[1000 * 16 - 1] = 42;
+	math_t c = math_constant(pool, math_vec4(pool, v));
+	math_t large = math_constant(pool, math_import(pool, buf, MATH_TYPE_MAT, 1000));
+	math_publish(pool);
+	struct math_context *M[2];
+	int i;
+	// large transient arrays in the published pool go to its own slot table, the constant one is frozen
+	struct large_object *frozen = pool->large_constant;
+	for (i=0;i<20;i++) {
+		math_import(pool, buf, MATH_TYPE_MAT, 1000);
+	}
+	assert(pool->large_constant == frozen && pool->large_constant_n == 1);
+	assert(math_value(pool, math_index(pool, large, 999))[15] == 42);
+	// the rows of the large constant are indexed, the others can't be added
+	assert(math_value(pool, math_constant(pool, math_import(pool, buf + 999 * 16 + 12, MATH_TYPE_VEC4, 1))) == math_value(pool, math_index(pool, large, 999)) + 12);
+	float other[4] = { 5,6,7,8 };
+	assert(math_isnull(math_constant(pool, math_vec4(pool, other))));
+	math_frame(pool);
+	for (i=0;i<2;i++) {
+		M[i] = math_new_shared(pool, 0);
+		assert(math_valid(M[i], c) && math_valid(M[i], large));
+		assert(math_value(M[i], c)[3] == 4);
+		assert(math_value(M[i], math_index(M[i], large, 999))[15] == 42);
+		assert(math_issame(c, math_constant(M[i], math_vec4(M[i], v))));
+		float nv[4] = { 4,3,2,1 };
+		assert(math_isnull(math_constant(M[i], math_vec4(M[i], nv))));
+		math_t m = math_mark(M[i], math_import(M[i], NULL, MATH_TYPE_VEC4, 1));
+		math_unmark(M[i], m);
+		math_frame(M[i]);
+	}
+	printf("shared constant : %d\n", math_info(M[0], MATH_INFO_CONSTANT));
+	for (i=0;i<2;i++) {
+		math_delete(M[i]);
+	}
+	math_delete(pool);
+	free(buf);
+}
+
+// Only the whole constants, each vec4 and the matrix-aligned windows of arrays are shared
+static void
+test_constant_window() {
+	struct math_context *M = math_new(0);
+	float v[8][4];
+	int i;
+	for (i=0;i<8*4;i++) {
+		v[i/4][i%4] = (float)(i + 1);
+	}
+	math_t array = math_constant(M, math_import(M, &v[0][0], MATH_TYPE_VEC4, 8));
+	int n = math_info(M, MATH_INFO_CONSTANT);
+	// a vec4 or a matrix at an aligned offset is shared
+	assert(math_value(M, math_constant(M, math_vec4(M, v[5]))) == math_value(M, array) + 5 * 4);
+	assert(math_value(M, math_constant(M, math_matrix(M, v[4]))) == math_value(M, array) + 4 * 4);
+	assert(math_info(M, MATH_INFO_CONSTANT) == n);
+	// two rows, or a matrix at an unaligned offset are new constants
+	math_t rows = math_constant(M, math_import(M, v[0], MATH_TYPE_VEC4, 2));
+	assert(math_value(M, rows) != math_value(M, array));
+	assert(math_info(M, MATH_INFO_CONSTANT) == n + 2);
+	math_t unaligned = math_constant(M, math_matrix(M, v[1]));
+	assert(math_value(M, unaligned) != math_value(M, array) + 4);
+	assert(math_info(M, MATH_INFO_CONSTANT) == n + 6);
+	// the same for a large constant
+	int large_n = 1000;
+	float *buf = (float *)malloc(large_n * 16 * sizeof(float));
+	for (i=0;i<large_n*16;i++) {
+		buf[i] = (float)-i;
+	}
+	math_t large = math_constant(M, math_import(M, buf, MATH_TYPE_MAT, large_n));
+	n = math_info(M, MATH_INFO_CONSTANT);
+	assert(math_value(M, math_constant(M, math_matrix(M, buf + 999 * 16))) == math_value(M, math_index(M, large, 999)));
+	assert(math_value(M, math_constant(M, math_vec4(M, buf + 3 * 4))) == math_value(M, large) + 3 * 4);
+	assert(math_info(M, MATH_INFO_CONSTANT) == n);
+	math_t part = math_constant(M, math_matrix(M, buf + 4));
+	assert(math_value(M, part) != math_value(M, large) + 4);
+	assert(math_info(M, MATH_INFO_CONSTANT) == n + 4);
+	free(buf);
+	math_delete(M);
+}
+
+static void
+test_overflow() {
+	struct math_context *M = math_new(0);
+	float v[4] = { 1,2,3,4 };
+	math_t id = math_mark(M, math_vec4(M, v));
+	math_t id2 = math_mark(M, math_vec4(M, v));
+	int slot = math_info(M, MATH_INFO_SLOT);
+	int i;
+	for (i=0;i<1000;i++) {
+		assert(math_issame(math_mark(M, id), id));
+		assert(math_issame(math_mark(M, id2), id2));
+	}
+	assert(math_info(M, MATH_INFO_SLOT) == slot);
+	for (i=0;i<1000;i++) {
+		assert(math_unmark(M, id) == 1001 - i);
+	}
+	math_frame(M);
+	assert(math_marked(M, id));
+	math_unmark(M, id);
+	math_frame(M);
+	assert(math_marked(M, id2));
+	assert(math_info(M, MATH_INFO_SLOT) == slot - 1);
+	printf("overflow : %d\n", M->overflow.n);
+	math_delete(M);
+}
+
+static void
+test_profile() {
+	struct math_context *M = math_new(0);
+	float v[4] = { 1,2,3,4 };
+	math_t id[20];
+	int i;
+	math_profile(M, 2);
+	for (i=0;i<20;i++) {
+		id[i] = math_mark_(M, math_vec4(M, v), (i < 10) ? "a" : "b", i < 10 ? 1 : 2);
+	}
+	for (i=0;i<10;i++) {
+		math_unmark(M, id[i]);
+	}
+	math_frame(M);
+	struct math_profile_site site[4];
+	int n = math_profile_report(M, site, 4);
+	assert(n == 2);
+	assert(site[0].live == 0 && site[1].live == 5);
+	printf("profile : %s:%d %d, %s:%d %d\n", site[0].filename, site[0].line, site[0].live, site[1].filename, site[1].line, site[1].live);
+	math_delete(M);
+}
+
+static void
+test_ref_stride() {
+	struct math_context *M = math_new(0);
+	// interleaved vertex : position (vec3) + uv (vec2)
+	float vb[4][5];
+	int i;
+	for (i=0;i<4;i++) {
+		vb[i][0] = (float)i;
+		vb[i][1] = (float)(i * 2);
+		vb[i][2] = (float)(i * 3);
+		vb[i][3] = vb[i][4] = -1.0f;
+	}
+	math_t pos = math_ref_stride(M, vb, MATH_TYPE_VEC4, 4, sizeof(vb[0]), MATH_REF_VEC3);
+	assert(math_size(M, pos) == 4);
+	const float *v = math_value(M, math_index(M, pos, 2));
+	assert(v[0] == 2 && v[1] == 4 && v[2] == 6 && v[3] == 1);
+	// gathered
+	v = math_value(M, pos);
+	assert(v[12] == 3 && v[13] == 6 && v[14] == 9 && v[15] == 1);
+	struct math_view view;
+	math_view(M, pos, &view);
+	assert(view.ptr == &vb[0][0] && view.size == 4 && view.stride == sizeof(vb[0]) && view.vec3);
+
+	// matrices with padding, write in place
+	float mb[2][20];
+	memset(mb, 0, sizeof(mb));
+	math_t mat = math_ref_stride(M, mb, MATH_TYPE_MAT, 2, sizeof(mb[0]), 0);
+	float *m = math_init(M, math_index(M, mat, 1));
+	m[0] = 42;
+	assert(mb[1][0] == 42);
+	math_frame(M);
+	math_delete(M);
+}
+
+static void
+test_compaction() {
+	struct math_context *M = math_new(0);
+	int n = 20000;
+	math_t *obj = (math_t *)malloc(n * sizeof(math_t));
+	int i;
+	unsigned r = 1;
+	for (i=0;i<n;i++) {
+		float v[2][4] = { { (float)i, 0, 0, 0 }, { 0, (float)i, 0, 0 } };
+		obj[i] = math_mark(M, math_import(M, &v[0][0], MATH_TYPE_VEC4, (i % 2) + 1));
+	}
+	math_frame(M);
+	for (i=0;i<n;i++) {
+		r = r * 1103515245 + 12345;
+		if ((r >> 16) % 10) {
+			math_unmark(M, obj[i]);
+			obj[i] = MATH_NULL;
+		}
+	}
+	math_frame(M);
+	int pages = math_info(M, MATH_INFO_MARKED_PAGE);
+	math_set_compaction(M, 1024);
+	for (i=0;i<100;i++) {
+		math_frame(M);
+	}
+	int compact_pages = math_info(M, MATH_INFO_MARKED_PAGE);
+	printf("compaction : pages %d -> %d, moved %d\n", pages, compact_pages, math_info(M, MATH_INFO_COMPACT_MOVED));
+	assert(compact_pages < pages);
+	for (i=0;i<n;i++) {
+		if (!math_isnull(obj[i])) {
+			assert(math_marked(M, obj[i]));
+			assert(math_value(M, obj[i])[0] == (float)i);
+			if (i % 2)
+				assert(math_value(M, math_index(M, obj[i], 1))[1] == (float)i);
+			// mark again and unmark, the id keeps
+			assert(math_issame(math_mark(M, obj[i]), obj[i]));
+			math_unmark(M, obj[i]);
+		}
+	}
+	for (i=0;i<n;i++) {
+		if (!math_isnull(obj[i]))
+			math_unmark(M, obj[i]);
+	}
+	math_frame(M);
+	assert(math_info(M, MATH_INFO_SLOT) == 0);
+	free(obj);
+	math_delete(M);
+}
+
+// abort the compaction in the middle, the slots moved out can't be reused until the ids are released
+static void
+test_compaction_abort() {
+	struct math_context *M = math_new(0);
+	int n = 3000;
+	int m = 2000;
+	math_t *obj = (math_t *)malloc((n + m) * sizeof(math_t));
+	int i;
+	for (i=0;i<n;i++) {
+		float v[4] = { (float)i, 0, 0, 0 };
+		obj[i] = math_mark(M, math_vec4(M, v));
+	}
+	math_frame(M);
+	for (i=0;i<n;i+=2) {
+		math_unmark(M, obj[i]);
+		obj[i] = MATH_NULL;
+	}
+	math_frame(M);
+	math_set_compaction(M, 100);
+	math_frame(M);
+	assert(math_info(M, MATH_INFO_COMPACT_MOVED) > 0);
+	math_set_compaction(M, 0);
+	for (i=n;i<n+m;i++) {
+		float v[4] = { (float)i, 0, 0, 0 };
+		obj[i] = math_mark(M, math_vec4(M, v));
+	}
+	math_frame(M);
+	for (i=0;i<n+m;i++) {
+		if (!math_isnull(obj[i]))
+			assert(math_value(M, obj[i])[0] == (float)i);
+	}
+	// release the moved blocks, and compact again
+	for (i=1;i<n;i+=2) {
+		math_unmark(M, obj[i]);
+		obj[i] = MATH_NULL;
+	}
+	math_set_compaction(M, 100);
+	for (i=0;i<100;i++) {
+		math_frame(M);
+	}
+	for (i=n;i<n+m;i++) {
+		assert(math_value(M, obj[i])[0] == (float)i);
+		math_unmark(M, obj[i]);
+	}
+	math_frame(M);
+	assert(math_info(M, MATH_INFO_SLOT) == 0);
+	free(obj);
+	math_delete(M);
+}
+
+static int
+count_changed(struct math_context *M, uint32_t since, const math_t *obj, int n) {
+	int iter = 0;
+	int count = 0;
+	math_t id;
+	while (math_changed_next(M, since, &iter, &id)) {
+		int i;
+		for (i=0;i<n;i++) {
+			if (math_issame(obj[i], id))
+				break;
+		}
+		assert(i < n);
+		++count;
+	}
+	return count;
+}
+
+static void
+test_stamp() {
+	struct math_context *M = math_new(0);
+	int n = 3000;
+	math_t *obj = (math_t *)malloc(n * sizeof(math_t));
+	int i;
+	// no stamp until the tracking is on
+	math_t before = math_mark(M, math_import(M, NULL, MATH_TYPE_MAT, 2));
+	assert(math_modified(M, before) == 0 && M->p[0].stamp == NULL);
+	math_track(M, 1);
+	for (i=0;i<n;i++) {
+		float v[16] = { (float)i };
+		if (i == n - 1)
+			obj[i] = math_mark(M, math_import(M, NULL, MATH_TYPE_MAT, 1000));	// large
+		else
+			obj[i] = math_mark(M, math_import(M, v, (i % 2) ? MATH_TYPE_MAT : MATH_TYPE_VEC4, 1));
+	}
+	assert(count_changed(M, math_stamp(M), obj, n) == n);
+	math_frame(M);
+	uint32_t since = math_stamp(M);
+	assert(count_changed(M, since, obj, n) == 0);
+	math_init(M, obj[1]);
+	math_init(M, obj[100]);
+	math_init(M, obj[n-1]);
+	assert(math_modified(M, obj[100]) == since && math_modified(M, obj[101]) < since);
+	assert(count_changed(M, since, obj, n) == 3);
+	// unmarked values are not changed
+	math_unmark(M, obj[100]);
+	assert(count_changed(M, since, obj, n) == 2);
+	math_frame(M);
+	obj[100] = MATH_NULL;
+	// the stamps keep after compaction
+	for (i=0;i<n-1;i++) {
+		if (i % 4 && i != 1) {
+			math_unmark(M, obj[i]);
+			obj[i] = MATH_NULL;
+		}
+	}
+	math_set_compaction(M, 1024);
+	for (i=0;i<10;i++)
+		math_frame(M);
+	assert(math_info(M, MATH_INFO_COMPACT_MOVED) > 0);
+	assert(count_changed(M, since, obj, n) == 2);
+	assert(math_modified(M, obj[1]) == since);
+	// a value marked before the tracking is tracked after a write, with the shape of its id
+	assert(math_modified(M, before) == 0);
+	math_init(M, before);
+	obj[100] = before;
+	assert(count_changed(M, math_stamp(M), obj, n) == 1);
+	math_track(M, 0);
+	for (i=0;i<M->marked_page;i++) {
+		assert(M->p[i].stamp == NULL);
+	}
+	assert(count_changed(M, 0, obj, n) == 0 && math_modified(M, obj[1]) == 0);
+	for (i=0;i<n;i++) {
+		if (!math_isnull(obj[i]))
+			math_unmark(M, obj[i]);
+	}
+	free(obj);
+	math_delete(M);
+}
+
+static int
+test_retention(int frames) {
+	struct math_context *M = math_new(0);
+	math_set_transient_retention(M, frames);
+	int i, j;
+	for (i=0;i<1000;i++) {
+		// heavy frame every 4 frames
+		int n = (i % 4 == 0) ? 8 : 1;
+		for (j=0;j<n;j++) {
+			math_import(M, NULL, MATH_TYPE_VEC4, PAGE_SIZE);
+		}
+		math_frame(M);
+	}
+	int churn = math_info(M, MATH_INFO_TRANSIENT_ALLOC);
+	printf("retention %d : transient page alloc %d free %d, retain %d\n", frames,
+		churn, math_info(M, MATH_INFO_TRANSIENT_FREE), math_info(M, MATH_INFO_TRANSIENT_RETAIN));
+	math_delete(M);
+	return churn;
+}
+
+static void
+bench_churn(int live) {
+	struct math_context *M = math_new(1024);
+	math_t *obj = (math_t *)malloc(live * sizeof(math_t));
+	int i, j;
+	unsigned r = 1;
+	for (i=0;i<live;i++) {
+		r = r * 1103515245 + 12345;
+		obj[i] = bench_object(M, r >> 16);
+	}
+	math_frame(M);
+	const int round = 100;
+	const int churn = 1000;
+	clock_t t = clock();
+	for (i=0;i<round;i++) {
+		for (j=0;j<churn;j++) {
+			r = r * 1103515245 + 12345;
+			int k = (r >> 16) % live;
+			math_unmark(M, obj[k]);
+			obj[k] = bench_object(M, r >> 8);
+		}
+		math_frame(M);
+	}
+	double ns = (double)(clock() - t) / CLOCKS_PER_SEC * 1e9 / (round * churn);
+	printf("churn live %6d : %.1f ns per unmark/mark, slot %d\n", live, ns, math_info(M, MATH_INFO_SLOT));
+	free(obj);
+	math_delete(M);
+}
+
+static void
+bench_frame(int n) {
+	struct math_context *M = math_new(1024);
+	math_t *obj = (math_t *)malloc(n * sizeof(math_t));
+	int i;
+	unsigned r = 1;
+	for (i=0;i<n;i++) {
+		r = r * 1103515245 + 12345;
+		obj[i] = bench_object(M, r >> 16);
+	}
+	math_frame(M);
+	// unmark in random order
+	for (i=n-1;i>0;i--) {
+		r = r * 1103515245 + 12345;
+		int k = (r >> 16) % (i + 1);
+		math_t tmp = obj[i];
+		obj[i] = obj[k];
+		obj[k] = tmp;
+	}
+	for (i=0;i<n;i++) {
+		math_unmark(M, obj[i]);
+	}
+	clock_t t = clock();
+	math_frame(M);
+	double us = (double)(clock() - t) / CLOCKS_PER_SEC * 1e6;
+	printf("frame with %6d unmarks : %.0f us, slot %d\n", n, us, math_info(M, MATH_INFO_SLOT));
+	free(obj);
+	math_delete(M);
+}
+
 int
 main() {
 	struct math_context *M = math_new(0);
@@ -1272,7 +3116,41 @@ main() {
 
 	math_print(M, id);
 
+	math_t c[3];
+	c[0] = math_constant(M, math_vec4(M, v));
+	c[1] = math_constant(M, math_import(M, &array[0][0], MATH_TYPE_VEC4, 3));
+	c[2] = math_constant(M, math_import(M, array[1], MATH_TYPE_VEC4, 1));	// inside c[1]
+	assert(math_issame(c[0], math_constant(M, math_vec4(M, v))));
+	assert(math_issame(c[1], math_constant(M, math_import(M, &array[0][0], MATH_TYPE_VEC4, 3))));
+	assert(math_value(M, c[2]) == math_value(M, math_index(M, c[1], 1)));
+	math_t cm = math_constant(M, math_import(M, &stack[0][0], MATH_TYPE_MAT, 2));
+	// a matrix inside an array is shared with it
+	assert(math_value(M, math_constant(M, math_import(M, stack[1], MATH_TYPE_MAT, 1))) == math_value(M, math_index(M, cm, 1)));
+	printf("constant : %d hit %d miss %d\n", math_info(M, MATH_INFO_CONSTANT),
+		math_info(M, MATH_INFO_CONSTANT_HIT), math_info(M, MATH_INFO_CONSTANT_MISS));
+
+	test_large(M);
+
 	math_delete(M);
+
+	assert(test_retention(DEFAULT_TRANSIENT_RETENTION) < test_retention(0));
+	test_allocator();
+	test_shared();
+	test_constant_window();
+	test_compaction();
+	test_compaction_abort();
+	test_overflow();
+	test_profile();
+	test_ref_stride();
+	test_stamp();
+
+	bench_churn(1000);
+	bench_churn(10000);
+	bench_churn(50000);
+
+	bench_frame(1000);
+	bench_frame(10000);
+	bench_frame(100000);
 	return 0;
 }
 
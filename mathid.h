@@ -26,18 +26,48 @@ static const math_t MATH_NULL = { 0 };
 #define MATH_INFO_CONSTANT 5
 #define MATH_INFO_REF 6
 #define MATH_INFO_SLOT 7
+#define MATH_INFO_CONSTANT_HIT 8
+#define MATH_INFO_CONSTANT_MISS 9
+#define MATH_INFO_LARGE 10
+#define MATH_INFO_TRANSIENT_ALLOC 11
+#define MATH_INFO_TRANSIENT_FREE 12
+#define MATH_INFO_TRANSIENT_RETAIN 13
+#define MATH_INFO_MARKED_PAGE 14
+#define MATH_INFO_COMPACT_MOVED 15
+
+// allocator of pages, alloc returns memory aligned to align (64), free gets the same size.
+struct math_allocator {
+	void * (*alloc)(void *ud, size_t size, size_t align);
+	void (*free)(void *ud, void *ptr, size_t size);
+	void *ud;
+};
 
 struct math_context * math_new(int maxpage);
+struct math_context * math_new_ex(int maxpage, const struct math_allocator *alloc);	// alloc == NULL : default allocator
 void math_delete(struct math_context *);
+// After math_publish, the constants of the context are read only (no new constants, include the large ones),
+// and it can be shared by other contexts (in other threads) created by math_new_shared.
+// The transient and marked values of the pool itself are still private to the thread that owns it.
+// The pool must be alive until all the shared contexts are deleted.
+void math_publish(struct math_context *pool);
+struct math_context * math_new_shared(struct math_context *pool, int maxpage);
 int math_info(struct math_context *, int what);
 void math_set_flag(struct math_context *, int flag_id, int v);
 int math_get_flag(struct math_context *, int flag_id);
+void math_set_transient_retention(struct math_context *, int frames);
+// move at most budget vec4 per math_frame to compact the marked pages, 0 : off (default).
+// The ids keep valid, but the pointers from math_value may change after math_frame.
+void math_set_compaction(struct math_context *, int budget);
 size_t math_memsize(struct math_context *);
 void math_frame(struct math_context *);
 int math_checkpoint(struct math_context *);
 void math_recover(struct math_context *, int cp);
 math_t math_import(struct math_context *, const float *v, int type, int size);
 math_t math_ref(struct math_context *, const float *v, int type, int size);
+// A view of external buffer, stride (in bytes, < 16M) between elements, 0 : packed.
+// MATH_REF_VEC3 : elements are float[3] (type must be vec4), read as vec4 with w = 1.
+#define MATH_REF_VEC3 1
+math_t math_ref_stride(struct math_context *, const void *v, int type, int size, int stride, int flags);
 math_t math_premark(struct math_context *, int type, int size);
 math_t math_mark_(struct math_context *, math_t id, const char *filename, int line);
 #define math_mark(M, id) math_mark_(M, id, __FILE__, __LINE__)
@@ -53,15 +83,47 @@ struct math_marked_iter {
 
 int math_marked_next(struct math_context *, struct math_marked_iter *iter);
 
+// Sampling profiler of marked values : record the source of 1 in sample new marked values, 0 : off (and clear)
+struct math_profile_site {
+	const char *filename;
+	int line;
+	int live;	// sampled values alive
+};
+
+void math_profile(struct math_context *, int sample);
+int math_profile_pending(struct math_context *);	// the next new marked value will be recorded
+int math_profile_report(struct math_context *, struct math_profile_site *site, int n);	// returns the number of sites
+
 int math_unmark(struct math_context *, math_t id);
 const float * math_value(struct math_context *, math_t id);
 float *math_init(struct math_context *, math_t id);
+
+// Read the elements in place (without gathering a strided ref) : element i is at (const char *)ptr + stride * i
+struct math_view {
+	const float *ptr;
+	int size;
+	int stride;	// in bytes
+	int vec3;	// only xyz in buffer, w = 1
+};
+
+void math_view(struct math_context *, math_t id, struct math_view *view);
 math_t math_index(struct math_context *, math_t id, int index);
 int math_valid(struct math_context *, math_t id);
 int math_marked(struct math_context *, math_t id);
+// Modification stamps of marked values, off by default. When the tracking is on, a marked value is stamped
+// when it's created (marked) or written by math_init. The values marked before it are not tracked until they are written.
+// math_track(M, 0) turns it off and releases the stamps. The stamp increases every math_frame.
+void math_track(struct math_context *, int enable);
+uint32_t math_stamp(struct math_context *);
+uint32_t math_modified(struct math_context *, math_t id);	// the stamp of the last write, 0 : constant or not tracked
+// iterate the tracked marked ids stamped at or after since, *iter starts from 0. returns 0 at the end
+int math_changed_next(struct math_context *, uint32_t since, int *iter, math_t *id);
 void math_print(struct math_context *, math_t id);	// for debug only
 const char * math_typename(int type);
-math_t math_constant(struct math_context *, math_t);
+// A constant equal to an existing one shares its storage : a whole constant, a vec4 of an array,
+// or a matrix at a matrix-aligned offset of an array. Other parts of an array (e.g. two rows of a matrix,
+// a matrix at an unaligned offset, or a window across two constants) are stored as new constants.
+math_t math_constant(struct math_context *, math_t);	// MATH_NULL if it's not in the read only (shared or published) pool
 math_t math_live(struct math_context *, math_t id);
 void math_refcount(struct math_context *, int delta);
 
@@ -43,6 +43,10 @@ do
 	print(vec2, math3d.tostring(vec))
 
 	assert(vec == vec2)
+	local hit = math3d.info "constant_hit"
+	assert(math3d.constant { type = "v4", 1,2,3,4 } == vec)
+	assert(math3d.info "constant_hit" == hit + 1)
+	print("constant hit/miss", math3d.info "constant_hit", math3d.info "constant_miss")
 
 	local vec = math3d.constant ("v4", { 0,0,0,0 })
 	print(vec, math3d.tostring(vec))
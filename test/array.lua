@@ -42,4 +42,293 @@ do
 		local m = math3d.array_index(mat_array, i)
 		assert(math3d.tostring(math3d.mul(m, m)) == math3d.tostring(math3d.array_index(tmp, i)))
 	end
-end
\ No newline at end of file
+end
+print "==== large array ====="
+do
+	-- larger than a page (2048 vec4)
+	local n = 1000
+	local t = {}
+	for i = 1, n do
+		t[i] = { t = { i, 0, 0 } }
+	end
+	local large = math3d.mark(math3d.array_matrix(t))
+	assert(math3d.array_size(large) == n)
+	local r = math3d.mul_array(math3d.matrix { t = { 0, 1, 0 } }, large)
+	assert(math3d.array_size(r) == n)
+	assert(math3d.tostring(math3d.array_index(r, n)) == math3d.tostring(math3d.matrix { t = { n, 1, 0 } }))
+	print("large", math3d.info "large")
+	math3d.unmark(large)
+end
+print "==== strided ref ====="
+do
+	-- interleaved vertices : position (xyz) + normal (xyz) + uv, 32 bytes
+	local vb = math3d.mark(math3d.array_vector {
+		{ 1, 2, 3, 0 }, { 0, 1, 0.5, 0.5 },
+		{ -1, 5, 0, 0 }, { 0, 1, 0.5, 0.5 },
+		{ 4, -2, 1, 0 }, { 0, 1, 0.5, 0.5 },
+	})
+	local pos = math3d.array_vector_ref(math3d.value_ptr(vb), 3, 32, 0, true)
+	assert(math3d.array_size(pos) == 3)
+	local x, y, z, w = math3d.index(math3d.array_index(pos, 2), 1, 2, 3, 4)
+	assert(x == -1 and y == 5 and z == 0 and w == 1)
+	local aabb = math3d.minmax(pos)
+	assert(math3d.tostring(aabb) == math3d.tostring(math3d.array_vector { { -1, -2, 0, 1 }, { 4, 5, 3, 1 } }))
+	print("minmax", math3d.tostring(aabb))
+	-- normals at byte offset 16
+	local normal = math3d.array_vector_ref(math3d.value_ptr(vb), 3, 32, 16, true)
+	assert(math3d.tostring(math3d.array_index(normal, 3)) == math3d.tostring(math3d.vector(0, 1, 0.5, 1)))
+	math3d.unmark(vb)
+	-- array_matrix_ref (ptr, size, [offset in matrices], [stride], [byte offset])
+	local mats = math3d.array_matrix { { s = 1 }, { s = 2 }, { s = 3 } }
+	local second = math3d.array_matrix_ref(math3d.value_ptr(mats), 1, 1)
+	assert(math3d.tostring(second) == math3d.tostring(math3d.array_index(mats, 2)))
+	local tail = math3d.array_matrix_ref(math3d.value_ptr(mats), 2, 1)
+	assert(math3d.tostring(math3d.array_index(tail, 2)) == math3d.tostring(math3d.array_index(mats, 3)))
+	local byte = math3d.array_matrix_ref(math3d.value_ptr(mats), 1, 0, 0, 64)
+	assert(math3d.tostring(byte) == math3d.tostring(math3d.array_index(mats, 2)))
+	local odd = math3d.array_matrix_ref(math3d.value_ptr(mats), 2, 0, 128)
+	assert(math3d.tostring(math3d.array_index(odd, 2)) == math3d.tostring(math3d.array_index(mats, 3)))
+	assert(not pcall(math3d.array_matrix_ref, math3d.value_ptr(mats), 1, 0, 32))
+end
+print "==== simd mul_array ====="
+do
+	local current, best = math3d.simd()
+	print("simd", current, best)
+	local n = 256
+	local t = {}
+	for i = 1, n do
+		t[i] = { s = i % 3 + 1, r = { axis = { 0, 1, 0 }, r = i * 0.1 }, t = { i, 2, 3 } }
+	end
+	local array = math3d.mark(math3d.array_matrix(t))
+	local result = math3d.mark(math3d.array_matrix(t))
+	local m = math3d.matrix { s = 2, r = { axis = { 1, 0, 0 }, r = 0.5 }, t = { 1, 2, 3 } }
+	math3d.simd "none"
+	local expect = math3d.serialize(math3d.mul_array(m, array))
+	local expect_rev = math3d.serialize(math3d.mul_array(array, m))
+	for i = 1, n do
+		local e = math3d.array_index(array, i)
+		assert(expect:sub(i * 64 - 63, i * 64) == math3d.serialize(math3d.mul(m, e)))
+		assert(expect_rev:sub(i * 64 - 63, i * 64) == math3d.serialize(math3d.mul(e, m)))
+	end
+	local levels = { "none", "sse4.1", "avx2", "avx512" }
+	for _, level in ipairs(levels) do
+		if math3d.simd(level) == level then
+			-- bitwise, the same as math3d.mul
+			assert(math3d.serialize(math3d.mul_array(m, array)) == expect)
+			assert(math3d.serialize(math3d.mul_array(array, m)) == expect_rev)
+			local output = math3d.array_matrix_ref(math3d.value_ptr(result), n)
+			local loop = 200
+			local c = os.clock()
+			for i = 1, loop do
+				math3d.mul_array(array, array, output)
+			end
+			local ti = os.clock() - c
+			print(string.format("%-8s %.0f matrices/s", level, n * loop / math.max(ti, 1e-6)))
+		end
+	end
+	math3d.simd(current)
+	math3d.unmark(array)
+	math3d.unmark(result)
+end
+print "==== srt array ====="
+do
+	local function near(a, b)
+		for i = 1, 4 do
+			if math.abs(math3d.index(a, i) - math3d.index(b, i)) > 1e-4 then
+				return false
+			end
+		end
+		return true
+	end
+	local function equal(a, b)
+		for c = 1, 4 do
+			local ca, cb = math3d.index(a, c), math3d.index(b, c)
+			for i = 1, 4 do
+				if math.abs(math3d.index(ca, i) - math3d.index(cb, i)) > 1e-4 then
+					return false
+				end
+			end
+		end
+		return true
+	end
+	local n = 37
+	local s, r, t = {}, {}, {}
+	for i = 1, n do
+		s[i] = { i % 3 + 1, 1, i % 2 == 0 and -1 or 2 }
+		r[i] = math3d.quaternion { axis = { 1, i, 0 }, r = i * 0.2 }
+		t[i] = { i, -i, 3 }
+	end
+	local current = math3d.simd()
+	for _, level in ipairs { "none", current } do
+		math3d.simd(level)
+		local mats = math3d.make_srt_array(math3d.array_vector(s), math3d.array_quat(r), math3d.array_vector(t))
+		assert(math3d.array_size(mats) == n)
+		for i = 1, n do
+			assert(equal(math3d.array_index(mats, i), math3d.matrix { s = s[i], r = r[i], t = t[i] }))
+		end
+		local ds, dr, dt = math3d.decompose_array(mats)
+		assert(math3d.array_size(ds) == n and math3d.array_size(dr) == n and math3d.array_size(dt) == n)
+		local back = math3d.make_srt_array(ds, dr, dt)
+		for i = 1, n do
+			assert(equal(math3d.array_index(mats, i), math3d.array_index(back, i)))
+		end
+		-- the same as the single value decompose
+		for i = 1, n do
+			local s1, r1, t1 = math3d.srt(math3d.array_index(mats, i))
+			assert(near(s1, math3d.array_index(ds, i)))
+			assert(near(r1, math3d.array_index(dr, i)))
+			assert(near(t1, math3d.array_index(dt, i)))
+		end
+		-- shared scale, no rotation
+		mats = math3d.make_srt_array(math3d.vector(2, 2, 2), nil, math3d.array_vector(t))
+		for i = 1, n do
+			assert(equal(math3d.array_index(mats, i), math3d.matrix { s = 2, t = t[i] }))
+		end
+		-- the output ref is shorter than the arrays
+		local buffer = math3d.array_matrix { {}, {} }
+		local short = math3d.array_matrix_ref(math3d.value_ptr(buffer), 2)
+		assert(not pcall(math3d.make_srt_array, math3d.array_vector(s), nil, nil, short))
+	end
+	math3d.simd(current)
+end
+print "==== blend array ====="
+do
+	local function near(a, b)
+		for i = 1, 4 do
+			if math.abs(math3d.index(a, i) - math3d.index(b, i)) > 1e-5 then
+				return false
+			end
+		end
+		return true
+	end
+	local n = 10
+	local qa, qb, va, vb, w = {}, {}, {}, {}, {}
+	for i = 1, n do
+		qa[i] = math3d.quaternion { axis = { 0, 1, 0 }, r = i * 0.1 }
+		qb[i] = math3d.quaternion { axis = { 1, 0, i }, r = i * 0.3 }
+		va[i] = { i, 0, 0, 1 }
+		vb[i] = { 0, i, 2, 1 }
+		w[i] = i / n
+	end
+	local aq, bq = math3d.array_quat(qa), math3d.array_quat(qb)
+	local av, bv = math3d.array_vector(va), math3d.array_vector(vb)
+	local current = math3d.simd()
+	for _, level in ipairs { "none", current } do
+		math3d.simd(level)
+		local r = math3d.blend_array(aq, bq, w, nil, "slerp")
+		for i = 1, n do
+			assert(near(math3d.array_index(r, i), math3d.slerp(qa[i], qb[i], w[i])))
+		end
+		r = math3d.blend_array(av, bv, string.pack("<f", 0.25))
+		for i = 1, n do
+			assert(near(math3d.array_index(r, i), math3d.lerp(math3d.vector(va[i]), math3d.vector(vb[i]), 0.25)))
+		end
+		r = math3d.blend_array(av, bv, w, nil, "add")
+		for i = 1, n do
+			assert(near(math3d.array_index(r, i), math3d.add(math3d.vector(va[i]), math3d.mul(math3d.vector(vb[i]), w[i]))))
+		end
+		-- nlerp ends at a and b
+		assert(near(math3d.array_index(math3d.blend_array(aq, bq, 0), 3), qa[3]))
+		assert(near(math3d.array_index(math3d.blend_array(aq, bq, 1), 3), qb[3]))
+		-- add a full rotation : a * b
+		r = math3d.blend_array(aq, bq, 1, nil, "add")
+		for i = 1, n do
+			assert(near(math3d.array_index(r, i), math3d.mul(qa[i], qb[i])))
+		end
+		-- in place
+		local buffer = math3d.array_vector(va)
+		local out = math3d.array_vector_ref(math3d.value_ptr(buffer), n)
+		math3d.blend_array(out, bv, w, out)
+		for i = 1, n do
+			assert(near(math3d.array_index(out, i), math3d.lerp(math3d.vector(va[i]), math3d.vector(vb[i]), w[i])))
+		end
+		-- the output ref is shorter than the arrays
+		local short = math3d.array_vector_ref(math3d.value_ptr(buffer), n - 1)
+		assert(not pcall(math3d.blend_array, av, bv, w, short))
+	end
+	math3d.simd(current)
+end
+print "==== skin palette ====="
+do
+	local n = 5
+	local world, invbind = {}, {}
+	for i = 1, n do
+		world[i] = { s = i, r = { axis = { 0, 0, 1 }, r = i * 0.4 }, t = { i, 1, 0 } }
+		invbind[i] = { r = { axis = { 1, 0, 0 }, r = i * -0.2 }, t = { 0, -i, 2 } }
+	end
+	local wa, ba = math3d.array_matrix(world), math3d.array_matrix(invbind)
+	local root = math3d.matrix { t = { 10, 0, 0 } }
+	local function expect(i)
+		return math3d.mul(root, math3d.mul(math3d.array_index(wa, i), math3d.array_index(ba, i)))
+	end
+	-- every simd level keeps the rounding of math3d.mul
+	local function near(a, b)
+		return a == b
+	end
+	local current = math3d.simd()
+	for _, level in ipairs { "none", current } do
+		math3d.simd(level)
+		local palette = math3d.skin_palette(wa, ba, root)
+		assert(math3d.array_size(palette) == n)
+		for i = 1, n do
+			local e, p = expect(i), math3d.array_index(palette, i)
+			for c = 1, 4 do
+				local ec, pc = math3d.index(e, c), math3d.index(p, c)
+				for r = 1, 4 do
+					assert(near(math3d.index(ec, r), math3d.index(pc, r)))
+				end
+			end
+		end
+		-- transposed 3x4 rows
+		local rows = math3d.skin_palette(wa, ba, root, nil, "3x4")
+		assert(#rows == n * 12 * 4)
+		for i = 1, n do
+			local e = expect(i)
+			for c = 1, 4 do
+				local ec = math3d.index(e, c)
+				for r = 1, 3 do
+					local v = string.unpack("<f", rows, ((i - 1) * 12 + (r - 1) * 4 + (c - 1)) * 4 + 1)
+					assert(near(math3d.index(ec, r), v))
+				end
+			end
+		end
+		-- into a vec4 ref
+		local buffer = math3d.array_vector(string.rep("\0", n * 3 * 16))
+		local output = math3d.array_vector_ref(math3d.value_ptr(buffer), n * 3)
+		assert(math3d.skin_palette(wa, ba, root, output) == output)
+		assert(math3d.serialize(buffer) == rows)
+	end
+	math3d.simd(current)
+end
+print "==== gpu export ====="
+do
+	local mats = math3d.array_matrix {
+		{ s = 2, t = { 1, 2, 3 } },
+		{ r = { axis = { 0, 1, 0 }, r = 0.5 }, t = { -1, 0, 4 } },
+		{ s = 0.5 },
+	}
+	local v = math3d.vector(1, 2, 3, 4)
+	local current = math3d.simd()
+	for _, level in ipairs { "none", current } do
+		math3d.simd(level)
+		assert(math3d.export(mats, "mat4") == math3d.serialize(mats))
+		-- transposed 3x4 rows, the same as the skin palette without bind pose
+		local rows = math3d.export(mats, "3x4")
+		assert(#rows == 3 * 12 * 4)
+		local identity = math3d.array_matrix { {}, {}, {} }
+		assert(rows == math3d.skin_palette(mats, identity, nil, nil, "3x4"))
+		-- a matrix is 4 vec4
+		local vec = math3d.export({ mats, v }, "vec4")
+		assert(vec == math3d.serialize(mats) .. math3d.serialize(v))
+		-- half floats
+		local half = math3d.export({ v, math3d.vector(0.5, -65504, 1e9, 1e-8) }, "vec4_half")
+		assert(half == string.pack("<I2I2I2I2I2I2I2I2", 0x3c00, 0x4000, 0x4200, 0x4400, 0x3800, 0xfbff, 0x7c00, 0x0000))
+		-- into a userdata buffer, with offset
+		local buffer = math3d.array_matrix(string.rep("\0", 64 * 4))
+		local ud = math3d.value_ptr(buffer)
+		assert(math3d.export(mats, "mat4", ud, 64) == 64 * 3)
+		assert(math3d.serialize(buffer):sub(65) == math3d.serialize(mats))
+		assert(not pcall(math3d.export, v, "3x4"))
+	end
+	math3d.simd(current)
+end
@@ -223,4 +223,37 @@ do
 	intersectpoints = math3d.frustum_aabb_intersect_points(projmat2, aabb2)
 	print "\t2. intersect results:"
 	tu.print_points(intersectpoints, TWO_TAB)
-end
\ No newline at end of file
+end
+print "===FRUSTUM CULL==="
+do
+	local projmat = math3d.projmat{ortho=true, l=-1, r=1, b=-1, t=1, n=0, f=2}
+	local planes = math3d.frustum_planes(projmat)
+	local list = {}
+	local packed = {}
+	for i = 1, 100 do
+		local x = (i % 10) * 0.5 - 2.5
+		local y = (i // 10) * 0.5 - 2.5
+		local aabb = math3d.aabb(math3d.vector(x, y, 0.5), math3d.vector(x + 0.4, y + 0.4, 1))
+		list[i] = aabb
+		packed[#packed+1] = math3d.serialize(aabb)
+	end
+	local expect = math3d.frustum_intersect_aabb_list(planes, list)
+	local count, index = math3d.frustum_cull(planes, table.concat(packed), nil, "index")
+	assert(count == #expect)
+	for i = 1, count do
+		assert(string.unpack("<I4", index, (i - 1) * 4 + 1) + 1 == expect[i])
+	end
+	local aabbs = math3d.array_vector(table.concat(packed))
+	local count2, mask = math3d.frustum_cull(planes, aabbs)
+	assert(count2 == count and #mask == 16)
+	for _, idx in ipairs(expect) do
+		local i = idx - 1
+		assert(string.unpack("<I4", mask, i // 32 * 4 + 1) & (1 << (i % 32)) ~= 0)
+	end
+	-- strided or odd sized arrays are rejected
+	local padded = math3d.array_vector(table.concat(packed) .. string.rep("\0", 16))
+	assert(not pcall(math3d.frustum_cull, planes, padded))
+	local strided = math3d.array_vector_ref(math3d.value_ptr(aabbs), 100, 32)
+	assert(not pcall(math3d.frustum_cull, planes, strided))
+	print("\tvisible", count, "/", #list)
+end
@@ -87,4 +87,175 @@ do
 	ndf_n, ndf_n_inf, ndf_m, ndf_m_inf, ndf_f, ndf_f_inf= compare_camera(true, 0.1, 20000, true)
 	ndf_n, ndf_n_inf, ndf_m, ndf_m_inf, ndf_f, ndf_f_inf = compare_camera(false, 0.01, 1000, true)
 	ndf_n, ndf_n_inf, ndf_m, ndf_m_inf, ndf_f, ndf_f_inf = compare_camera(true, 0.01, 2000, true)
-end
\ No newline at end of file
+end
+
+print "===TRANSFORM HIERARCHY==="
+do
+	local parent = { 0, 1, 1, 3, 0 }
+	local s = { { 1, 1, 1 }, { 2, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0.5 }, { 3, 3, 3 } }
+	local r = {}
+	local t = {}
+	for i = 1, #parent do
+		r[i] = math3d.quaternion { axis = { 0, 1, 0 }, r = i * 0.3 }
+		t[i] = { i, 0, -i }
+	end
+	local buffer = math3d.array_matrix { {}, {}, {}, {}, {} }
+	local world = math3d.array_matrix_ref(math3d.value_ptr(buffer), #parent)
+	local function check()
+		for i = 1, #parent do
+			local m = math3d.matrix { s = s[i], r = r[i], t = t[i] }
+			if parent[i] > 0 then
+				m = math3d.mul(math3d.array_index(world, parent[i]), m)
+			end
+			local w = math3d.array_index(world, i)
+			if parent[i] == 0 then
+				-- the locals are composed by math3d.matrix { s, r, t } exactly
+				assert(math3d.serialize(m) == math3d.serialize(w))
+			end
+			for c = 1, 4 do
+				local a, b = math3d.index(m, c), math3d.index(w, c)
+				for j = 1, 4 do
+					assert(math.abs(math3d.index(a, j) - math3d.index(b, j)) < 1e-5)
+				end
+			end
+		end
+	end
+	local srt = { s = math3d.array_vector(s), r = math3d.array_quat(r), t = math3d.array_vector(t) }
+	assert(math3d.transform_hierarchy(world, parent, srt) == #parent)
+	check()
+
+	-- only node 3 (0-based 2) and its child are recomputed
+	t[3] = { 0, 5, 0 }
+	srt.t = math3d.array_vector(t)
+	assert(math3d.transform_hierarchy(world, parent, srt, string.pack("<I4", 1 << 2)) == 2)
+	check()
+
+	-- local matrices, parents as int32 (0-based, -1 root)
+	local locals = {}
+	for i = 1, #parent do
+		locals[i] = { s = s[i], r = r[i], t = t[i] }
+	end
+	assert(math3d.transform_hierarchy(world, string.pack("<i4i4i4i4i4", -1, 0, 0, 2, -1), math3d.array_matrix(locals)) == #parent)
+	check()
+end
+
+print "===COMPILED EXPRESSION==="
+do
+	local q = math3d.quaternion { axis = {0, 1, 0}, r = math.rad(30) }
+	local v = math3d.vector(1, 2, 3)
+	local t = math3d.vector(4, 5, 6)
+	local f, n1, n2, n3 = math3d.compile("transform(q, v, 1) + t * 2", "q", "v", "t")
+	assert(n1 == "q" and n2 == "v" and n3 == "t")
+	local expect = math3d.add(math3d.transform(q, v, 1), math3d.mul(t, 2))
+	assert(math3d.serialize(f(q, v, t)) == math3d.serialize(expect))
+
+	-- the names of inputs are in the order of the first appearance
+	local world, a, b = math3d.compile "inverse(parent) * srt(s, r, -pos)"
+	assert(world and a == "parent" and b == "s")
+	local m = math3d.matrix { s = 2, r = q, t = t }
+	local neg = math3d.mul(-1, t)
+	expect = math3d.mul(math3d.inverse(m), math3d.matrix { s = 0.5, r = q, t = neg })
+	assert(math3d.serialize(world(m, 0.5, q, t)) == math3d.serialize(expect))
+
+	-- number results and identity
+	local d = math3d.compile("dot(a, b) * 2 + length(a, b)", "a", "b")
+	assert(d(v, t) == math3d.dot(v, t) * 2 + math3d.length(v, t))
+	local id = math3d.compile("m * srt(1, r, 0 * t)", "m", "r", "t")
+	assert(math3d.isequal(id(math3d.matrix(), math3d.quaternion(), t), math3d.matrix()))
+
+	assert(not pcall(math3d.compile, "v +"))
+	assert(not pcall(math3d.compile, "foo(v)"))
+	-- the nesting depth is limited, instead of overflowing the C stack
+	assert(not pcall(math3d.compile, string.rep("(", 10000000) .. "v"))
+	assert(not pcall(math3d.compile, string.rep("-", 100000) .. "v"))
+	assert(math3d.compile(string.rep("(", 32) .. "v" .. string.rep(")", 32)))
+	assert(not pcall(f, v, q, t))
+end
+
+print "===COMMAND BUFFER==="
+do
+	local q = math3d.quaternion { axis = {0, 1, 0}, r = math.rad(30) }
+	local v = math3d.vector(1, 2, 3)
+	local t = math3d.ref(math3d.vector(4, 5, 6))
+	local cb = math3d.command_buffer()
+	local m = math3d.command(cb, "srt", math3d.vector(2, 2, 2), q, t)
+	local p = math3d.command(cb, "transform", m, v)
+	local inv = math3d.command(cb, "inverse", m)
+	local pos = math3d.command(cb, "input")
+	local back = math3d.command(cb, "transformH", inv, math3d.command(cb, "add", p, pos))
+
+	local function check()
+		local em = math3d.matrix { s = 2, r = q, t = t }
+		local ep = math3d.transform(em, v, nil)
+		local rm, rp = math3d.command_execute(cb, m, p)
+		assert(math3d.serialize(rm) == math3d.serialize(em))
+		assert(math3d.serialize(rp) == math3d.serialize(ep))
+		local eback = math3d.transformH(math3d.inverse(em), math3d.add(ep, v))
+		assert(math3d.serialize(math3d.command_execute(cb, back)) == math3d.serialize(eback))
+	end
+	assert(not pcall(math3d.command_execute, cb))	-- pos is unbound
+	math3d.command_bind(cb, pos, v)
+	check()
+	-- only input registers can be bound
+	assert(not pcall(math3d.command_bind, cb, p, v))
+	-- ref inputs are read at execute time
+	t.v = math3d.vector(7, 8, 9)
+	check()
+
+	math3d.command_reset(cb)
+	local bad = math3d.command(cb, "mul", v, q)
+	assert(not pcall(math3d.command_execute, cb))
+	assert(not pcall(math3d.command, cb, "mul", bad + 1, v))
+	assert(not pcall(math3d.command, cb, "unknown", v))
+	-- other userdata are not command buffers
+	assert(not pcall(math3d.command_execute, t))
+end
+
+print "===COMPUTED REF==="
+do
+	local parent = math3d.ref(math3d.matrix { t = {1, 2, 3} })
+	local s = math3d.ref(math3d.vector(2, 2, 2))
+	local r = math3d.ref(math3d.quaternion { axis = {0, 0, 1}, r = math.rad(45) })
+	local t = math3d.mark(math3d.vector(0, 1, 0))
+	local world = math3d.computed("parent * srt(s, r, t)", { parent = parent, s = s, r = r, t = t })
+	local proj = math3d.ref(math3d.projmat { fov = 60, aspect = 1, n = 1, f = 100 })
+	local view = math3d.computed("inverse(world)", { world = world })
+	local vp = math3d.computed("proj * view", { proj = proj, view = view })
+
+	local function check()
+		local w = math3d.mul(parent, math3d.matrix { s = s, r = r, t = t })
+		assert(math3d.serialize(world) == math3d.serialize(w))
+		assert(math3d.serialize(vp) == math3d.serialize(math3d.mul(proj, math3d.inverse(w))))
+	end
+	check()
+	-- not changed, no recompute
+	local id = vp.i
+	assert(vp.i == id and world.i == world.i)
+	-- the change of an input ref propagates on read
+	r.q = { axis = {0, 1, 0}, r = math.rad(30) }
+	check()
+	assert(vp.i ~= id)
+	id = vp.i
+	proj.m = math3d.projmat { fov = 90, aspect = 1, n = 1, f = 100 }
+	check()
+	assert(vp.i ~= id)
+
+	assert(not pcall(function() world.m = math3d.matrix() end))
+	assert(not pcall(math3d.computed, "a * b", { a = parent }))
+	assert(not pcall(math3d.computed, "a * b", { a = parent, b = math3d.matrix() }))	-- transient id
+	-- world holds its own mark of t
+	math3d.unmark(t)
+	r.q = { axis = {1, 0, 0}, r = math.rad(60) }
+	check()
+
+	-- a failed evaluation is not cached, the next read fails again
+	local a = math3d.ref(math3d.vector(1, 2, 3))
+	local b = math3d.ref(math3d.vector(1, 1, 1))
+	local sum = math3d.computed("a + b", { a = a, b = b })
+	assert(math3d.serialize(sum) == math3d.serialize(math3d.vector(2, 3, 4)))
+	b.q = math3d.quaternion()
+	assert(not pcall(math3d.serialize, sum))
+	assert(not pcall(math3d.serialize, sum))
+	b.v = math3d.vector(0, 0, 1)
+	assert(math3d.serialize(sum) == math3d.serialize(math3d.vector(1, 2, 4)))
+end
@@ -131,4 +131,143 @@ do
 	local t1, pt1 = math3d.triangles_ray(r1.o, r1.d, tb1, #triangles // 3, true)
 
 	assert(t1 ~= nil and math3d.isequal(pt1, math3d.vector(0, 0, -1)))
-end
\ No newline at end of file
+end
+print "===RAY INTERSET WITH BVH==="
+do
+	local G = 100
+	local function h(x, z)
+		return math.sin(x * 0.1) * math.cos(z * 0.13) * 3
+	end
+	local t = {}
+	for x = 0, G-1 do
+		for z = 0, G-1 do
+			t[#t+1] = ('fffffffff'):pack(x, h(x,z), z, x, h(x,z+1), z+1, x+1, h(x+1,z), z)
+			t[#t+1] = ('fffffffff'):pack(x+1, h(x+1,z), z, x, h(x,z+1), z+1, x+1, h(x+1,z+1), z+1)
+		end
+	end
+	local tb = table.concat(t)
+	local numtri = #t
+	local c = os.clock()
+	local bvh = math3d.triangles_bvh(tb, numtri)
+	print(("\tbuild bvh of %d triangles : %.2f ms, %d bytes"):format(numtri, (os.clock() - c) * 1000, #bvh))
+	assert(math3d.bvh_check(bvh) == "triangles")
+	-- the last one of the original indices is out of range
+	assert(math3d.bvh_check(bvh:sub(1, -5) .. ("I4"):pack(numtri)) == nil)
+	assert(math3d.bvh_check(bvh:sub(1, -2)) == nil)
+
+	local rays = {}
+	for i = 1, 100 do
+		rays[i] = {
+			o = math3d.mark(math3d.vector(math.random() * G, 20, math.random() * G)),
+			d = math3d.mark(math3d.vector(math.random() - 0.5, -1, math.random() - 0.5)),
+		}
+	end
+	local linear = {}
+	c = os.clock()
+	for i, r in ipairs(rays) do
+		linear[i] = math3d.triangles_ray(r.o, r.d, tb, numtri) or false
+	end
+	local linear_time = os.clock() - c
+	c = os.clock()
+	for _, r in ipairs(rays) do
+		math3d.bvh_ray(r.o, r.d, bvh)
+	end
+	local bvh_time = os.clock() - c
+
+	-- packet rays, shared origin
+	local origin = rays[1].o
+	local dirs = {}
+	for i, r in ipairs(rays) do
+		dirs[i] = r.d
+	end
+	c = os.clock()
+	local hits, result = math3d.rays_bvh(origin, dirs, bvh)
+	local packet_time = os.clock() - c
+	local brute_hits, brute_result = math3d.rays_triangles(origin, dirs, tb, numtri)
+	local packet_hits = 0
+	for i, d in ipairs(dirs) do
+		local t = ("f"):unpack(result, (i - 1) * 12 + 1)
+		local tt = math3d.bvh_ray(origin, d, bvh)
+		if tt then
+			packet_hits = packet_hits + 1
+			-- the packets take the same steps as a single ray
+			assert(t == tt)
+		else
+			assert(t < 0)
+		end
+		assert(t == ("f"):unpack(brute_result, (i - 1) * 12 + 1))
+	end
+	assert(hits == packet_hits)
+	assert(brute_hits == hits)
+	for i, r in ipairs(rays) do
+		local t, pt, idx = math3d.bvh_ray(r.o, r.d, bvh, true)
+		assert((t or false) == linear[i])
+		if t then
+			assert(math3d.isequal(pt, math3d.muladd(r.d, t, r.o)))
+			local tri = tb:sub((idx - 1) * 36 + 1, idx * 36)
+			local tt = math3d.triangles_ray(r.o, r.d, tri, 1)
+			assert(tt == t)
+			-- any hit
+			assert(math3d.bvh_ray(r.o, r.d, bvh, false, true))
+		end
+	end
+	print(("\t%d rays : linear %.3f ms, bvh %.3f ms, packet %.3f ms"):format(#rays, linear_time * 1000, bvh_time * 1000, packet_time * 1000))
+	for _, r in ipairs(rays) do
+		math3d.unmark(r.o)
+		math3d.unmark(r.d)
+	end
+end
+
+print "===RAY INTERSET WITH INDEXED MESH==="
+do
+	local G = 32
+	local vb = {}
+	for x = 0, G do
+		for z = 0, G do
+			-- position + uv, 20 bytes per vertex
+			vb[#vb+1] = ('fffff'):pack(x, math.sin(x * 0.3) * math.cos(z * 0.2), z, x / G, z / G)
+		end
+	end
+	local function vid(x, z)
+		return x * (G + 1) + z
+	end
+	local ib16, ib32, tris = {}, {}, {}
+	for x = 0, G-1 do
+		for z = 0, G-1 do
+			for _, id in ipairs { vid(x,z), vid(x,z+1), vid(x+1,z), vid(x+1,z), vid(x,z+1), vid(x+1,z+1) } do
+				ib16[#ib16+1] = ('I2'):pack(id)
+				ib32[#ib32+1] = ('I4'):pack(id)
+				tris[#tris+1] = vb[id + 1]:sub(1, 12)
+			end
+		end
+	end
+	vb = table.concat(vb)
+	local mesh16 = { vb = vb, stride = 20, ib = table.concat(ib16) }
+	local mesh32 = { vb = vb, stride = 20, ib = table.concat(ib32), index_size = 4 }
+	tris = table.concat(tris)
+	local numtri = #tris // 36
+	local bvh = math3d.mesh_bvh(mesh16)
+	assert(math3d.bvh_check(bvh) == "mesh")
+	print(("\tmesh bvh of %d triangles : %d bytes (expanded : %d bytes)"):format(numtri, #bvh, #math3d.triangles_bvh(tris, numtri)))
+	for _ = 1, 50 do
+		local o = math3d.vector(math.random() * G, 5, math.random() * G)
+		local d = math3d.vector(math.random() - 0.5, -1, math.random() - 0.5)
+		local t = math3d.triangles_ray(o, d, tris, numtri)
+		local t1, idx1 = math3d.mesh_ray(o, d, mesh16)
+		local t2, idx2 = math3d.mesh_ray(o, d, mesh32, bvh)
+		assert(t == t1 and t == t2)
+		assert(idx1 == idx2)
+		if t then
+			assert(math3d.mesh_ray(o, d, mesh32, bvh, false, true))
+			assert(math3d.mesh_ray(o, d, mesh32, nil, false, true))
+		end
+	end
+	-- more triangles than the index buffer holds
+	assert(not pcall(math3d.mesh_ray, math3d.vector(0, 5, 0), math3d.vector(0, -1, 0), { vb = vb, stride = 20, ib = mesh16.ib, n = numtri + 1 }))
+	-- the index of a vertex out of range
+	local badib = mesh16.ib:sub(1, -3) .. ("I2"):pack((G + 1) * (G + 1))
+	assert(not pcall(math3d.mesh_bvh, { vb = vb, stride = 20, ib = badib }))
+	assert(not pcall(math3d.mesh_ray, math3d.vector(0, 5, 0), math3d.vector(0, -1, 0), { vb = vb, stride = 20, ib = badib }))
+	-- the bvh is built from another mesh
+	assert(not pcall(math3d.mesh_ray, math3d.vector(0, 5, 0), math3d.vector(0, -1, 0), { vb = vb, stride = 20, ib = mesh16.ib, n = numtri - 1 }, bvh))
+end
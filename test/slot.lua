@@ -25,4 +25,62 @@ do
 	print(math3d.tostring(math3d.vector(0,0,0)))
 end
 
-print("SLOT = ", math3d.info "slot")
\ No newline at end of file
+print("SLOT = ", math3d.info "slot")
+print "===PROFILE TEST==="
+do
+	math3d.profile(1)
+	local base = math3d.profile_report()
+	local m = {}
+	for i = 1, 10 do
+		m[i] = math3d.mark(math3d.vector(i, 0, 0))
+	end
+	local diff = math3d.profile_report(base)
+	for site, live in pairs(diff) do
+		print(site, live)
+		assert(live == 10)
+	end
+	for i = 1, 10 do
+		math3d.unmark(m[i])
+	end
+	math3d.reset()
+	assert(next(math3d.profile_report(base)) == nil)
+	math3d.profile(0)
+end
+
+print "===STAMP TEST==="
+do
+	-- not tracked by default
+	local untracked = math3d.ref(math3d.vector(1, 2, 3))
+	assert(math3d.modified(untracked) == 0)
+	math3d.track(true)
+	local a = math3d.ref(math3d.matrix { t = {1, 2, 3} })
+	local b = math3d.ref(math3d.vector(1, 2, 3))
+	math3d.reset()
+	local since = math3d.stamp()
+	assert(math3d.modified(a) < since and math3d.modified(b) < since)
+	local changed, n = math3d.changed(since)
+	assert(n == 0 and #changed == 0)
+
+	-- a new value is a changed id
+	a.m = { t = {4, 5, 6} }
+	assert(math3d.modified(a) == since)
+	changed, n = math3d.changed(since, changed)
+	assert(n == 1 and changed[1] == a.i)
+
+	-- write in place
+	local p = b.p
+	assert(math3d.modified(b) == since)
+	changed, n = math3d.changed(since, changed)
+	assert(n == 2)
+	local set = { [changed[1]] = true, [changed[2]] = true }
+	assert(set[a.i] and set[b.i])
+
+	math3d.reset()
+	changed, n = math3d.changed(math3d.stamp(), changed)
+	assert(n == 0 and changed[1] == nil)
+	assert(math3d.modified(math3d.vector(1, 2, 3)) == math3d.stamp())	-- transient
+	math3d.track(false)
+	assert(math3d.modified(a) == 0)
+	changed, n = math3d.changed(0, changed)
+	assert(n == 0)
+end